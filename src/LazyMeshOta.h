@@ -17,6 +17,20 @@
 #include <wifi_raw.h>  // https://github.com/shkoo/esp8266_wifi_raw
 #endif
 
+#include "LazyMeshOtaAdvertCache.h"
+#include "LazyMeshOtaAggregate.h"
+#include "LazyMeshOtaAirtime.h"
+#include "LazyMeshOtaCapture.h"
+#include "LazyMeshOtaCensus.h"
+#include "LazyMeshOtaClock.h"
+#include "LazyMeshOtaImage.h"
+#include "LazyMeshOtaLatency.h"
+#include "LazyMeshOtaManifest.h"
+#include "LazyMeshOtaMemory.h"
+#include "LazyMeshOtaPrebuilt.h"
+#include "LazyMeshOtaTrace.h"
+#include "LazyMeshOtaTransport.h"
+
 // LazyMeshOta propagates a new version of firmware automatically when
 // any node comes into wifi range of a node with a higher version.
 //
@@ -32,8 +46,197 @@
 // it remembers where it came from.  Next time it would advertise, it
 // instead will start the upgrade process.
 
-class LazyMeshOta {
+// Compile-time tuning of the protocol.  The default matches the
+// behavior of previous releases; to tune a product, derive from it and
+// shadow whichever constants need to change, e.g.:
+//
+//   struct MyConfig : LazyMeshOtaConfig {
+//     static constexpr uint16_t bufferSize = 1400;
+//   };
+//   BasicLazyMeshOta<MyConfig> lmo;
+//
+// Instantiating BasicLazyMeshOta with a custom config requires
+// including LazyMeshOtaImpl.h in one translation unit.
+struct LazyMeshOtaConfig {
+#if defined(EPOXY_DUINO)
+  static constexpr uint32_t advertiseInterval = 1000;
+  static constexpr uint32_t receiveTimeoutInterval = 456;
+  static constexpr uint16_t bufferSize = 4;  // Number of bytes to transfer per packet.
+  static constexpr uint32_t relayAdvertiseInterval = 100;
+#else
+  static constexpr uint32_t advertiseInterval = 30000;
+  static constexpr uint32_t receiveTimeoutInterval = 10000;
+  static constexpr uint16_t bufferSize = 1024;  // Number of bytes to transfer per packet.
+  static constexpr uint32_t relayAdvertiseInterval = 1000;
+#endif
+  static constexpr uint16_t maxRetries = 10;  // Number of times to try a block before giving up.
+
+  // 0 = no trace, 1 = single chars, 2 = trace some, 3 = verbose trace
+  static constexpr int tracePackets = 0;
+
+  // If true, advertise the root of a hash tree over our sketch and
+  // verify each received block against it.  This lets blocks come from
+  // any neighbor advertising the same root.
+  static constexpr bool useManifest = false;
+  // Number of children of each interior node of the hash tree.
+  static constexpr uint16_t manifestFanout = 16;
+  // Deepest hash tree we can receive; bounds memory used while updating.
+  static constexpr uint8_t manifestMaxDepth = 4;
+
+  // Forward error correction.  If fecParityBlocks is nonzero, receivers
+  // request groups of up to fecDataBlocks blocks at once, and the
+  // sender follows them with fecParityBlocks XOR parity blocks.  Parity
+  // block j covers the data blocks whose index in the group is j modulo
+  // fecParityBlocks, so a receiver can rebuild one lost block per parity
+  // block without another round trip.  The redundancy is
+  // fecParityBlocks / fecDataBlocks.
+  static constexpr uint8_t fecDataBlocks = 8;
+  static constexpr uint8_t fecParityBlocks = 0;
+
+  // Number of events kept in the binary trace ring.  Tracing is off
+  // until enabled with setTraceEnabled.
+  static constexpr size_t traceRingSize = 16;
+
+  // The md5 of the running sketch is computed after begin returns, this
+  // many bytes per loop, so hashing a large sketch doesn't hold up
+  // booting.  We don't advertise until it's done.
+  static constexpr uint32_t md5SliceSize = 4096;
+  // Offset, in 4 byte words, of RTC user memory to cache the md5 in so
+  // warm reboots don't need to hash the sketch again.  The cache takes
+  // md5CacheWords words.  -1 disables the cache; enable it only if the
+  // sketch doesn't use that part of RTC user memory itself.
+  static constexpr int md5CacheRtcOffset = -1;
+
+  // Streaming.  If streamWindow is nonzero, a receiver asks a source
+  // advertising "stream" to send the rest of the image on its own, one
+  // REPLY every streamPacing microseconds and at most streamBurst per
+  // loop, instead of sending a REQ for each block.  The receiver keeps
+  // up to streamWindow blocks which arrive after a lost one, and
+  // reports losses at most every streamNackInterval ms with a
+  // STREAM_REQ carrying a bitmap of missing blocks; the source resends
+  // only those.  The source stops once everything has been sent, or
+  // after receiveTimeoutInterval without a STREAM_REQ, so receivers
+  // send one at least every half of that.  A source streams to one
+  // receiver at a time; others are ignored until it's done or quiet.
+  // Not used together with a manifest or forward error correction.
+  static constexpr uint8_t streamWindow = 0;
+  static constexpr uint8_t streamBurst = 4;
+  static constexpr uint32_t streamPacing = 2000;
+  static constexpr uint32_t streamNackInterval = 20;
+
+  // Cut-through relaying.  If true, a node which is downloading an
+  // update advertises the new version along with how much of it has
+  // reached flash, and serves that part to its neighbors with plain
+  // REQs, so an update pipelines down a chain of nodes instead of
+  // moving one whole image per hop.  Growth is advertised at most every
+  // relayAdvertiseInterval ms.  Needs useManifest: only updates with a
+  // hash tree are relayed, so every block passed on has been checked,
+  // and the tree's root is passed on for the next hop to check against.
+  static constexpr bool relayPartial = false;
+
+  // Airtime limit.  If airtimeBytesPerSecond is nonzero, every frame
+  // sent is charged against a token bucket refilled at that rate which
+  // holds up to airtimeBurstBytes.  Image data waits in a queue of up to
+  // airtimeQueueFrames frames while the bucket is low, and always leaves
+  // airtimeControlReserve bytes for advertisements and requests.  Those
+  // are dropped rather than queued if even the reserve is used up, since
+  // they're retried anyway.  Requests aren't answered while the queue
+  // couldn't take the whole reply, so it has to hold a full FEC group;
+  // image data that still finds it full is dropped and counted in
+  // airtimeStats().droppedFrames.
+  static constexpr uint32_t airtimeBytesPerSecond = 0;
+  static constexpr uint32_t airtimeBurstBytes = 4096;
+  static constexpr uint32_t airtimeControlReserve = 512;
+  static constexpr uint8_t airtimeQueueFrames = 16;
+
+  // If true, time the receive path, flash reads, updater writes, sends
+  // and request round trips into histograms read with latency().
+  static constexpr bool latencyHistograms = false;
+
+  // Version collection.  If versionCollectWindow is nonzero, a node
+  // which hears of a newer version waits that many ms before
+  // downloading, and then takes the newest version offered meanwhile.
+  // Advertisements also carry the newest version heard of nearby in the
+  // last versionDigestTimeout ms; a node whose best offer is older than
+  // that waits one more window for the newer one to reach it.  This
+  // saves downloading an image which is about to be superseded.
+  static constexpr uint32_t versionCollectWindow = 0;
+  static constexpr uint32_t versionDigestTimeout = advertiseInterval * 3;
+
+  // Advertisement cache.  If advertCacheSize is nonzero, the last
+  // advertisement from up to that many neighbors is remembered by a
+  // hash of its bytes, and a repeat of one which needed nothing from us
+  // is dropped before parsing for up to advertCacheTimeout ms.  Then
+  // onNeighborSeen is also called at most every neighborSeenInterval ms
+  // for each neighbor and version.
+  static constexpr uint8_t advertCacheSize = 0;
+  static constexpr uint32_t advertCacheTimeout = advertiseInterval * 10;
+  static constexpr uint32_t neighborSeenInterval = advertiseInterval * 10;
+
+  // Block sharing.  If true, along with useManifest, each node indexes
+  // the blocks of its own sketch by hash, advertises "blocks <block
+  // size>", and answers BLOCK_REQ for any block whose bytes match, even
+  // from nodes running other sketches.  A node downloading an update
+  // notes up to maxBlockSources neighbors running anything else as
+  // block sources, and asks them in turn when its source stops
+  // answering.  The index takes 8 bytes per block.
+  static constexpr bool shareBlocks = false;
+  static constexpr uint8_t maxBlockSources = 4;
+
+  // Frame aggregation.  If aggregateWindow is nonzero, messages sent
+  // within that many us of each other share one AGGREGATE frame, up to
+  // maxRawFrameLength, even if they're for different neighbors.  Each
+  // costs 9 bytes instead of a frame header and a transmission of its
+  // own.
+  static constexpr uint32_t aggregateWindow = 0;
+
+  // Fleet census.  If censusVersions is nonzero, nodes estimate how
+  // many of them have run each of the newest censusVersions versions of
+  // their sketch, with a HyperLogLog sketch of censusRegisters registers
+  // per version, good to about 1.04 / sqrt(censusRegisters).  Each node
+  // counts itself, advertises its sketches as "census" fields, and
+  // merges those it hears.  A node running the newest version, which
+  // every node counted also runs, and which hasn't heard an older
+  // version advertised for convergedQuietTime ms, considers the rollout
+  // converged and advertises every convergedAdvertiseInterval ms
+  // instead of every advertiseInterval.
+  static constexpr uint8_t censusVersions = 0;
+  static constexpr uint8_t censusRegisters = 16;
+  static constexpr uint32_t convergedQuietTime = advertiseInterval * 5;
+  static constexpr uint32_t convergedAdvertiseInterval = advertiseInterval * 4;
+
+  // Memory accounting.  If memoryAccounting is true, the deepest stack
+  // and most heap used by begin(), each loop and each received frame
+  // are kept per entry point and read with memoryUsage().  A call which
+  // goes over memoryStackBudget or memoryHeapBudget bytes, if nonzero,
+  // is reported with onError.  On the host, include
+  // LazyMeshOtaMemoryHooks.h in one file of the program to count heap
+  // use; on the ESP only heap still in use on return is seen.
+  static constexpr bool memoryAccounting = false;
+  static constexpr uint32_t memoryStackBudget = 0;
+  static constexpr uint32_t memoryHeapBudget = 0;
+
+  // Rendezvous, for battery powered nodes.  If rendezvousPeriod is
+  // nonzero, the radio is only on for the first rendezvousWindow ms of
+  // every rendezvousPeriod ms, and advertisements wait for a window.
+  // Nodes follow the schedule of the lowest addressed node they've
+  // heard of, carried in advertisements as "rendezvous <ms into the
+  // period> <address>".  After begin, and then every
+  // rendezvousScanPeriods periods, a node listens for a whole period
+  // and an advertisement interval to find neighbors on other
+  // schedules.  The radio stays on while updating, or while a neighbor
+  // has asked us for blocks in the last receiveTimeoutInterval ms, so a
+  // transfer started in a window runs to the end.
+  static constexpr uint32_t rendezvousPeriod = 0;
+  static constexpr uint32_t rendezvousWindow = advertiseInterval / 10;
+  static constexpr uint16_t rendezvousScanPeriods = 16;
+};
+
+// Parts of LazyMeshOta which don't depend on the configuration.
+class LazyMeshOtaBase {
  public:
+  virtual ~LazyMeshOtaBase() = default;
+
   class Listener {
    public:
     virtual void onNeighborSeen(eth_addr src, String sketchName, int version, String md5);
@@ -46,54 +249,172 @@ class LazyMeshOta {
     virtual void onError(String err);
   };
 
-  LazyMeshOta() = default;
-  ~LazyMeshOta() { end(); }
-
-  // 'version' is the version number of the current software.  Any
-  // peer nodes with lower version numbers and the same sketchName
-  // will be upgraded.
-  void begin(String sketchName, int version);
-
-  void setListener(Listener* l) { _listener = l; }
+  // Passes calls on to another listener, and describes each one to
+  // onState.  Used to record and check state transitions in captures.
+  class StateListener : public Listener {
+   public:
+    void onNeighborSeen(eth_addr src, String sketchName, int version, String md5) override;
+    void onStartUpgrade(eth_addr src, int version, String md5) override;
+    void onDoneUpgrade() override;
+    void onSendProgress(eth_addr src, size_t start, size_t len, size_t tot_size) override;
+    void onRequestChunk(size_t start, size_t tot_size) override;
+    void onReceiveTimeout() override;
+    void onError(String err) override;
 
-  void end();
-  void register_wifi_cb() {
-    assert(!_instance);
-    _instance = this;
-    wifi_raw_set_recv_cb(onReceiveRawFrameCallback);
-  }
-  // Receives a raw frame directly from the network stack, likely in an interrupt context.
-  static void onReceiveRawFrameCallback(RxPacket*) IRAM_ATTR;
+    virtual void onState(CaptureState state, const String& description) = 0;
 
-  // Receives a raw frame.  Must free frame when done.
-  bool onReceiveRawFrame(RxPacket* pkt);
+    Listener* next = nullptr;
+  };
 
   // Convert ethernet address to string.
   static String ethToString(const eth_addr& addr);
   // Convert string to ethernet address.  Return true on success.
   static bool ethFromString(eth_addr* out, String src);
 
-#if defined(EPOXY_DUINO)
-  void loop() { _loop(); }
-#endif
+  // Convert manifest hash to hex string.
+  static String hashToString(const uint8_t* hash);
+  // Convert hex string to manifest hash.  Return true on success.
+  static bool hashFromString(uint8_t* out, String src);
+  // Short id of the image with the given hex md5, which requests carry
+  // so a node that starts serving another image drops them.
+  static String imageId(const String& md5);
 
- private:
+  // Write a pcap file header for 802.11 frames.
+  static void writePcapHeader(Print& out);
+  // Write a trace event as a pcap record.  Only the headers are
+  // available, so the frame is truncated after them.
+  static void writePcapRecord(Print& out, const TraceEvent& ev);
+
+  // Size of the md5 cache in RTC user memory, in 4 byte words.
+  static constexpr size_t md5CacheWords = 8;
+
+  // Receive frames from the raw wifi callback.  Several instances may
+  // register, with any configuration; each frame goes to the instance
+  // it's addressed to, or to all of them if it's not addressed to any.
+  void register_wifi_cb();
+  // Receives a raw frame directly from the network stack, likely in an interrupt context.
+  static void onReceiveRawFrameCallback(RxPacket*) IRAM_ATTR;
+
+  // Number of instances which can receive frames through register_wifi_cb.
+  static constexpr size_t maxWifiInstances = 4;
+
+  // Largest frame we hand to the transport.  Received frame
+  // lengths are additionally limited by the 12 bit legacy_length.
+  static constexpr size_t maxRawFrameLength = 1500;
+
+ protected:
   enum class PKT_TYPE : uint8_t {
     // Advertise current version as "<sketchName>\n<version>\n<sketchsize>\n<md5dum>\n<src
     // bssid>\n".
     // Replies are expected to be sent with the given soure bssid.
+    // This is followed by optional fields, one per line, which are ignored
+    // if not understood:
+    //   "manifest <root> <block size> <fanout>" if the sender has a hash
+    //       tree over its sketch.
+    //   "fec <block size> <data blocks> <parity blocks>" if the sender
+    //       answers GROUP_REQ.
+    //   "stream <block size>" if the sender answers STREAM_REQ.
+    //   "partial <bytes>" if the sender is still downloading the
+    //       advertised version, and can only serve the given prefix.
+    //       The prefix has been checked against the "manifest" sent
+    //       along, and the sender answers HASH_REQ for it.
+    //   "newest <version> <md5> <age>" if the sender heard of a newer
+    //       version than it advertises, age ms ago.
+    //   "blocks <block size>" if the sender answers BLOCK_REQ for blocks
+    //       of its running sketch.
+    //   "census <version> <registers>", and "census older <registers>"
+    //       for versions it has forgotten, with a HyperLogLog sketch of
+    //       the nodes running that version as a hex digit per register.
     ADVERTISE,
 
     // Request sketch data, starting at the the given integer, passed as a string "<src
-    // bssid>\n<start>\n".
+    // bssid>\n<image>\n<start>\n".
     // Replies are expected to be sent with the given source bssid.
+    // Image is imageId() of the advertised md5; requests for any other
+    // image than the one being served are dropped, as for all requests
+    // below which carry it.
     REQ,
 
     // Provide sketch data from a request.  Provides "<start>\n<binary data>"
-    REPLY
+    REPLY,
+
+    // Request the hashes of the children of a node in the hash tree, as
+    // "<src bssid>\n<image>\n<level>\n<index>\n".
+    HASH_REQ,
+
+    // Provide the children requested by HASH_REQ, as
+    // "<level>\n<index>\n<binary hashes>".
+    HASH_REPLY,
+
+    // Request a group of blocks starting at the given offset, as "<src
+    // bssid>\n<image>\n<start>\n<mask>\n".  Each block whose bit is set in mask is
+    // sent as a REPLY, followed by all PARITY blocks of the group.
+    GROUP_REQ,
+
+    // Provide a parity block of a group, as "<start>\n<index>\n<binary data>".
+    PARITY,
+
+    // Ask for the image to be streamed, as
+    // "<src bssid>\n<image>\n<start>\n<mask>\n<resume>\n".
+    // The receiver has everything before start.  Each block from start
+    // whose bit is set in mask is resent as a REPLY, then the source
+    // sends REPLYs for consecutive blocks on its own, carrying on from
+    // where it was or from resume, whichever is earlier.
+    STREAM_REQ,
+
+    // Request a block by content, as "<src bssid>\n<start>\n<hex md5>\n".
+    // If any block of the receiver's running sketch has that md5, it's
+    // sent as a REPLY for the requester's start offset; otherwise
+    // there's no answer.
+    BLOCK_REQ,
+
+    // Several of the above, each as "<dest><len><type><body>" where dest
+    // is 6 bytes, len is 2 bytes little endian, and type is 1 byte.
+    // Receivers handle those addressed to them or to broadcast.  The
+    // frame itself goes to broadcast unless all share a destination.
+    AGGREGATE
+  };
+
+  struct hdr_t {
+    // 802.11 fields:
+
+    // Bit order is weird here; ISO defines it in terms of bits, but we
+    // read bytes big endian.  So what ISO calls bit 0 is our bit 7.
+    //
+    // Here are our bits in on-the-wire order:
+    // 00 - Protocol version
+    // 10 - Type = data
+    // 0000 - Subtype = plain old data
+    // 00 - fromds, tods = station-to-station
+    // 0 - more fragments bit, not set
+    // 0 - retry, not set
+    // 0 - power management, not set
+    // 0 - more data, not set
+    // 0 - protected frame, not set
+    // 0 - HTC/order, not set
+    uint8_t frame_control1 = 0b00001000;
+    uint8_t frame_control2 = 0b00000000;
+
+    uint16_t duration = 0;
+    eth_addr dest;
+    eth_addr src;
+    eth_addr bssid;
+    uint16_t seq = 0;
+
+    // 802.2 LLC PDU fields.  Not needed for us to understand ourself,
+    // but useful for tcpdump output.
+    static constexpr uint8_t LMO_ETH_SAP_ID = 0x31;
+    uint8_t dsap = LMO_ETH_SAP_ID;
+    uint8_t ssap = LMO_ETH_SAP_ID;
+    uint16_t llc_pdu_ctrl = 0;
+
+    // Our protocol data:
+    uint16_t len = 0;
+    PKT_TYPE packetType;
   };
 
-  struct hdr_t;
+  // Maximum number of characters used to print a 32 bit offset.
+  static constexpr size_t maxOffsetDigits = 10;
 
   struct update_t {
     // Information on a new version available
@@ -105,7 +426,58 @@ class LazyMeshOta {
     uint32_t size = 0;
 
     uint32_t retryCount = 0;
+
+    // How much of the image the source has; less than size if it's
+    // relaying an update of its own.
+    uint32_t srcAvailable = 0;
+
+    // Expected md5 of the new version.
+    String md5;
+
+    // Another neighbor advertising the same image, if any.  Only
+    // tracked when blocks can be verified individually.
+    bool haveAltSrc = false;
+    eth_addr altSrc;
+    eth_addr altBssid;
+
+    // Source of an update to another image which this one preempted.
+    // Its replies to requests sent before then may still arrive.
+    bool haveStaleSrc = false;
+    eth_addr staleSrc;
+  };
+  // Cached md5 of the running sketch.  Since we only have the sketch
+  // name, version and size to go by, entries are only trusted if all
+  // three match.
+  struct md5_cache_t {
+    static constexpr uint32_t MAGIC = 0x4c4d4f35;  // LMO5
+    uint32_t magic;
+    uint32_t sketchSize;
+    int32_t version;
+    uint32_t nameHash;
+    uint8_t md5[16];
   };
+  static_assert(sizeof(md5_cache_t) == md5CacheWords * 4, "md5 cache size mismatch");
+  // Look up the md5 of the given sketch in RTC user memory.  Returns
+  // false if it's not there.
+  static bool _loadMd5Cache(int rtcOffset, const String& sketchName, int version,
+                            uint32_t sketchSize, String* md5);
+  static void _storeMd5Cache(int rtcOffset, const String& sketchName, int version,
+                             uint32_t sketchSize, const String& md5);
+
+  // Copies a frame from the raw wifi callback and schedules it.  Only
+  // BasicLazyMeshOta registers for them.
+  virtual void _queueRawFrame(RxPacket* /* pkt */) IRAM_ATTR {}
+  // Stops frames from the raw wifi callback reaching this instance.
+  void _unregisterWifi();
+
+  eth_addr _localEthAddr;
+
+  // Instances registered with register_wifi_cb.  The raw wifi callback
+  // is shared by the whole program, so this is too.  Slots are claimed
+  // and released with compare and swap, so the callback never needs a
+  // lock.
+  static std::atomic<LazyMeshOtaBase*> _wifiInstances[maxWifiInstances];
+
   class BufStream : public Stream {
    public:
     BufStream(char* buf, size_t len) : _buf(buf), _len(len) {}
@@ -169,40 +541,491 @@ class LazyMeshOta {
     size_t _pos = 0;
     size_t _len = 0;
   };
+};
 
-  //  static constexpr uint32_t advertiseInterval = 60000; // Advertise our version every 60
-  //  seconds.
+template <typename Config = LazyMeshOtaConfig>
+class BasicLazyMeshOta : public LazyMeshOtaBase {
+ public:
+  BasicLazyMeshOta() = default;
+  ~BasicLazyMeshOta() {
+    end();
+    delete[] _localManifestCache;
+    delete[] _relayNodeHashes;
+    delete[] _blockIndex;
+  }
+
+  // 'version' is the version number of the current software.  Any
+  // peer nodes with lower version numbers and the same sketchName
+  // will be upgraded.
+  void begin(String sketchName, int version);
+
+  void setListener(Listener* l) {
+    if (_capture) {
+      _captureListener.next = l;
+    } else {
+      _listener = l;
+    }
+  }
+  // Send frames with something other than raw wifi.  Must be called
+  // before begin.
+  void setTransport(LazyMeshOtaTransport* t) { _transport = t; }
+  // Read the running image from, and write updates to, something other
+  // than flash.  Must be called before begin.
+  void setImageSource(LazyMeshOtaImageSource* s) { _imageSource = s; }
+  void setImageSink(LazyMeshOtaImageSink* s) { _imageSink = s; }
+  // Use another source of time and random numbers.  Must be called
+  // before begin.
+  void setClock(LazyMeshOtaClock* c) { _clock = c; }
+  // Record every frame received and sent, along with timing, random
+  // numbers drawn and listener calls, to 'out' for LazyMeshOtaReplay.
+  // Must be called before begin.
+  void setCapture(Print* out);
+
+  void end();
+
+  // Receives a raw frame.  Must free frame when done.
+  bool onReceiveRawFrame(RxPacket* pkt);
+
+  // Enable or disable recording frames in the trace ring.  Recording
+  // is a few stores per frame, so it can stay on during transfers.
+  void setTraceEnabled(bool enabled) { _trace.setEnabled(enabled); }
+  // Removes the oldest event from the trace ring.  Returns false if empty.
+  bool nextTraceEvent(TraceEvent* ev) { return _trace.pop(ev); }
+  // Number of events lost because the ring was full.
+  uint32_t traceOverwritten() const { return _trace.overwritten; }
+  // Drains the trace ring as a pcap file, which can be read by
+  // wireshark or tcpdump.  Returns the number of frames written.
+  size_t writeTracePcap(Print& out);
+
+  // Times spent in one part of updating, if latencyHistograms is set.
+  const LatencyHistogram& latency(LatencySpan span) const {
+    return _latency[latencyHistograms ? size_t(span) : 0];
+  }
+  void clearLatency() {
+    for (LatencyHistogram& histogram : _latency) {
+      histogram.clear();
+    }
+  }
+
+  // How well the advertisement cache is doing, if advertCacheSize is set.
+  AdvertCacheStats advertCacheStats() const { return _advertCache.stats; }
+
+  // Memory used by each entry point, if memoryAccounting is set.
+  const MemoryUsage& memoryUsage(MemoryEntry entry) const {
+    return _memory[Config::memoryAccounting ? size_t(entry) : 0];
+  }
+  void clearMemoryUsage() {
+    for (MemoryUsage& usage : _memory) {
+      usage = MemoryUsage();
+    }
+  }
+
+  // Estimated number of nodes which have run each version, if
+  // censusVersions is set.
+  using CensusT = VersionCensus<Config::censusVersions ? Config::censusVersions : 1,
+                                Config::censusRegisters>;
+  const CensusT& census() const { return _census; }
+  // True if we think every node runs our version; see censusVersions.
+  bool converged() const;
+
+  // True unless rendezvous has turned the radio off.
+  bool radioOn() const { return _radioOn; }
+
+  // How many messages shared frames, if aggregateWindow is set.
+  AggregateStats aggregateStats() const { return _aggregate.stats; }
+
+  // Bytes sent so far, and what the airtime limit has held back.
+  AirtimeStats airtimeStats() {
+    _airtime.rollWindow(_clock->millis());
+    return _airtime.stats;
+  }
+
+  // Milliseconds until the instance next has something to do unless a
+  // frame arrives first; 0 if it's busy.  On the ESP a timer runs the
+  // loop then, so nothing runs in between and the application can
+  // sleep.
+  uint32_t millisUntilWork() const;
 
 #if defined(EPOXY_DUINO)
-  static constexpr uint32_t advertiseInterval = 1000;
-  static constexpr uint32_t receiveTimeoutInterval = 456;
-  static constexpr uint16_t bufferSize = 4;  // Number of bytes to transfer per packet.
-#else
-  static constexpr uint32_t advertiseInterval = 30000;
-  static constexpr uint32_t receiveTimeoutInterval = 10000;
-  static constexpr uint16_t bufferSize = 1024;  // Number of bytes to transfer per packet.
+  void loop() { _loop(); }
 #endif
-  static constexpr uint16_t maxRetries = 10;  // Number of times to try a block before giving up.
 
+ private:
+  // Lets tests/HotPathBench call the packet handlers directly.
+  friend struct LazyMeshOtaBench;
+
+  //  static constexpr uint32_t advertiseInterval = 60000; // Advertise our version every 60
+  //  seconds.
+
+  static constexpr uint32_t advertiseInterval = Config::advertiseInterval;
+  static constexpr uint32_t receiveTimeoutInterval = Config::receiveTimeoutInterval;
+  static constexpr uint16_t bufferSize = Config::bufferSize;
+  static constexpr uint16_t maxRetries = Config::maxRetries;
+  static constexpr int tracePackets = Config::tracePackets;
+  static constexpr bool useManifest = Config::useManifest;
+  static constexpr uint16_t manifestFanout = Config::manifestFanout;
+  static constexpr uint8_t manifestMaxDepth = Config::manifestMaxDepth;
+  static constexpr size_t hashSize = ManifestHasher::hashSize;
+  static constexpr size_t traceRingSize = Config::traceRingSize;
+  static constexpr uint32_t md5SliceSize = Config::md5SliceSize;
+  static constexpr int md5CacheRtcOffset = Config::md5CacheRtcOffset;
+
+  // Largest frames we can generate, apart from advertisements whose
+  // size depends on the sketch name.
+  static constexpr size_t maxReqFrameLength =
+      sizeof(hdr_t) + sizeof(eth_addr) * 3 /* bssid + \n */ + maxOffsetDigits + 1;
+  static constexpr size_t maxReplyFrameLength = sizeof(hdr_t) + maxOffsetDigits + 1 + bufferSize;
+  static_assert(bufferSize > 0, "bufferSize must be positive");
+  static_assert(maxReqFrameLength <= maxRawFrameLength, "REQ frames too big to send");
+  static_assert(maxReplyFrameLength <= maxRawFrameLength,
+                "bufferSize too big; REPLY frames would not fit in a raw frame");
+  static constexpr size_t maxHashReplyFrameLength =
+      sizeof(hdr_t) + 4 /* level */ + maxOffsetDigits + 1 + manifestFanout * hashSize;
+  static_assert(!useManifest || maxHashReplyFrameLength <= maxRawFrameLength,
+                "manifestFanout too big; HASH_REPLY frames would not fit in a raw frame");
+  static_assert(manifestFanout > 1, "manifestFanout must be at least 2");
+  static constexpr uint8_t fecDataBlocks = Config::fecDataBlocks;
+  static constexpr uint8_t fecParityBlocks = Config::fecParityBlocks;
+  static_assert(fecParityBlocks == 0 || (fecDataBlocks > 0 && fecDataBlocks <= 31),
+                "fecDataBlocks must fit in a positive 32 bit mask");
+  static_assert(fecParityBlocks <= fecDataBlocks, "More parity blocks than data blocks");
+  static_assert(maxReplyFrameLength + 4 /* index */ <= maxRawFrameLength,
+                "bufferSize too big; PARITY frames would not fit in a raw frame");
+  static_assert(md5SliceSize > 0, "md5SliceSize must be positive");
+  static constexpr uint8_t streamWindow = Config::streamWindow;
+  static constexpr uint8_t streamBurst = Config::streamBurst;
+  static constexpr uint32_t streamPacing = Config::streamPacing;
+  static constexpr uint32_t streamNackInterval = Config::streamNackInterval;
+  static constexpr bool relayPartial = Config::relayPartial;
+  static constexpr uint32_t relayAdvertiseInterval = Config::relayAdvertiseInterval;
+  static_assert(streamWindow <= 31, "streamWindow must fit in a positive 32 bit mask");
+  static_assert(!streamWindow || streamBurst > 0, "streamBurst must be positive");
+  static_assert(md5CacheRtcOffset < 0 || md5CacheRtcOffset + md5CacheWords <= 128,
+                "md5 cache doesn't fit in the 512 bytes of RTC user memory");
+  static constexpr uint32_t airtimeBytesPerSecond = Config::airtimeBytesPerSecond;
+  static constexpr uint32_t airtimeBurstBytes = Config::airtimeBurstBytes;
+  static constexpr uint32_t airtimeControlReserve = Config::airtimeControlReserve;
+  static constexpr uint8_t airtimeQueueFrames = Config::airtimeQueueFrames;
+  static constexpr bool latencyHistograms = Config::latencyHistograms;
+  static constexpr uint32_t versionCollectWindow = Config::versionCollectWindow;
+  static constexpr uint32_t versionDigestTimeout = Config::versionDigestTimeout;
+  static constexpr uint8_t advertCacheSize = Config::advertCacheSize;
+  static constexpr uint32_t advertCacheTimeout = Config::advertCacheTimeout;
+  static constexpr uint32_t neighborSeenInterval = Config::neighborSeenInterval;
+  static constexpr bool shareBlocks = Config::shareBlocks;
+  static constexpr uint8_t maxBlockSources = Config::maxBlockSources;
+  static_assert(!shareBlocks || useManifest, "shareBlocks needs useManifest for block hashes");
+  static_assert(!relayPartial || useManifest, "relayPartial needs useManifest to check blocks");
+  static_assert(!shareBlocks || maxBlockSources > 0, "maxBlockSources must be positive");
+  static constexpr uint32_t aggregateWindow = Config::aggregateWindow;
+  static constexpr uint8_t censusVersions = Config::censusVersions;
+  static constexpr uint8_t censusRegisters = Config::censusRegisters;
+  static constexpr uint32_t convergedQuietTime = Config::convergedQuietTime;
+  static constexpr uint32_t convergedAdvertiseInterval = Config::convergedAdvertiseInterval;
+  static constexpr bool memoryAccounting = Config::memoryAccounting;
+  static constexpr uint32_t memoryStackBudget = Config::memoryStackBudget;
+  static constexpr uint32_t memoryHeapBudget = Config::memoryHeapBudget;
+  static constexpr uint32_t rendezvousPeriod = Config::rendezvousPeriod;
+  static constexpr uint32_t rendezvousWindow = Config::rendezvousWindow;
+  static constexpr uint16_t rendezvousScanPeriods = Config::rendezvousScanPeriods;
+  static_assert(!rendezvousPeriod || (rendezvousWindow > 0 && rendezvousWindow < rendezvousPeriod),
+                "rendezvousWindow must be positive and shorter than rendezvousPeriod");
+  // Long enough to hear every neighbor on any schedule advertise.
+  static constexpr uint32_t rendezvousListenTime = rendezvousPeriod + advertiseInterval * 3 / 2;
+  static constexpr size_t maxBulkFrameLength =
+      useManifest && maxHashReplyFrameLength > maxReplyFrameLength + 4
+          ? maxHashReplyFrameLength
+          : maxReplyFrameLength + 4 /* parity index */;
+  static_assert(!airtimeBytesPerSecond ||
+                    airtimeBurstBytes >= airtimeControlReserve + maxBulkFrameLength,
+                "airtimeBurstBytes too small to ever send a bulk frame");
+  static_assert(!airtimeBytesPerSecond || airtimeQueueFrames > 0,
+                "airtimeQueueFrames must be positive");
+  static_assert(!airtimeBytesPerSecond || !fecParityBlocks ||
+                    airtimeQueueFrames >= fecDataBlocks + fecParityBlocks,
+                "airtimeQueueFrames too small for a whole group reply");
+
+  // Hash tree state while receiving an update which advertised a root.
+  struct manifest_t {
+    uint8_t root[hashSize];
+    ManifestShape shape;
+    // For each level starting at 1, the index of the node whose
+    // children are in 'children', or -1 if none have been received yet.
+    int32_t loaded[manifestMaxDepth];
+    uint8_t children[manifestMaxDepth][manifestFanout][hashSize];
+  };
+
+  // Group being received while updating with forward error correction.
+  struct fec_t {
+    // Parameters advertised by the source.
+    uint32_t blockSize;
+    uint8_t dataBlocks;
+    uint8_t parityBlocks;
+
+    // Offset of the first block of the current group.
+    uint32_t groupStart = 0;
+    // Which blocks of the current group we have.
+    uint32_t haveData = 0;
+    uint32_t haveParity = 0;
+
+    // Short blocks are zero padded.
+    uint8_t data[fecParityBlocks ? fecDataBlocks : 1][bufferSize];
+    uint8_t parity[fecParityBlocks ? fecParityBlocks : 1][bufferSize];
+  };
+
+  // Receive state while the source streams the image.
+  struct stream_t {
+    // Advertised by the source.
+    uint32_t blockSize;
+
+    // Which blocks after the update offset we have; bit i is the block
+    // i blocks after it.  The block at the offset itself is written as
+    // soon as it arrives, so bit 0 is never set.
+    uint32_t have = 0;
+    // True if a block arrived after a missing one since the last STREAM_REQ.
+    bool gap = false;
+    // Timestamp in millis before which we don't send another STREAM_REQ.
+    uint32_t nextNack = 0;
+
+    // Indexed by block number modulo streamWindow.
+    uint8_t data[streamWindow ? streamWindow : 1][streamWindow ? bufferSize : 1];
+  };
+
+  // Optional capabilities of a neighbor, from its advertisement.
+  struct offer_t {
+    ~offer_t() {
+      delete manifest;
+      delete fec;
+      delete stream;
+    }
+    manifest_t* manifest = nullptr;
+    fec_t* fec = nullptr;
+    stream_t* stream = nullptr;
+    // Bytes available, if only a prefix.
+    uint32_t partial = 0;
+  };
+
+  // Best offer heard while waiting out versionCollectWindow.
+  struct pending_offer_t {
+    eth_addr src;
+    eth_addr bssid;
+    int version = 0;
+    uint32_t size = 0;
+    String md5;
+    uint32_t available = 0;
+    offer_t offer;
+    // Timestamp in millis to start downloading it.
+    uint32_t deadline = 0;
+    // True if we've already waited longer for a newer version.
+    bool extended = false;
+  };
+
+  // Stream being sent in answer to STREAM_REQ.
+  struct stream_source_t {
+    bool active = false;
+    eth_addr client;
+    eth_addr bssid;
+    // Offset of the next block to send unprompted.
+    uint32_t next = 0;
+    // Blocks to resend first, as in STREAM_REQ.
+    uint32_t resendStart = 0;
+    uint32_t resendMask = 0;
+    // Timestamp in micros of the next REPLY.
+    uint32_t nextSend = 0;
+    // Timestamp in millis of the last STREAM_REQ from the client.
+    uint32_t lastReq = 0;
+  };
+
+  static void _debugPutchar(int ch);
   eth_addr _getLocalBssid();
 
   // Runs once per loop.  Checks to see if we need to advertise and/or resend lost packets.
   void _loop();
+  // Arranges for _loop to run when millisUntilWork says.
+  void _scheduleWake();
+#if !defined(EPOXY_DUINO)
+  static void _onWakeTimer(void* arg);
+  os_timer_t _wakeTimer;
+  bool _wakeTimerReady = false;
+  // True while _loop is queued with schedule_function.
+  bool _loopScheduled = false;
+#endif
+
+  // Reads the clock.  Called when entered from outside, so decisions
+  // depend only on when we were called, and replays come out the same.
+  void _tick() {
+    _nowMillis = _clock->millis();
+    _nowMicros = _clock->micros();
+  }
+  long _random(long min, long max);
+  // Appends a record to the capture, if capturing.
+  void _captureRecord(CaptureRecord::Type type, const uint8_t* data, size_t len,
+                      const uint8_t* data2 = nullptr, size_t len2 = 0);
 
   void _transmit(PKT_TYPE pkt_type, eth_addr dest, eth_addr bssid, String msg);
+  // Sends a frame built by _transmit or _flushAggregate, subject to
+  // the airtime limit.
+  void _transmitFrame(uint8_t* frame, uint16_t len, bool bulk);
+  // Sends the messages waiting to share a frame, if any.
+  void _flushAggregate();
+  // Hands a built frame to the transport, which takes ownership.
+  void _sendFrame(uint8_t* frame, uint16_t len, bool bulk);
   void _tracePacket(uint8_t* pkt, uint32_t len, uint32_t hdr_start);
 
+  // Record a frame in the trace ring, if enabled.
+  void _traceFrame(TraceEvent::Direction direction, TraceEvent::Outcome outcome,
+                   const uint8_t* frm, uint32_t len, int8_t rssi);
+  void _traceRx(TraceEvent::Outcome outcome, RxPacket* pkt) {
+    _traceFrame(TraceEvent::Direction::RX, outcome, pkt->data, pkt->rx_ctl.legacy_length,
+                pkt->rx_ctl.rssi);
+  }
+  void _traceSendFailed();
+
+  // Hash the next slice of the local sketch, if its md5 isn't known yet.
+  void _hashSketchSlice();
+  void _localMd5Ready();
+
   void _advertise();
   void _receiveAdvertise(const eth_addr& src, BufStream& body);
+  // Takes ownership of anything in offer it uses.
   void _startUpdate(const eth_addr& src, const eth_addr& bssid, int version, uint32_t sketchsize,
-                    String md5sum);
+                    String md5sum, offer_t* offer);
+  // Returns false if the offer can't be taken up this time.
+  bool _parseAdvertField(const String& field, uint32_t sketchsize, offer_t* offer);
+
+  // Version collection.
+  void _collectOffer(const eth_addr& src, const eth_addr& bssid, int version,
+                     uint32_t sketchsize, const String& md5, offer_t* offer);
+  void _startPendingOffer();
+  // Notes that 'version' was seen 'age' ms ago.
+  void _noteNewest(int version, const String& md5, uint32_t age);
+  bool _parseNewestField(const String& field);
+  // Newest version heard of recently, or 0.
+  int _newestKnown() const {
+    return int32_t(_nowMillis - _newestExpires) < 0 ? _newestVersion : 0;
+  }
+  // Advertisement field for the newest version, if newer than 'version'.
+  String _newestField(int version);
+  // Counts a neighbor advertising 'version' of our sketch.
+  void _noteCensus(const eth_addr& src, int version);
   void _requestNextBlock();
   void _receiveTimeout();
+  // Counts a failed attempt at the current block, abandoning the update
+  // after maxRetries.  Returns false if it was abandoned.
+  bool _countRetry();
   void _receiveReq(const eth_addr& src, BufStream& body);
   void _receiveReply(const eth_addr& src, BufStream& body);
+  // Handles a message of any type but AGGREGATE.
+  void _dispatch(PKT_TYPE type, const eth_addr& src, const uint8_t* data, uint16_t len);
+  void _receiveAggregate(const eth_addr& src, const uint8_t* data, uint16_t len);
+  void _deleteUpdate();
+  // Send the block at the given offset as a REPLY.
+  bool _sendBlock(const eth_addr& dest, const eth_addr& bssid, uint32_t startOffset);
+  // Pass received image data to the updater.  Returns the number of
+  // bytes written.
+  uint32_t _updateWrite(uint8_t* data, uint32_t len);
+
+  // Cut-through relaying.  While relaying, we serve the new image
+  // instead of the running sketch.
+  bool _relaying() const { return relayPartial && _relaySize; }
+  // Whether a request's image id is of the image we serve.
+  bool _servesImage(const String& id) const {
+    return id == imageId(_relaying() ? _relayMd5 : _localSketchMd5);
+  }
+  uint32_t _relayAvailable() const;
+  bool _readServed(uint32_t offset, uint8_t* data, uint32_t len);
+  // Hash of a node of the relayed image's tree, from the level 1 hashes
+  // verified so far and the blocks written.  Returns false if we don't
+  // have that much yet.
+  bool _relayNodeHash(uint8_t level, uint32_t index, uint8_t* out);
+
+  // Hash tree over the local sketch.  Its blocks are hashed a slice at
+  // a time along with the md5, between _beginManifest and
+  // _finishManifest; _manifestHashed hashes a piece of the image which
+  // doesn't cross a block boundary.
+  bool _beginManifest();
+  void _manifestHashed(uint32_t offset, const uint8_t* data, uint32_t len);
+  bool _finishManifest();
+  // Takes the md5, and hash tree if it fits, from a prebuilt manifest.
+  // Returns false if there isn't one for this image.
+  bool _loadPrebuiltManifest();
+  bool _manifestNodeHash(uint8_t level, uint32_t index, uint8_t* out);
+  void _receiveHashReq(const eth_addr& src, BufStream& body);
+
+  // Hash tree of an update in progress.
+  bool _manifestWantedNode(uint32_t block, uint8_t* level, uint32_t* index);
+  bool _manifestVerifyBlock(uint32_t block, const uint8_t* data, uint32_t len);
+  void _receiveHashReply(const eth_addr& src, BufStream& body);
+  void _useAltSrc();
+  // Handles data which didn't match the hash tree.
+  void _verificationFailed(const char* error);
+  // Expected hash of the given block, which must be loaded.
+  const uint8_t* _manifestBlockHash(uint32_t block);
+
+  // Block sharing.
+  // Neighbors with other images which answer BLOCK_REQ.
+  struct block_sources_t {
+    eth_addr src[maxBlockSources ? maxBlockSources : 1];
+    eth_addr bssid[maxBlockSources ? maxBlockSources : 1];
+    uint8_t count = 0;
+    // Slot to replace when full.
+    uint8_t next = 0;
+    // 0 to ask the update's source, or one more than the index of the
+    // block source to ask.
+    uint8_t turn = 0;
+  };
+  struct block_index_t {
+    // First bytes of the block's hash.
+    uint32_t key;
+    uint32_t block;
+  };
+  // True if other images' advertisements are worth looking at.
+  bool _wantBlockSources() const { return shareBlocks && _update && _updateManifest; }
+  // Notes the sender of an advertisement for another image as a block
+  // source, if it offers blocks.  'rest' is what follows the version.
+  void _noteBlockSource(const eth_addr& src, const char* rest, size_t len);
+  void _receiveBlockReq(const eth_addr& src, BufStream& body);
+
+  // Forward error correction.
+  uint32_t _groupBlocks(uint32_t groupStart, uint32_t blockSize, uint8_t dataBlocks,
+                        uint32_t imageSize);
+  void _receiveGroupReq(const eth_addr& src, BufStream& body);
+  void _fecReceive(uint32_t startOffset, int parityIndex, BufStream& body);
+  void _fecRecover();
+  bool _fecFlush();
+
+  // Streaming.
+  void _receiveStreamReq(const eth_addr& src, BufStream& body);
+  void _streamSend();
+  void _streamReceive(uint32_t startOffset, BufStream& body);
 
   Listener _defaultListener;
   Listener* _listener = &_defaultListener;
+  RawWifiTransport _defaultTransport;
+  LazyMeshOtaTransport* _transport = &_defaultTransport;
+  FlashImageSource _defaultImageSource;
+  LazyMeshOtaImageSource* _imageSource = &_defaultImageSource;
+  UpdaterImageSink _defaultImageSink;
+  LazyMeshOtaImageSink* _imageSink = &_defaultImageSink;
+  SystemClock _defaultClock;
+  LazyMeshOtaClock* _clock = &_defaultClock;
+  // Clock as of when we were last called.
+  uint32_t _nowMillis = 0;
+  uint32_t _nowMicros = 0;
+
+  // Where the capture goes, if any.
+  Print* _capture = nullptr;
+  // A loop record is only written if the loop does something.
+  bool _captureLoopPending = false;
+  class CaptureListener : public StateListener {
+   public:
+    void onState(CaptureState state, const String& description) override {
+      owner->_captureRecord(CaptureRecord::Type::STATE, (const uint8_t*)&state, sizeof(state),
+                            (const uint8_t*)description.c_str(), description.length());
+    }
+    BasicLazyMeshOta* owner = nullptr;
+  };
+  CaptureListener _captureListener;
   // timestamp in millis of next version advertisement
   uint32_t _nextAdvertise = 0;
 
@@ -213,18 +1036,174 @@ class LazyMeshOta {
   // Version of our current sketch.
   String _localSketchName;
   int _localVersion;
+  // Empty until the md5 has been computed.
   String _localSketchMd5;
   uint32_t _localSketchSize;
-  eth_addr _localEthAddr;
+  // Progress hashing the local sketch.
+  ManifestHasher _localSketchHasher;
+  uint32_t _localSketchHashed = 0;
+  // Sequence number of the last frame we sent.
+  uint16_t _txSeq = 0;
+  // Last frame passed on by the raw wifi callback, to drop duplicates.
+  uint16_t _lastRxSeq = 0;
+  eth_addr _lastRxSrc = {};
+
+  // Hash tree of the local sketch, if useManifest.  Holds the hashes of
+  // level 1; level 0 is recomputed from flash when requested.
+  bool _haveLocalManifest = false;
+  // True while its blocks are being hashed, with the block and level 1
+  // node in progress.
+  bool _buildingManifest = false;
+  ManifestHasher _manifestBlockHasher;
+  ManifestHasher _manifestGroupHasher;
+  ManifestShape _localManifest;
+  uint8_t* _localManifestCache = nullptr;
+  uint8_t _localManifestRoot[hashSize];
+  // Blocks of the local sketch sorted by key, if shareBlocks.
+  block_index_t* _blockIndex = nullptr;
+  uint32_t _blockIndexSize = 0;
+  // Block sources for the update in progress.
+  block_sources_t _blockSources;
 
   // New version download in progress.
   update_t* _update = nullptr;
+  // Hash tree of the new version, if the source advertised one.
+  manifest_t* _updateManifest = nullptr;
+  // Current group, if the source offers forward error correction.
+  fec_t* _updateFec = nullptr;
+  // Receive state, if the source is streaming the image.
+  stream_t* _updateStream = nullptr;
+  stream_source_t _streamSource;
+
+  // Download waiting for versionCollectWindow to pass, if any.
+  pending_offer_t* _pendingOffer = nullptr;
+  // Newest version heard of, directly or in other advertisements, and
+  // when it's forgotten.
+  int _newestVersion = 0;
+  String _newestMd5;
+  uint32_t _newestExpires = 0;
+
+  // Size of the image we're relaying, or 0.  Stays set after the update
+  // completes so we keep serving it until we reboot.
+  uint32_t _relaySize = 0;
+  String _relayMd5;
+  // The updater may rewrite the image header in flash, so we keep the
+  // original to serve.
+  uint8_t _relayHeader[4];
+  // Shape of the relayed image's hash tree, and the hashes of its level
+  // 1 nodes, of which the first _relayNodesKnown have been verified.
+  // Kept with _relaySize to answer HASH_REQs.
+  ManifestShape _relayShape;
+  uint8_t* _relayNodeHashes = nullptr;
+  uint32_t _relayNodesKnown = 0;
+  // Bytes available in our last advertisement, and when we can send
+  // another one.
+  uint32_t _relayAdvertised = 0;
+  uint32_t _nextRelayAdvertise = 0;
+  // Parity being generated while answering GROUP_REQ.
+  uint8_t _fecParity[fecParityBlocks ? fecParityBlocks : 1][fecParityBlocks ? bufferSize : 1];
 
   // True if an update is complete; we then just wait for reboot.
   bool _terminate = false;
 
-  // For the register_wifi_cb convenience method
-  static LazyMeshOta* _instance;
+  TraceRing<traceRingSize ? traceRingSize : 1> _trace;
+
+  AirtimeLimiter<airtimeQueueFrames ? airtimeQueueFrames : 1> _airtime;
+  // True if 'frames' more image frames would fit in the airtime queue, so
+  // a reply that long won't be cut short.
+  bool _airtimeRoom(uint32_t frames) const {
+    return !airtimeBytesPerSecond || _airtime.stats.queuedFrames + frames <= airtimeQueueFrames;
+  }
+
+  using AdvertCacheT = AdvertCache<advertCacheSize ? advertCacheSize : 1>;
+  AdvertCacheT _advertCache;
+  // Cache entry of the advertisement being handled, if any.
+  typename AdvertCacheT::Entry* _advertEntry = nullptr;
+
+  // Accounts for the memory used from construction to destruction,
+  // if memoryAccounting.  Must be constructed at the top of an entry
+  // point; calls nested in another entry point count towards it.
+  class MemoryScope {
+   public:
+    __attribute__((always_inline)) MemoryScope(BasicLazyMeshOta* ota, MemoryEntry entry)
+        : _ota(memoryAccounting && !ota->_memoryActive ? ota : nullptr), _entry(entry) {
+      if (_ota) {
+        _ota->_memoryActive = true;
+        _probe.start();
+      }
+    }
+    __attribute__((always_inline)) ~MemoryScope() {
+      if (_ota) {
+        uint32_t stack, heap;
+        _probe.stop(&_ota->_memory[size_t(_entry)], &stack, &heap);
+        _ota->_memoryActive = false;
+        _ota->_memoryCheck(_entry, stack, heap);
+      }
+    }
+
+   private:
+    BasicLazyMeshOta* _ota;
+    MemoryEntry _entry;
+    MemoryProbe _probe;
+  };
+  // Reports a call which went over budget.
+  void _memoryCheck(MemoryEntry entry, uint32_t stack, uint32_t heap);
+  MemoryUsage _memory[memoryAccounting ? size_t(MemoryEntry::COUNT) : 1];
+  bool _memoryActive = false;
+
+  CensusT _census;
+  // When an older version of our sketch was last advertised.
+  uint32_t _lastStaleAdvert = 0;
+
+  // Messages waiting to share a frame, if aggregateWindow.
+  FrameAggregator<sizeof(hdr_t), maxRawFrameLength> _aggregate;
+
+  // Rendezvous.  The current period started at _rendezvousStart by
+  // the schedule of _rendezvousAnchor.
+  uint32_t _rendezvousPhase() const {
+    return (_nowMillis - _rendezvousStart) % (rendezvousPeriod ? rendezvousPeriod : 1);
+  }
+  bool _radioWanted() const;
+  // Milliseconds until _radioWanted might change.
+  uint32_t _millisUntilRadioChange() const;
+  // Turns the radio on or off as wanted.
+  void _updateRadio();
+  void _setRadio(bool on);
+  // Follows the schedule in an advertisement, if it has one we prefer.
+  void _noteRendezvous(const uint8_t* data, uint16_t len);
+  // Advertisement field for our schedule.
+  String _rendezvousField() const {
+    return "rendezvous " + String(_rendezvousPhase()) + " " + ethToString(_rendezvousAnchor) +
+           "\n";
+  }
+  bool _radioOn = true;
+  eth_addr _rendezvousAnchor = {};
+  uint32_t _rendezvousStart = 0;
+  // Listening for other schedules until then.
+  uint32_t _rendezvousListenUntil = 0;
+  uint32_t _nextRendezvousListen = 0;
+  // When a neighbor last asked us for blocks.
+  uint32_t _lastServed = 0;
+
+  void _queueRawFrame(RxPacket* pkt) override IRAM_ATTR;
+  // Handles a frame queued by _queueRawFrame at 'queuedAt'.
+  bool _receiveQueuedFrame(RxPacket* pkt, LatencyStamp queuedAt);
+
+  // Adds the time since 'start', from latencyNow, to a histogram.
+  void _latencySpan(LatencySpan span, LatencyStamp start) IRAM_ATTR {
+    if (latencyHistograms) {
+      _latency[size_t(span)].add(latencyNanos(latencyNow() - start));
+    }
+  }
+  LatencyHistogram _latency[latencyHistograms ? size_t(LatencySpan::COUNT) : 1];
+  // When the REQ for _update->offset was sent, if one is outstanding.
+  bool _reqPending = false;
+  LatencyStamp _reqSentAt = 0;
 };
 
+using LazyMeshOta = BasicLazyMeshOta<>;
+
+// The default configuration is instantiated in LazyMeshOta.cpp.
+extern template class BasicLazyMeshOta<LazyMeshOtaConfig>;
+
 #endif
@@ -0,0 +1,111 @@
+#ifndef LAZYMESHOTAADVERTCACHE_H
+#define LAZYMESHOTAADVERTCACHE_H
+
+#include <Arduino.h>
+#include <string.h>
+
+struct AdvertCacheStats {
+  // Advertisements dropped because we'd already handled the same bytes.
+  uint32_t hits = 0;
+  uint32_t misses = 0;
+  // Neighbors forgotten to make room for another.
+  uint32_t evictions = 0;
+  // onNeighborSeen calls skipped by the rate limit.
+  uint32_t suppressedNotifications = 0;
+};
+
+// Remembers the last advertisement from each of up to 'capacity'
+// neighbors by hashes of its bytes, so a repeat can be dropped without
+// parsing it.  Entries are keyed by the neighbor and the identity of
+// the advertised image: the sketch name, version, size and md5 lines.
+template <size_t capacity>
+class AdvertCache {
+ public:
+  struct Entry {
+    eth_addr src;
+    uint32_t identity;
+    // Hash of the whole advertisement.
+    uint32_t body;
+    uint32_t seenAt;
+    uint32_t notifiedAt;
+    bool used = false;
+    // True if the advertisement needed nothing from us, so a repeat can
+    // be dropped.
+    bool judged = false;
+    bool notified = false;
+  };
+
+  // Looks up an advertisement.  Returns null if it's a repeat of one
+  // judged less than 'timeout' ms ago; otherwise returns its entry,
+  // replacing the least recently seen one if it's from a new neighbor
+  // or for a new image.
+  Entry* find(const eth_addr& src, const uint8_t* data, size_t len, uint32_t nowMillis,
+              uint32_t timeout) {
+    uint32_t identity = hash(data, _identityLength(data, len));
+    uint32_t body = hash(data, len);
+    Entry* oldest = &_entries[0];
+    for (Entry& entry : _entries) {
+      if (entry.used && entry.identity == identity &&
+          memcmp(&entry.src, &src, sizeof(src)) == 0) {
+        if (entry.judged && entry.body == body && nowMillis - entry.seenAt < timeout) {
+          ++stats.hits;
+          return nullptr;
+        }
+        ++stats.misses;
+        entry.body = body;
+        entry.seenAt = nowMillis;
+        entry.judged = false;
+        return &entry;
+      }
+      if (!entry.used) {
+        oldest = &entry;
+      } else if (oldest->used && nowMillis - entry.seenAt > nowMillis - oldest->seenAt) {
+        oldest = &entry;
+      }
+    }
+    ++stats.misses;
+    if (oldest->used) {
+      ++stats.evictions;
+    }
+    *oldest = Entry();
+    oldest->used = true;
+    oldest->src = src;
+    oldest->identity = identity;
+    oldest->body = body;
+    oldest->seenAt = nowMillis;
+    return oldest;
+  }
+
+  void clear() {
+    for (Entry& entry : _entries) {
+      entry = Entry();
+    }
+  }
+
+  // 32 bit FNV-1a.
+  static uint32_t hash(const uint8_t* data, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i != len; ++i) {
+      h = (h ^ data[i]) * 16777619u;
+    }
+    return h;
+  }
+
+  AdvertCacheStats stats;
+
+ private:
+  // Length of the first four lines.
+  static size_t _identityLength(const uint8_t* data, size_t len) {
+    int lines = 0;
+    for (size_t i = 0; i != len; ++i) {
+      if (data[i] == '\n' && ++lines == 4) {
+        return i + 1;
+      }
+    }
+    return len;
+  }
+
+  Entry _entries[capacity];
+};
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef LAZYMESHOTAAGGREGATE_H
+#define LAZYMESHOTAAGGREGATE_H
+
+#include <Arduino.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct AggregateStats {
+  // Messages which waited to share a frame, and the frames they went
+  // out in.
+  uint32_t messages = 0;
+  uint32_t frames = 0;
+};
+
+// Packs messages into the body of one frame.  Each is its destination,
+// length and type, followed by its bytes.  The frame is allocated with
+// 'headroom' bytes in front for the frame header, and is at most
+// 'capacity' bytes including them.
+template <size_t headroom, size_t capacity>
+class FrameAggregator {
+ public:
+  static constexpr size_t messageHeaderSize = sizeof(eth_addr) + sizeof(uint16_t) + 1;
+
+  ~FrameAggregator() { free(_frame); }
+
+  // True if a message of 'len' bytes could ever share a frame.
+  static constexpr bool fitsAlone(size_t len) {
+    return headroom + messageHeaderSize + len <= capacity;
+  }
+
+  bool empty() const { return !_count; }
+  // True if a message of 'len' bytes fits with those already added.
+  bool fits(size_t len) const { return fitsAlone(_len + len); }
+
+  uint8_t count() const { return _count; }
+  // When the first message was added.
+  uint32_t start() const { return _start; }
+  // True if any message added was bulk.
+  bool bulk() const { return _bulk; }
+  // The destination and bssid shared by every message added, or
+  // broadcast if they differ.
+  const eth_addr& dest() const { return _dest; }
+  const eth_addr& bssid() const { return _bssid; }
+  // Length of the body after the headroom.
+  uint16_t len() const { return _len; }
+
+  // Adds a message, which must fit.  Returns false if the frame couldn't
+  // be allocated.
+  bool add(const eth_addr& dest, const eth_addr& bssid, uint8_t type, const uint8_t* data,
+           uint16_t len, bool bulk, uint32_t now) {
+    if (!_frame) {
+      _frame = (uint8_t*)malloc(capacity);
+      if (!_frame) {
+        return false;
+      }
+      _start = now;
+      _dest = dest;
+      _bssid = bssid;
+    }
+    if (memcmp(&_dest, &dest, sizeof(dest)) != 0) {
+      memset(&_dest, 0xff, sizeof(_dest));
+    }
+    if (memcmp(&_bssid, &bssid, sizeof(bssid)) != 0) {
+      memset(&_bssid, 0xff, sizeof(_bssid));
+    }
+    uint8_t* pos = _frame + headroom + _len;
+    memcpy(pos, &dest, sizeof(dest));
+    memcpy(pos + sizeof(dest), &len, sizeof(len));
+    pos[sizeof(dest) + sizeof(len)] = type;
+    memcpy(pos + messageHeaderSize, data, len);
+    _len += messageHeaderSize + len;
+    _bulk |= bulk;
+    ++_count;
+    ++stats.messages;
+    return true;
+  }
+
+  // Hands over the frame, allocated with malloc, and starts a new one.
+  uint8_t* take() {
+    uint8_t* frame = _frame;
+    _frame = nullptr;
+    _len = 0;
+    _count = 0;
+    _bulk = false;
+    ++stats.frames;
+    return frame;
+  }
+
+  // Reads the next message of a body at 'pos', with 'remaining' bytes
+  // left, and advances past it.  Returns false at the end or if the
+  // rest is malformed.
+  static bool next(const uint8_t*& pos, size_t& remaining, eth_addr* dest, uint8_t* type,
+                   const uint8_t** data, uint16_t* len) {
+    if (remaining < messageHeaderSize) {
+      return false;
+    }
+    memcpy(dest, pos, sizeof(*dest));
+    memcpy(len, pos + sizeof(*dest), sizeof(*len));
+    *type = pos[sizeof(*dest) + sizeof(*len)];
+    if (*len > remaining - messageHeaderSize) {
+      return false;
+    }
+    *data = pos + messageHeaderSize;
+    pos += messageHeaderSize + *len;
+    remaining -= messageHeaderSize + *len;
+    return true;
+  }
+
+  AggregateStats stats;
+
+ private:
+  uint8_t* _frame = nullptr;
+  uint16_t _len = 0;
+  uint8_t _count = 0;
+  bool _bulk = false;
+  uint32_t _start = 0;
+  eth_addr _dest;
+  eth_addr _bssid;
+};
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef LAZYMESHOTAAIRTIME_H
+#define LAZYMESHOTAAIRTIME_H
+
+#include <Arduino.h>
+
+#include <algorithm>
+
+// How much of the channel LazyMeshOta has used.  Control frames are
+// advertisements and requests; bulk frames carry image data.
+struct AirtimeStats {
+  uint64_t controlBytes = 0;
+  uint64_t bulkBytes = 0;
+  // Bytes sent during the last whole second.
+  uint32_t bytesLastSecond = 0;
+  // Bulk frames which had to wait for budget.
+  uint32_t deferredFrames = 0;
+  // Control frames sent without budget, and bulk frames which found the
+  // queue full.
+  uint32_t droppedFrames = 0;
+  // Bulk frames waiting now.
+  uint32_t queuedFrames = 0;
+};
+
+// Token bucket holding up to 'burst' bytes, refilled at 'rate' bytes per
+// second, with a queue of bulk frames waiting for it.  Queued frames are
+// owned by the limiter until popped.
+template <size_t queueCapacity>
+class AirtimeLimiter {
+ public:
+  ~AirtimeLimiter() {
+    uint16_t len;
+    while (uint8_t* frame = _pop(&len)) {
+      free(frame);
+    }
+  }
+
+  void begin(uint32_t rate, uint32_t burst, uint32_t nowMicros) {
+    _rate = rate;
+    _capacity = uint64_t(burst) * 1000000;
+    _tokens = _capacity;
+    _lastRefill = nowMicros;
+  }
+
+  // Takes 'len' bytes of budget if at least len + reserve are left.
+  bool take(uint32_t len, uint32_t reserve, uint32_t now) {
+    _tokens = std::min(_capacity, _tokens + uint64_t(now - _lastRefill) * _rate);
+    _lastRefill = now;
+    if (_tokens < uint64_t(len + reserve) * 1000000) {
+      return false;
+    }
+    _tokens -= uint64_t(len) * 1000000;
+    return true;
+  }
+
+  // Queues a bulk frame.  If full, frees it and returns false.
+  bool push(uint8_t* frame, uint16_t len) {
+    if (stats.queuedFrames == queueCapacity) {
+      free(frame);
+      ++stats.droppedFrames;
+      return false;
+    }
+    _queue[(_start + stats.queuedFrames) % queueCapacity] = {frame, len};
+    ++stats.queuedFrames;
+    ++stats.deferredFrames;
+    return true;
+  }
+
+  // Removes the oldest queued frame if there's budget for it.
+  uint8_t* popReady(uint16_t* len, uint32_t reserve, uint32_t nowMicros) {
+    if (!stats.queuedFrames || !take(_queue[_start].len, reserve, nowMicros)) {
+      return nullptr;
+    }
+    return _pop(len);
+  }
+
+  // Microseconds until popReady could remove the oldest queued frame,
+  // or 0 if it could now or nothing is queued.
+  uint32_t microsUntilReady(uint32_t reserve, uint32_t nowMicros) const {
+    if (!stats.queuedFrames) {
+      return 0;
+    }
+    uint64_t tokens =
+        std::min(_capacity, _tokens + uint64_t(nowMicros - _lastRefill) * _rate);
+    uint64_t needed = uint64_t(_queue[_start].len + reserve) * 1000000;
+    if (tokens >= needed) {
+      return 0;
+    }
+    return (needed - tokens + _rate - 1) / _rate;
+  }
+
+  // Counts a frame as sent.
+  void sent(uint16_t len, bool bulk, uint32_t nowMillis) {
+    (bulk ? stats.bulkBytes : stats.controlBytes) += len;
+    rollWindow(nowMillis);
+    _windowBytes += len;
+  }
+
+  // Brings bytesLastSecond up to date.
+  void rollWindow(uint32_t now) {
+    uint32_t elapsed = now - _windowStart;
+    if (elapsed < 1000) {
+      return;
+    }
+    stats.bytesLastSecond = elapsed < 2000 ? _windowBytes : 0;
+    _windowBytes = 0;
+    _windowStart = now - elapsed % 1000;
+  }
+
+  AirtimeStats stats;
+
+ private:
+  uint8_t* _pop(uint16_t* len) {
+    if (!stats.queuedFrames) {
+      return nullptr;
+    }
+    uint8_t* frame = _queue[_start].frame;
+    *len = _queue[_start].len;
+    _start = (_start + 1) % queueCapacity;
+    --stats.queuedFrames;
+    return frame;
+  }
+
+  struct entry_t {
+    uint8_t* frame;
+    uint16_t len;
+  };
+
+  uint32_t _rate = 0;
+  uint64_t _capacity = 0;
+  // In millionths of a byte, so refills don't round away.
+  uint64_t _tokens = 0;
+  uint32_t _lastRefill = 0;
+  uint32_t _windowStart = 0;
+  uint32_t _windowBytes = 0;
+  size_t _start = 0;
+  entry_t _queue[queueCapacity];
+};
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef LAZYMESHOTACAPTURE_H
+#define LAZYMESHOTACAPTURE_H
+
+#include <Arduino.h>
+
+// A capture records everything one instance received and decided, so
+// it can be replayed on the host with LazyMeshOtaReplay.  It starts with
+// captureMagic and captureVersion, followed by records, each a
+// CaptureRecord followed by 'len' bytes of payload.
+static constexpr char captureMagic[4] = {'L', 'M', 'O', 'C'};
+static constexpr uint8_t captureVersion = 1;
+
+struct __attribute__((packed)) CaptureRecord {
+  enum class Type : uint8_t {
+    // Payload: local address, bssid, int32_t version, sketch name.
+    BEGIN,
+    // A loop which did something.  No payload.
+    LOOP,
+    // Payload: int8_t rssi, then the frame.
+    RX,
+    // Payload: the frame.
+    TX,
+    // Payload: int32_t value returned.
+    RANDOM,
+    // Payload: CaptureState, then a description.
+    STATE,
+  };
+
+  Type type;
+  // Clock when the instance was called.
+  uint32_t millis;
+  uint32_t micros;
+  uint16_t len;
+};
+
+// Listener calls, recorded as state transitions.
+enum class CaptureState : uint8_t {
+  NEIGHBOR_SEEN,
+  START_UPGRADE,
+  DONE_UPGRADE,
+  SEND_PROGRESS,
+  REQUEST_CHUNK,
+  RECEIVE_TIMEOUT,
+  ERROR,
+};
+
+#endif
@@ -0,0 +1,275 @@
+#ifndef LAZYMESHOTACENSUS_H
+#define LAZYMESHOTACENSUS_H
+
+#include <Arduino.h>
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+// HyperLogLog sketches of which nodes have run each of the newest
+// 'maxVersions' versions of a sketch.  Sketches merge by taking the
+// larger of each register, so gossip converges on the same estimates
+// everywhere however often a node is counted.  Registers never go
+// down, so a node which has moved on to a newer version is still
+// counted for the ones it ran before.  Versions evicted to make room
+// for newer ones are merged into one sketch of older versions, so the
+// total still counts them.
+template <size_t maxVersions, size_t registers>
+class VersionCensus {
+ public:
+  static_assert(registers >= 16 && registers <= 64 && (registers & (registers - 1)) == 0,
+                "registers must be 16, 32 or 64");
+  static_assert(maxVersions > 0, "maxVersions must be positive");
+
+  // Register values are capped to fit in a hex digit.
+  static constexpr uint8_t maxRank = 15;
+  // Stands for all evicted versions.
+  static constexpr int olderVersions = INT_MIN;
+
+  // Counts 'node' as running 'version'.
+  void add(int version, const eth_addr& node) {
+    uint8_t* reg = _registers(version);
+    uint32_t h = hash(node);
+    uint32_t rest = h >> indexBits;
+    uint8_t rank = 1;
+    while (!(rest & 1) && rank < maxRank) {
+      rest >>= 1;
+      ++rank;
+    }
+    uint8_t& r = reg[h & (registers - 1)];
+    r = std::max(r, rank);
+  }
+
+  // Merges a field from an advertisement, "census <version> <registers>"
+  // with one hex digit per register, or "census older <registers>".
+  // Returns false if it isn't one.
+  bool parseField(const String& field) {
+    char which[12];
+    char hex[64 + 1];
+    if (sscanf(field.c_str(), "census %11s %64s", which, hex) != 2 ||
+        strlen(hex) != registers) {
+      return false;
+    }
+    int version;
+    if (strcmp(which, "older") == 0) {
+      version = olderVersions;
+    } else {
+      char* end;
+      long parsed = strtol(which, &end, 10);
+      if (*end || end == which || parsed <= INT_MIN || parsed > INT_MAX) {
+        return false;
+      }
+      version = parsed;
+    }
+    uint8_t incoming[registers];
+    for (size_t i = 0; i != registers; ++i) {
+      char ch = hex[i];
+      if (ch >= '0' && ch <= '9') {
+        incoming[i] = ch - '0';
+      } else if (ch >= 'a' && ch <= 'f') {
+        incoming[i] = ch - 'a' + 10;
+      } else {
+        return false;
+      }
+    }
+    uint8_t* reg = _registers(version);
+    for (size_t i = 0; i != registers; ++i) {
+      reg[i] = std::max(reg[i], incoming[i]);
+    }
+    return true;
+  }
+
+  // Advertisement fields for everything we know.
+  String fields() const {
+    String out;
+    for (const Slot& slot : _slots) {
+      if (slot.used) {
+        out += "census " + String(slot.version) + " " + _hex(slot.reg) + "\n";
+      }
+    }
+    if (_haveOlder) {
+      out += "census older " + _hex(_older) + "\n";
+    }
+    return out;
+  }
+
+  // Versions tracked, newest first.
+  size_t versions(int* out, size_t max) const {
+    size_t count = 0;
+    for (const Slot& slot : _slots) {
+      if (slot.used && count != max) {
+        out[count++] = slot.version;
+      }
+    }
+    std::sort(out, out + count, [](int a, int b) { return a > b; });
+    return count;
+  }
+
+  // Newest version tracked, or olderVersions if none.
+  int newest() const {
+    int newest = olderVersions;
+    for (const Slot& slot : _slots) {
+      if (slot.used) {
+        newest = std::max(newest, slot.version);
+      }
+    }
+    return newest;
+  }
+
+  // Estimated number of nodes which have ever run 'version', which may
+  // be olderVersions.  For the newest version, that's those running it.
+  uint32_t estimate(int version) const {
+    const uint8_t* reg = version == olderVersions ? (_haveOlder ? _older : nullptr)
+                                                  : _find(version);
+    return reg ? _estimate(reg) : 0;
+  }
+
+  // Estimated number of nodes counted at all.
+  uint32_t estimateTotal() const {
+    uint8_t all[registers];
+    _union(all);
+    return _estimate(all);
+  }
+
+  // True if every node counted is counted as running 'version'.
+  bool covers(int version) const {
+    const uint8_t* reg = _find(version);
+    if (!reg) {
+      return false;
+    }
+    uint8_t all[registers];
+    _union(all);
+    return memcmp(reg, all, registers) == 0;
+  }
+
+  void clear() {
+    for (Slot& slot : _slots) {
+      slot.used = false;
+    }
+    _haveOlder = false;
+  }
+
+  static uint32_t hash(const eth_addr& node) {
+    // FNV-1a, then a finalizer so every bit depends on the whole address.
+    uint32_t h = 2166136261u;
+    for (uint8_t byte : node.addr) {
+      h = (h ^ byte) * 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+  }
+
+ private:
+  static constexpr int indexBits = registers == 16 ? 4 : registers == 32 ? 5 : 6;
+
+  struct Slot {
+    int version = 0;
+    bool used = false;
+    uint8_t reg[registers];
+  };
+
+  const uint8_t* _find(int version) const {
+    for (const Slot& slot : _slots) {
+      if (slot.used && slot.version == version) {
+        return slot.reg;
+      }
+    }
+    return nullptr;
+  }
+
+  // Registers for 'version', making room for it if it's new.
+  uint8_t* _registers(int version) {
+    if (version == olderVersions) {
+      return _olderRegisters();
+    }
+    Slot* oldest = nullptr;
+    for (Slot& slot : _slots) {
+      if (!slot.used) {
+        if (!oldest || oldest->used) {
+          oldest = &slot;
+        }
+      } else if (slot.version == version) {
+        return slot.reg;
+      } else if (!oldest || (oldest->used && slot.version < oldest->version)) {
+        oldest = &slot;
+      }
+    }
+    if (oldest->used) {
+      if (version < oldest->version) {
+        return _olderRegisters();
+      }
+      uint8_t* older = _olderRegisters();
+      for (size_t i = 0; i != registers; ++i) {
+        older[i] = std::max(older[i], oldest->reg[i]);
+      }
+    }
+    oldest->used = true;
+    oldest->version = version;
+    memset(oldest->reg, 0, registers);
+    return oldest->reg;
+  }
+
+  uint8_t* _olderRegisters() {
+    if (!_haveOlder) {
+      _haveOlder = true;
+      memset(_older, 0, registers);
+    }
+    return _older;
+  }
+
+  void _union(uint8_t* all) const {
+    if (_haveOlder) {
+      memcpy(all, _older, registers);
+    } else {
+      memset(all, 0, registers);
+    }
+    for (const Slot& slot : _slots) {
+      if (slot.used) {
+        for (size_t i = 0; i != registers; ++i) {
+          all[i] = std::max(all[i], slot.reg[i]);
+        }
+      }
+    }
+  }
+
+  static uint32_t _estimate(const uint8_t* reg) {
+    float sum = 0;
+    size_t zeros = 0;
+    for (size_t i = 0; i != registers; ++i) {
+      sum += 1.0f / float(1u << reg[i]);
+      zeros += !reg[i];
+    }
+    if (zeros == registers) {
+      return 0;
+    }
+    float alpha = registers == 16 ? 0.673f : registers == 32 ? 0.697f : 0.709f;
+    float e = alpha * registers * registers / sum;
+    if (e <= 2.5f * registers && zeros) {
+      // Linear counting is better for small counts.
+      e = registers * logf(float(registers) / zeros);
+    }
+    return uint32_t(e + 0.5f);
+  }
+
+  static String _hex(const uint8_t* reg) {
+    char hex[registers + 1];
+    for (size_t i = 0; i != registers; ++i) {
+      hex[i] = "0123456789abcdef"[reg[i]];
+    }
+    hex[registers] = 0;
+    return hex;
+  }
+
+  Slot _slots[maxVersions];
+  bool _haveOlder = false;
+  uint8_t _older[registers];
+};
+
+#endif
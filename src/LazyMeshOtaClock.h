@@ -0,0 +1,26 @@
+#ifndef LAZYMESHOTACLOCK_H
+#define LAZYMESHOTACLOCK_H
+
+#include <Arduino.h>
+
+// Where LazyMeshOta gets the time and random numbers.  Replays of a
+// capture substitute their own.
+class LazyMeshOtaClock {
+ public:
+  virtual ~LazyMeshOtaClock() = default;
+
+  virtual uint32_t millis() = 0;
+  virtual uint32_t micros() = 0;
+  // Returns a random number in [min, max).
+  virtual long random(long min, long max) = 0;
+};
+
+// The real clock and random number generator.  This is the default.
+class SystemClock : public LazyMeshOtaClock {
+ public:
+  uint32_t millis() override { return ::millis(); }
+  uint32_t micros() override { return ::micros(); }
+  long random(long min, long max) override { return ::random(min, max); }
+};
+
+#endif
@@ -0,0 +1,165 @@
+#if defined(EPOXY_DUINO) && defined(__linux__)
+
+#include "LazyMeshOtaFileImage.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "LazyMeshOta.h"
+
+constexpr size_t FileImageSink::batchSize;
+
+MappedFileImageSource::MappedFileImageSource(const char* path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size <= 0 || uint64_t(st.st_size) > UINT32_MAX) {
+    close(fd);
+    return;
+  }
+  void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  // The mapping stays valid after the file is closed.
+  close(fd);
+  if (data == MAP_FAILED) {
+    return;
+  }
+  _data = (uint8_t*)data;
+  _manifestSize = prebuiltManifestLength(_data, st.st_size);
+  _size = st.st_size - _manifestSize;
+}
+
+MappedFileImageSource::~MappedFileImageSource() {
+  if (_data) {
+    munmap(_data, _size + _manifestSize);
+  }
+}
+
+bool MappedFileImageSource::read(uint32_t offset, uint8_t* data, size_t len) {
+  if (!_data || offset > _size || len > _size - offset) {
+    return false;
+  }
+  memcpy(data, _data + offset, len);
+  return true;
+}
+
+bool MappedFileImageSource::readManifest(uint32_t offset, uint8_t* data, size_t len) {
+  if (offset > _manifestSize || len > _manifestSize - offset) {
+    return false;
+  }
+  memcpy(data, _data + _size + offset, len);
+  return true;
+}
+
+void MappedFileImageSource::readAhead(uint32_t offset, size_t len) {
+  if (!_data || offset >= _size) {
+    return;
+  }
+  len = std::min<size_t>(len, _size - offset);
+  // madvise wants a page aligned start.
+  size_t pageMask = sysconf(_SC_PAGESIZE) - 1;
+  size_t start = offset & ~pageMask;
+  madvise(_data + start, offset + len - start, MADV_WILLNEED);
+}
+
+FileImageSink::FileImageSink(const char* path, uint32_t capacity)
+    : _path(path), _capacity(capacity) {}
+
+FileImageSink::~FileImageSink() {
+  if (_fd >= 0) {
+    close(_fd);
+  }
+}
+
+bool FileImageSink::begin(uint32_t size, const char* md5) {
+  if (_fd >= 0) {
+    close(_fd);
+  }
+  _fd = open(_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  _size = size;
+  _flushed = 0;
+  _batchLen = 0;
+  _complete = false;
+  _md5 = md5;
+  _hasher.begin();
+  if (_fd < 0) {
+    _error = "Could not open " + _path;
+    return false;
+  }
+  _error = String();
+  return true;
+}
+
+size_t FileImageSink::write(const uint8_t* data, size_t len) {
+  if (_fd < 0) {
+    return 0;
+  }
+  len = std::min<size_t>(len, _size - _flushed - _batchLen);
+  size_t taken = 0;
+  while (taken != len) {
+    if (_batchLen == batchSize && !_writeBatch()) {
+      break;
+    }
+    size_t chunk = std::min(len - taken, batchSize - _batchLen);
+    memcpy(_batch + _batchLen, data + taken, chunk);
+    _hasher.add(data + taken, chunk);
+    _batchLen += chunk;
+    taken += chunk;
+  }
+  return taken;
+}
+
+void FileImageSink::flush() {
+  if (_fd >= 0 && _batchLen == batchSize) {
+    _writeBatch();
+  }
+}
+
+bool FileImageSink::_writeBatch() {
+  ssize_t written = pwrite(_fd, _batch, _batchLen, _flushed);
+  if (written != ssize_t(_batchLen)) {
+    _error = "Writing " + _path + " failed";
+    return false;
+  }
+  _flushed += _batchLen;
+  _batchLen = 0;
+  return true;
+}
+
+bool FileImageSink::end() {
+  if (_fd < 0) {
+    return false;
+  }
+  if (_batchLen && !_writeBatch()) {
+    return false;
+  }
+  if (_flushed != _size) {
+    _error = "Wrong size; got " + String(_flushed) + " but expected " + String(_size);
+    return false;
+  }
+  uint8_t md5[ManifestHasher::hashSize];
+  _hasher.finish(md5);
+  String hex = LazyMeshOtaBase::hashToString(md5);
+  if (_md5 != hex) {
+    _error = "Expected md5 " + _md5 + " but got " + hex;
+    return false;
+  }
+  _complete = true;
+  return true;
+}
+
+uint32_t FileImageSink::readableSize(uint32_t written) const {
+  return std::min(written, _flushed);
+}
+
+bool FileImageSink::readBack(uint32_t offset, uint8_t* data, size_t len) {
+  if (_fd < 0 || offset > _flushed || len > _flushed - offset) {
+    return false;
+  }
+  return pread(_fd, data, len, offset) == ssize_t(len);
+}
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef LAZYMESHOTAFILEIMAGE_H
+#define LAZYMESHOTAFILEIMAGE_H
+
+#include "LazyMeshOtaImage.h"
+
+#if defined(EPOXY_DUINO) && defined(__linux__)
+
+// An image file mapped into memory.  Pages are only read in as they
+// are used, and are shared with every other mapping of the same file,
+// so any number of simulated nodes can run one multi-megabyte image.
+// A prebuilt manifest at the end of the file isn't part of the image.
+class MappedFileImageSource : public LazyMeshOtaImageSource {
+ public:
+  explicit MappedFileImageSource(const char* path);
+  ~MappedFileImageSource();
+
+  // False if the file couldn't be mapped.
+  bool ok() const { return _data != nullptr; }
+  // The whole image, e.g. for FakeUpdateContext.
+  const uint8_t* data() const { return _data; }
+
+  uint32_t size() override { return _size; }
+  bool read(uint32_t offset, uint8_t* data, size_t len) override;
+  void readAhead(uint32_t offset, size_t len) override;
+  bool readManifest(uint32_t offset, uint8_t* data, size_t len) override;
+
+ private:
+  uint8_t* _data = nullptr;
+  uint32_t _size = 0;
+  uint32_t _manifestSize = 0;
+};
+
+// Streams an update to a file, a batch at a time.  Like Updater, only
+// whole batches which have been written out can be read back until
+// the update ends.
+class FileImageSink : public LazyMeshOtaImageSink {
+ public:
+  static constexpr size_t batchSize = 4096;
+
+  FileImageSink(const char* path, uint32_t capacity);
+  ~FileImageSink();
+
+  // True once an image has ended successfully.
+  bool complete() const { return _complete; }
+
+  uint32_t freeSpace() override { return _capacity; }
+  bool begin(uint32_t size, const char* md5) override;
+  size_t write(const uint8_t* data, size_t len) override;
+  void flush() override;
+  bool end() override;
+  void printError(Print& out) override { out.print(_error); }
+
+  uint32_t readableSize(uint32_t written) const override;
+  bool readBack(uint32_t offset, uint8_t* data, size_t len) override;
+
+ private:
+  bool _writeBatch();
+
+  String _path;
+  uint32_t _capacity;
+  int _fd = -1;
+  uint32_t _size = 0;
+  // Bytes written to the file so far.
+  uint32_t _flushed = 0;
+  bool _complete = false;
+  String _md5;
+  String _error;
+  ManifestHasher _hasher;
+  size_t _batchLen = 0;
+  uint8_t _batch[batchSize];
+};
+
+#endif
+
+#endif
@@ -0,0 +1,217 @@
+#ifndef LAZYMESHOTAIMAGE_H
+#define LAZYMESHOTAIMAGE_H
+
+#include <Arduino.h>
+#include <stdlib.h>
+
+#include "LazyMeshOtaManifest.h"
+#include "LazyMeshOtaPrebuilt.h"
+
+#if defined(EPOXY_DUINO)
+#include "fake_update.h"
+#else
+#include <Updater.h>
+#include <flash_hal.h>
+
+// If not testing, run real versions of these functions from the ESP core.
+static inline bool flashRead(uint32_t address, uint8_t* data, size_t size) {
+  return ESP.flashRead(address, data, size);
+}
+
+static inline uint32_t getFreeSketchSpace() { return ESP.getFreeSketchSpace(); }
+
+static inline uint32_t getSketchSize() { return ESP.getSketchSize(); }
+
+// Where Updater puts a new image of the given size; see Updater::begin.
+static inline uint32_t updateStartAddress(uint32_t imageSize) {
+  uint32_t roundedSize = (imageSize + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1);
+  uint32_t updateEndAddress = FS_PHYS_ADDR;
+  return updateEndAddress > roundedSize ? updateEndAddress - roundedSize : 0;
+}
+
+static inline bool updateFlashRead(uint32_t imageSize, uint32_t offset, uint8_t* data,
+                                   size_t size) {
+  return ESP.flashRead(updateStartAddress(imageSize) + offset, data, size);
+}
+
+// Updater buffers a sector at a time, so only whole sectors of what
+// we've written have reached flash.
+static inline uint32_t updateFlashedSize(uint32_t written) {
+  return written & ~(FLASH_SECTOR_SIZE - 1);
+}
+#endif
+
+// Where the running image comes from, to hash it and serve it to
+// neighbors.
+class LazyMeshOtaImageSource {
+ public:
+  virtual ~LazyMeshOtaImageSource() = default;
+
+  virtual uint32_t size() = 0;
+  // Reads 'len' bytes at 'offset'.  Returns false on failure.
+  virtual bool read(uint32_t offset, uint8_t* data, size_t len) = 0;
+  // Hint that the given range will be read soon.
+  virtual void readAhead(uint32_t /* offset */, size_t /* len */) {}
+  // Reads 'len' bytes at 'offset' in the prebuilt manifest stored after
+  // the image.  Returns false if there isn't one there.
+  virtual bool readManifest(uint32_t /* offset */, uint8_t* /* data */, size_t /* len */) {
+    return false;
+  }
+};
+
+// Where an update is written.  Once begun, what has been written can
+// be read back to relay it to neighbors, both during the update and
+// after it has ended successfully.
+class LazyMeshOtaImageSink {
+ public:
+  virtual ~LazyMeshOtaImageSink() = default;
+
+  // Largest image that can be written.
+  virtual uint32_t freeSpace() = 0;
+  // Starts an image of the given size, which must match the given md5
+  // (as lowercase hex) to end successfully.
+  virtual bool begin(uint32_t size, const char* md5) = 0;
+  // Appends to the image, returning how much was taken.  May be
+  // buffered until the next flush.
+  virtual size_t write(const uint8_t* data, size_t len) = 0;
+  // Called once per loop while an update is in progress, so sinks
+  // which batch writes can write them out.
+  virtual void flush() {}
+  // Finishes the image.  Returns false if it is incomplete or doesn't
+  // match its md5; this is also how an update is abandoned.
+  virtual bool end() = 0;
+  virtual void printError(Print& /* out */) {}
+
+  // How much of the first 'written' bytes can be read back.
+  virtual uint32_t readableSize(uint32_t written) const = 0;
+  virtual bool readBack(uint32_t offset, uint8_t* data, size_t len) = 0;
+};
+
+// The running sketch in flash.  This is the default source.
+class FlashImageSource : public LazyMeshOtaImageSource {
+ public:
+  uint32_t size() override { return getSketchSize(); }
+  bool read(uint32_t offset, uint8_t* data, size_t len) override {
+    return flashRead(offset, data, len);
+  }
+  // Flashed along with the sketch, the manifest follows it.
+  bool readManifest(uint32_t offset, uint8_t* data, size_t len) override {
+    return flashRead(getSketchSize() + offset, data, len);
+  }
+};
+
+// The ESP core's Updater.  This is the default sink.
+class UpdaterImageSink : public LazyMeshOtaImageSink {
+ public:
+  uint32_t freeSpace() override { return getFreeSketchSpace(); }
+  bool begin(uint32_t size, const char* md5) override {
+    _size = size;
+    if (!Update.begin(size)) {
+      return false;
+    }
+    Update.runAsync(true);
+    return Update.setMD5(md5);
+  }
+  size_t write(const uint8_t* data, size_t len) override {
+    return Update.write(const_cast<uint8_t*>(data), len);
+  }
+  bool end() override { return Update.end(); }
+  void printError(Print& out) override { Update.printError(out); }
+
+  uint32_t readableSize(uint32_t written) const override { return updateFlashedSize(written); }
+  bool readBack(uint32_t offset, uint8_t* data, size_t len) override {
+    return updateFlashRead(_size, offset, data, len);
+  }
+
+ private:
+  uint32_t _size = 0;
+};
+
+// An image already in memory, which must outlive the source.  A
+// prebuilt manifest at the end isn't part of the image.
+class RamImageSource : public LazyMeshOtaImageSource {
+ public:
+  RamImageSource(const uint8_t* data, uint32_t size)
+      : _data(data), _size(size), _manifestSize(prebuiltManifestLength(data, size)) {
+    _size -= _manifestSize;
+  }
+
+  uint32_t size() override { return _size; }
+  bool read(uint32_t offset, uint8_t* data, size_t len) override {
+    if (offset > _size || len > _size - offset) {
+      return false;
+    }
+    memcpy(data, _data + offset, len);
+    return true;
+  }
+  bool readManifest(uint32_t offset, uint8_t* data, size_t len) override {
+    if (offset > _manifestSize || len > _manifestSize - offset) {
+      return false;
+    }
+    memcpy(data, _data + _size + offset, len);
+    return true;
+  }
+
+ private:
+  const uint8_t* _data;
+  uint32_t _size;
+  uint32_t _manifestSize;
+};
+
+// Collects an update in memory, allocated when it begins.
+class RamImageSink : public LazyMeshOtaImageSink {
+ public:
+  explicit RamImageSink(uint32_t capacity) : _capacity(capacity) {}
+  ~RamImageSink() { free(_data); }
+
+  // The image, once it has ended successfully; otherwise null.
+  const uint8_t* data() const { return _complete ? _data : nullptr; }
+  uint32_t size() const { return _size; }
+
+  uint32_t freeSpace() override { return _capacity; }
+  bool begin(uint32_t size, const char* md5) override {
+    free(_data);
+    _data = size ? (uint8_t*)malloc(size) : nullptr;
+    if (size && !_data) {
+      _error = "Out of memory";
+      return false;
+    }
+    _size = size;
+    _written = 0;
+    _complete = false;
+    _md5 = md5;
+    _error = String();
+    _hasher.begin();
+    return true;
+  }
+  size_t write(const uint8_t* data, size_t len) override {
+    len = std::min<size_t>(len, _size - _written);
+    memcpy(_data + _written, data, len);
+    _hasher.add(data, len);
+    _written += len;
+    return len;
+  }
+  bool end() override;
+  void printError(Print& out) override { out.print(_error); }
+
+  uint32_t readableSize(uint32_t written) const override { return written; }
+  bool readBack(uint32_t offset, uint8_t* data, size_t len) override {
+    if (offset > _written || len > _written - offset) {
+      return false;
+    }
+    memcpy(data, _data + offset, len);
+    return true;
+  }
+
+ private:
+  uint32_t _capacity;
+  uint8_t* _data = nullptr;
+  uint32_t _size = 0;
+  uint32_t _written = 0;
+  bool _complete = false;
+  String _md5;
+  String _error;
+  ManifestHasher _hasher;
+};
+
+#endif
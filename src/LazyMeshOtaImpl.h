@@ -0,0 +1,2801 @@
+#ifndef LAZYMESHOTAIMPL_H
+#define LAZYMESHOTAIMPL_H
+
+// Implementation of BasicLazyMeshOta.  Only needs to be included
+// directly when instantiating BasicLazyMeshOta with a configuration
+// other than LazyMeshOtaConfig.
+
+#include <LazyMeshOta.h>
+#include <stdio.h>
+
+#include <cerrno>
+#include <functional>
+#include <new>
+#if !defined(EPOXY_DUINO)
+#include <Schedule.h>
+#else
+static inline void schedule_function(const std::function<void(void)>& f) {
+  // For testing, just do it now instead of waiting for later.
+  f();
+}
+static inline void schedule_recurrent_function_us(const std::function<bool(void)>& f, uint32_t) {
+  // For testing, just do it now instead of waiting for later.
+  f();
+}
+
+#endif
+
+#if !defined(EPOXY_DUINO)
+// If not testing, run real versions of these functions from the ESP core.
+static inline uint32_t getChipId() { return ESP.getChipId(); }
+
+static inline bool concatString(String* str, char* buf, size_t len) {
+  return str->concat(buf, len);
+}
+
+static inline void espRestart() { ESP.restart(); }
+
+static inline bool rtcUserMemoryRead(uint32_t offset, uint32_t* data, size_t size) {
+  return ESP.rtcUserMemoryRead(offset, data, size);
+}
+
+static inline bool rtcUserMemoryWrite(uint32_t offset, uint32_t* data, size_t size) {
+  return ESP.rtcUserMemoryWrite(offset, data, size);
+}
+
+#else
+
+// Epoxy duino doesn't allow us to concatinate more than one character at once.
+static inline bool concatString(String* str, char* buf, size_t len) {
+  while (len) {
+    if (!str->concat(*buf++)) {
+      return false;
+    }
+    len--;
+  }
+  return true;
+}
+
+#endif
+
+static constexpr eth_addr ethBroadcast = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
+template <typename Config>
+constexpr uint32_t BasicLazyMeshOta<Config>::advertiseInterval;
+template <typename Config>
+constexpr uint32_t BasicLazyMeshOta<Config>::receiveTimeoutInterval;
+template <typename Config>
+constexpr uint16_t BasicLazyMeshOta<Config>::bufferSize;
+template <typename Config>
+constexpr uint16_t BasicLazyMeshOta<Config>::maxRetries;
+template <typename Config>
+constexpr int BasicLazyMeshOta<Config>::tracePackets;
+template <typename Config>
+constexpr size_t BasicLazyMeshOta<Config>::traceRingSize;
+template <typename Config>
+constexpr uint32_t BasicLazyMeshOta<Config>::md5SliceSize;
+template <typename Config>
+constexpr int BasicLazyMeshOta<Config>::md5CacheRtcOffset;
+template <typename Config>
+constexpr uint8_t BasicLazyMeshOta<Config>::streamWindow;
+template <typename Config>
+constexpr uint8_t BasicLazyMeshOta<Config>::streamBurst;
+template <typename Config>
+constexpr uint32_t BasicLazyMeshOta<Config>::streamPacing;
+template <typename Config>
+constexpr uint32_t BasicLazyMeshOta<Config>::streamNackInterval;
+template <typename Config>
+constexpr bool BasicLazyMeshOta<Config>::relayPartial;
+template <typename Config>
+constexpr uint32_t BasicLazyMeshOta<Config>::relayAdvertiseInterval;
+template <typename Config>
+constexpr uint32_t BasicLazyMeshOta<Config>::airtimeControlReserve;
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_debugPutchar(int ch) {
+  // Can't run this in the recurrent function, so schedule it for later.
+  if (tracePackets) {
+    schedule_function([ch]() { putchar(ch); });
+  }
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_tracePacket(uint8_t* pkt, uint32_t len, uint32_t hdr_start) {
+  Serial.println("Packet of length " + String(len) + " hdr_start=" + String(hdr_start));
+  if (len >= sizeof(hdr_t)) {
+    hdr_t* hdr = reinterpret_cast<hdr_t*>(pkt);
+    Serial.println("From: " + ethToString(hdr->src) + " To: " + ethToString(hdr->dest) +
+                   " BSSID: " + ethToString(hdr->bssid) +
+                   " PktType: " + String(int(hdr->packetType)));
+  }
+  if (tracePackets > 3) {
+    for (uint32_t i = 0; i != len; ++i) {
+      if ((i & 7) == 0) {
+        Serial.printf("\n@%d: ", i);
+      }
+      if (i == hdr_start || i == (hdr_start + sizeof(hdr_t))) {
+        Serial.print("*");
+      } else {
+        Serial.print(" ");
+      }
+      Serial.printf("%02x %c", pkt[i], isprint(pkt[i]) ? pkt[i] : ' ');
+    }
+  }
+  Serial.print("\n");
+}
+
+/* Should we generate an 802.2 SNAP header inside of the 802.11 data packet?
+ According to
+https://legal.vvv.enseirb-matmeca.fr/download/amichel/%5BStandard%20LDPC%5D%20802.11-2012.pdf
+
+The frame body consists of either:
+— The MSDU (or a fragment thereof), the Mesh Control field (present if the frame is transmitted by a
+mesh STA and the Mesh Control Present subfield of the QoS Control field is 1, otherwise absent),
+and a security header and trailer (present if the Protected Frame subfield in the Frame Control
+field is 1, otherwise absent) — The A-MSDU and a security header and trailer (present if the
+Protected Frame subfield in the Frame Control field is 1, otherwise absen
+
+
+...
+
+all MSDUs are LLC PDUs as
+defined in ISO/IEC 8802-2: 1998
+
+
+*/
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::begin(String sketchName, int version) {
+  MemoryScope memoryScope(this, MemoryEntry::BEGIN);
+  _tick();
+  _localEthAddr = _transport->macAddress();
+  if (_capture) {
+    _capture->write((const uint8_t*)captureMagic, sizeof(captureMagic));
+    _capture->write(captureVersion);
+    uint8_t fields[sizeof(eth_addr) * 2 + sizeof(int32_t)];
+    eth_addr bssid = _transport->bssid();
+    int32_t version32 = version;
+    memcpy(fields, &_localEthAddr, sizeof(eth_addr));
+    memcpy(fields + sizeof(eth_addr), &bssid, sizeof(eth_addr));
+    memcpy(fields + sizeof(eth_addr) * 2, &version32, sizeof(version32));
+    _captureRecord(CaptureRecord::Type::BEGIN, fields, sizeof(fields),
+                   (const uint8_t*)sketchName.c_str(), sketchName.length());
+  }
+
+  _localSketchName = sketchName;
+  _localSketchSize = _imageSource->size();
+  _localVersion = version;
+
+  // Hashing the whole sketch takes a while, so it's done a slice at a
+  // time from _loop unless it was prebuilt or we remember it from
+  // before a warm reboot.
+  _localSketchMd5 = String();
+  _localSketchHashed = 0;
+  _localSketchHasher.begin();
+  _haveLocalManifest = false;
+  _buildingManifest = false;
+  bool md5Known = _loadPrebuiltManifest() ||
+                  (md5CacheRtcOffset >= 0 &&
+                   _loadMd5Cache(md5CacheRtcOffset, _localSketchName, _localVersion,
+                                 _localSketchSize, &_localSketchMd5));
+  if (useManifest && !_haveLocalManifest && _beginManifest()) {
+    // The hash tree has to be hashed from flash anyway, and the md5
+    // comes along with it.
+    md5Known = false;
+    _localSketchMd5 = String();
+    _localSketchHashed = 0;
+  }
+  if (md5Known) {
+    _localMd5Ready();
+  }
+
+  if (airtimeBytesPerSecond) {
+    _airtime.begin(airtimeBytesPerSecond, airtimeBurstBytes, _nowMicros);
+  }
+  // What needed nothing from us depends on our version.
+  _advertCache.clear();
+  if (censusVersions) {
+    _census.clear();
+    _census.add(_localVersion, _localEthAddr);
+    _lastStaleAdvert = _nowMillis;
+  }
+  if (rendezvousPeriod) {
+    // Listen for a schedule to join before keeping our own.
+    _rendezvousAnchor = _localEthAddr;
+    _rendezvousStart = _nowMillis;
+    _rendezvousListenUntil = _nowMillis + rendezvousListenTime;
+    _nextRendezvousListen = _rendezvousListenUntil + rendezvousScanPeriods * rendezvousPeriod;
+    _lastServed = _nowMillis - receiveTimeoutInterval;
+    _setRadio(true);
+  }
+
+  // Don't have everything advertise all at once.
+  _nextAdvertise = _nowMillis + _random(advertiseInterval * 2 / 2, advertiseInterval * 3 / 2);
+
+  _scheduleWake();
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::end() {
+  if (_update) {
+    _imageSink->end();
+    _deleteUpdate();
+  }
+  _unregisterWifi();
+  delete _pendingOffer;
+  _pendingOffer = nullptr;
+  if (rendezvousPeriod) {
+    // Leave the radio as we found it.
+    _setRadio(true);
+  }
+  _terminate = true;
+  _scheduleWake();
+}
+
+template <typename Config>
+uint32_t BasicLazyMeshOta<Config>::millisUntilWork() const {
+  if (!_localSketchMd5.length() || _streamSource.active) {
+    return 0;
+  }
+  // Advertisements and timeouts are due once strictly past their time.
+  int32_t wait = _nextAdvertise + 1 - _nowMillis;
+  if (airtimeBytesPerSecond && _airtime.stats.queuedFrames) {
+    // Queued image data goes once the budget has refilled enough.
+    uint32_t micros = _airtime.microsUntilReady(airtimeControlReserve, _nowMicros);
+    wait = std::min<int32_t>(wait, (micros + 999) / 1000);
+  }
+  if (_update) {
+    wait = std::min<int32_t>(wait, _nextReceiveTimeout + 1 - _nowMillis);
+    if (_relaying() && _relayAvailable() > _relayAdvertised) {
+      wait = std::min<int32_t>(wait, _nextRelayAdvertise - _nowMillis);
+    }
+  }
+  if (_updateStream && _updateStream->gap) {
+    wait = std::min<int32_t>(wait, _updateStream->nextNack - _nowMillis);
+  }
+  if (_pendingOffer) {
+    wait = std::min<int32_t>(wait, _pendingOffer->deadline - _nowMillis);
+  }
+  if (aggregateWindow && !_aggregate.empty()) {
+    uint32_t waited = _nowMicros - _aggregate.start();
+    wait = std::min<int32_t>(
+        wait, waited >= aggregateWindow ? 0 : (aggregateWindow - waited + 999) / 1000);
+  }
+  if (rendezvousPeriod) {
+    if (_radioOn != _radioWanted()) {
+      return 0;
+    }
+    wait = std::min<int32_t>(wait, _millisUntilRadioChange());
+  }
+  return std::max<int32_t>(wait, 0);
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_scheduleWake() {
+#if !defined(EPOXY_DUINO)
+  if (!_wakeTimerReady) {
+    os_timer_setfn(&_wakeTimer, &BasicLazyMeshOta::_onWakeTimer, this);
+    _wakeTimerReady = true;
+  }
+  os_timer_disarm(&_wakeTimer);
+  if (_terminate) {
+    return;
+  }
+  uint32_t wait = millisUntilWork();
+  if (wait) {
+    os_timer_arm(&_wakeTimer, wait, false /* repeat */);
+  } else {
+    _onWakeTimer(this);
+  }
+#endif
+}
+
+#if !defined(EPOXY_DUINO)
+template <typename Config>
+void BasicLazyMeshOta<Config>::_onWakeTimer(void* arg) {
+  BasicLazyMeshOta* ota = static_cast<BasicLazyMeshOta*>(arg);
+  if (!ota->_loopScheduled) {
+    ota->_loopScheduled = true;
+    schedule_function(std::bind(&BasicLazyMeshOta::_loop, ota));
+  }
+}
+#endif
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_loop() {
+  MemoryScope memoryScope(this, MemoryEntry::LOOP);
+#if !defined(EPOXY_DUINO)
+  _loopScheduled = false;
+#endif
+  if (_terminate) {
+    if (tracePackets > 1) {
+      Serial.print("&");
+    }
+    return;
+  }
+  if (tracePackets > 1) {
+    Serial.print("*");
+  }
+  _tick();
+  _captureLoopPending = true;
+  if (!_localSketchMd5.length()) {
+    // Replays need to hash as much as we did.
+    _captureRecord(CaptureRecord::Type::LOOP, nullptr, 0);
+    _hashSketchSlice();
+  }
+
+  if (airtimeBytesPerSecond) {
+    uint16_t len;
+    while (uint8_t* frame = _airtime.popReady(&len, airtimeControlReserve, _nowMicros)) {
+      _sendFrame(frame, len, true /* bulk */);
+    }
+  }
+
+  if (_update) {
+    // Write out what arrived since the last loop before telling
+    // anyone relaying through us about it.
+    _imageSink->flush();
+  }
+
+  uint32_t cur = _nowMillis;
+
+  if (_update && _relaying() && _relayAvailable() > _relayAdvertised &&
+      int32_t(cur - _nextRelayAdvertise) >= 0) {
+    // Let anyone downloading from us know there's more.
+    _advertise();
+    _nextRelayAdvertise = cur + relayAdvertiseInterval;
+  }
+
+  if (int32_t(cur - _nextAdvertise) > 0 && _localSketchMd5.length()) {
+    if (rendezvousPeriod && _rendezvousPhase() >= rendezvousWindow) {
+      // Wait for the next window, when neighbors are listening.
+      _nextAdvertise =
+          cur + (rendezvousPeriod - _rendezvousPhase()) + _random(0, rendezvousWindow / 2);
+    } else {
+      _advertise();
+      uint32_t interval = converged() ? convergedAdvertiseInterval : advertiseInterval;
+      _nextAdvertise = _nowMillis + _random(interval * 2 / 2, interval * 3 / 2);
+    }
+  }
+
+  if (_pendingOffer && int32_t(cur - _pendingOffer->deadline) >= 0) {
+    _startPendingOffer();
+  }
+
+  if (_update && int32_t(cur - _nextReceiveTimeout) > 0) {
+    _receiveTimeout();
+  } else if (_updateStream && _updateStream->gap &&
+             int32_t(cur - _updateStream->nextNack) >= 0) {
+    _requestNextBlock();
+  }
+
+  if (_streamSource.active) {
+    _streamSend();
+  }
+
+  if (aggregateWindow && !_aggregate.empty() &&
+      _nowMicros - _aggregate.start() >= aggregateWindow) {
+    _flushAggregate();
+  }
+  if (rendezvousPeriod) {
+    _updateRadio();
+  }
+  _captureLoopPending = false;
+  _scheduleWake();
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_memoryCheck(MemoryEntry entry, uint32_t stack, uint32_t heap) {
+  if ((!memoryStackBudget || stack <= memoryStackBudget) &&
+      (!memoryHeapBudget || heap <= memoryHeapBudget)) {
+    return;
+  }
+  ++_memory[size_t(entry)].overBudget;
+  static const char* const entryNames[] = {"begin", "loop", "receive"};
+  schedule_function(std::bind(&Listener::onError, _listener,
+                              String(entryNames[size_t(entry)]) + " used " + String(stack) +
+                                  " bytes of stack and " + String(heap) +
+                                  " bytes of heap, over budget"));
+}
+
+template <typename Config>
+bool BasicLazyMeshOta<Config>::_radioWanted() const {
+  return int32_t(_nowMillis - _rendezvousListenUntil) < 0 ||
+         _rendezvousPhase() < rendezvousWindow || _update || _pendingOffer ||
+         _streamSource.active || (airtimeBytesPerSecond && _airtime.stats.queuedFrames) ||
+         (aggregateWindow && !_aggregate.empty()) ||
+         _nowMillis - _lastServed < receiveTimeoutInterval;
+}
+
+template <typename Config>
+uint32_t BasicLazyMeshOta<Config>::_millisUntilRadioChange() const {
+  uint32_t phase = _rendezvousPhase();
+  uint32_t wait = phase < rendezvousWindow ? rendezvousWindow - phase : rendezvousPeriod - phase;
+  int32_t listening = _rendezvousListenUntil - _nowMillis;
+  if (listening > 0) {
+    wait = std::min<uint32_t>(wait, listening);
+  }
+  if (rendezvousScanPeriods) {
+    wait = std::min<uint32_t>(wait, std::max<int32_t>(_nextRendezvousListen - _nowMillis, 0));
+  }
+  uint32_t served = _nowMillis - _lastServed;
+  if (served < receiveTimeoutInterval) {
+    wait = std::min<uint32_t>(wait, receiveTimeoutInterval - served);
+  }
+  return wait;
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_updateRadio() {
+  // Keep the start of the period recent, so it never wraps.
+  _rendezvousStart = _nowMillis - _rendezvousPhase();
+  if (rendezvousScanPeriods && int32_t(_nowMillis - _nextRendezvousListen) >= 0) {
+    _rendezvousListenUntil = _nowMillis + rendezvousListenTime;
+    _nextRendezvousListen = _rendezvousListenUntil + rendezvousScanPeriods * rendezvousPeriod;
+  }
+  _setRadio(_radioWanted());
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_setRadio(bool on) {
+  if (on == _radioOn) {
+    return;
+  }
+  if (tracePackets > 1) {
+    Serial.println(on ? "Radio on" : "Radio off");
+  }
+  _radioOn = on;
+  _transport->setRadioOn(on);
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_noteRendezvous(const uint8_t* data, uint16_t len) {
+  // Fields follow the sketch name, version, size, md5 and bssid.
+  static const char prefix[] = "rendezvous ";
+  const char* pos = (const char*)data;
+  const char* end = pos + len;
+  for (int line = 0; pos < end; ++line) {
+    const char* nl = (const char*)memchr(pos, '\n', end - pos);
+    const char* lineEnd = nl ? nl : end;
+    size_t lineLen = lineEnd - pos;
+    char field[48];
+    if (line < 5 || lineLen >= sizeof(field) || lineLen < sizeof(prefix) ||
+        memcmp(pos, prefix, sizeof(prefix) - 1) != 0) {
+      pos = lineEnd + 1;
+      continue;
+    }
+    memcpy(field, pos, lineLen);
+    field[lineLen] = 0;
+    unsigned long theirs;
+    char anchorStr[18];
+    eth_addr anchor;
+    if (sscanf(field, "rendezvous %lu %17s", &theirs, anchorStr) != 2 ||
+        theirs >= rendezvousPeriod || !ethFromString(&anchor, anchorStr)) {
+      return;
+    }
+    int cmp = memcmp(&anchor, &_rendezvousAnchor, sizeof(anchor));
+    uint32_t phase;
+    if (cmp > 0) {
+      // They'll follow us once they hear us.
+      return;
+    } else if (cmp < 0) {
+      if (tracePackets > 1) {
+        Serial.println("Following the rendezvous schedule of " + String(anchorStr));
+      }
+      _rendezvousAnchor = anchor;
+      phase = theirs;
+      // Found a schedule, so stop looking.
+      _rendezvousListenUntil = _nowMillis;
+    } else if (memcmp(&anchor, &_localEthAddr, sizeof(anchor)) == 0) {
+      // Everyone else follows us.
+      return;
+    } else {
+      // Split the difference with another follower, to make up for
+      // clock drift.
+      uint32_t ours = _rendezvousPhase();
+      int32_t diff = int32_t(ours - theirs);
+      if (diff > int32_t(rendezvousPeriod / 2)) {
+        diff -= rendezvousPeriod;
+      } else if (diff <= -int32_t(rendezvousPeriod / 2)) {
+        diff += rendezvousPeriod;
+      }
+      int64_t shifted = int64_t(ours) - diff / 2;
+      phase = shifted < 0                         ? shifted + rendezvousPeriod
+              : shifted >= int64_t(rendezvousPeriod) ? shifted - rendezvousPeriod
+                                                     : shifted;
+    }
+    _rendezvousStart = _nowMillis - phase;
+    return;
+  }
+}
+
+template <typename Config>
+long BasicLazyMeshOta<Config>::_random(long min, long max) {
+  long value = _clock->random(min, max);
+  int32_t value32 = value;
+  _captureRecord(CaptureRecord::Type::RANDOM, (const uint8_t*)&value32, sizeof(value32));
+  return value;
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::setCapture(Print* out) {
+  if (out && !_capture) {
+    _captureListener.owner = this;
+    _captureListener.next = _listener;
+    _listener = &_captureListener;
+  } else if (!out && _capture) {
+    _listener = _captureListener.next;
+  }
+  _capture = out;
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_captureRecord(CaptureRecord::Type type, const uint8_t* data,
+                                              size_t len, const uint8_t* data2, size_t len2) {
+  if (!_capture) {
+    return;
+  }
+  if (_captureLoopPending) {
+    // Something happened, so the loop is worth replaying.
+    _captureLoopPending = false;
+    CaptureRecord loop = {CaptureRecord::Type::LOOP, _nowMillis, _nowMicros, 0};
+    _capture->write((const uint8_t*)&loop, sizeof(loop));
+  }
+  if (type == CaptureRecord::Type::LOOP) {
+    return;
+  }
+  CaptureRecord rec = {type, _nowMillis, _nowMicros, uint16_t(len + len2)};
+  _capture->write((const uint8_t*)&rec, sizeof(rec));
+  if (len) {
+    _capture->write(data, len);
+  }
+  if (len2) {
+    _capture->write(data2, len2);
+  }
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_hashSketchSlice() {
+  uint8_t buf[256];
+  uint32_t end = std::min(_localSketchSize, _localSketchHashed + md5SliceSize);
+  while (_localSketchHashed != end) {
+    uint32_t len = std::min<uint32_t>(sizeof(buf), end - _localSketchHashed);
+    if (_buildingManifest) {
+      len = std::min<uint32_t>(len, bufferSize - _localSketchHashed % bufferSize);
+    }
+    if (!_imageSource->read(_localSketchHashed, buf, len)) {
+      // Try again next loop.
+      return;
+    }
+    _localSketchHasher.add(buf, len);
+    if (_buildingManifest) {
+      _manifestHashed(_localSketchHashed, buf, len);
+    }
+    _localSketchHashed += len;
+  }
+  if (_localSketchHashed != _localSketchSize) {
+    _imageSource->readAhead(_localSketchHashed, md5SliceSize);
+    return;
+  }
+
+  uint8_t md5[hashSize];
+  _localSketchHasher.finish(md5);
+  _localSketchMd5 = hashToString(md5);
+  if (md5CacheRtcOffset >= 0) {
+    _storeMd5Cache(md5CacheRtcOffset, _localSketchName, _localVersion, _localSketchSize,
+                   _localSketchMd5);
+  }
+  if (_buildingManifest) {
+    _finishManifest();
+  }
+  _localMd5Ready();
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_localMd5Ready() {
+  if (tracePackets > 1) {
+    Serial.println("Local sketch md5 " + _localSketchMd5);
+  }
+  if (useManifest && !_haveLocalManifest) {
+    schedule_function(std::bind(&Listener::onError, _listener, "Unable to build manifest"));
+  }
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_advertise() {
+  if (_update) {
+    if (!_relaying()) {
+      // Don't advertise our version if we think it might be old.
+      return;
+    }
+    // Advertise the new version instead, with only what we have so far.
+    // Everything written has been checked against the manifest, which
+    // goes along so the next hop can check it too.
+    uint32_t available = _relayAvailable();
+    if (!available) {
+      return;
+    }
+    _debugPutchar('A');
+    _transmit(PKT_TYPE::ADVERTISE, ethBroadcast, ethBroadcast /* bssid */,
+              _localSketchName + "\n" + String(_update->version) + "\n" +
+                  String(_update->size) + "\n" + _update->md5 + "\n" +
+                  ethToString(_getLocalBssid()) + "\n" + "partial " + String(available) + "\n" +
+                  "manifest " + hashToString(_updateManifest->root) + " " +
+                  String(_relayShape.blockSize) + " " + String(_relayShape.fanout) + "\n" +
+                  _newestField(_update->version) +
+                  (_blockIndexSize ? "blocks " + String(bufferSize) + "\n" : String()) +
+                  (rendezvousPeriod ? _rendezvousField() : String()));
+    _relayAdvertised = available;
+    return;
+  }
+  if (tracePackets > 1) {
+    Serial.println("Advertising local version " + String(_localVersion) +
+                   " md5=" + _localSketchMd5);
+  }
+  _debugPutchar('A');
+  String msg = _localSketchName + "\n" + String(_localVersion) + "\n" +
+               String(_localSketchSize) + "\n" + _localSketchMd5 + "\n" +
+               ethToString(_getLocalBssid()) + "\n";
+  if (_haveLocalManifest) {
+    msg += "manifest " + hashToString(_localManifestRoot) + " " +
+           String(_localManifest.blockSize) + " " + String(_localManifest.fanout) + "\n";
+  }
+  if (fecParityBlocks) {
+    msg += "fec " + String(bufferSize) + " " + String(fecDataBlocks) + " " +
+           String(fecParityBlocks) + "\n";
+  }
+  if (streamWindow) {
+    msg += "stream " + String(bufferSize) + "\n";
+  }
+  msg += _newestField(_localVersion);
+  if (_blockIndexSize) {
+    msg += "blocks " + String(bufferSize) + "\n";
+  }
+  if (censusVersions) {
+    msg += _census.fields();
+  }
+  if (rendezvousPeriod) {
+    msg += _rendezvousField();
+  }
+  _transmit(PKT_TYPE::ADVERTISE, ethBroadcast, ethBroadcast /* bssid */, msg);
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_transmit(PKT_TYPE pkt_type, eth_addr dest, eth_addr bssid,
+                                         String msg) {
+  bool bulk = pkt_type == PKT_TYPE::REPLY || pkt_type == PKT_TYPE::HASH_REPLY ||
+              pkt_type == PKT_TYPE::PARITY;
+  if (aggregateWindow) {
+    if (!_aggregate.fits(msg.length())) {
+      // Keep messages in order.
+      _flushAggregate();
+    }
+    if (_aggregate.fitsAlone(msg.length()) &&
+        _aggregate.add(dest, bssid, uint8_t(pkt_type), (const uint8_t*)msg.c_str(),
+                       msg.length(), bulk, _nowMicros)) {
+      return;
+    }
+  }
+
+  uint32_t tot_len = sizeof(hdr_t) + msg.length();
+  uint8_t* transmitBuf = (uint8_t*)malloc(tot_len);
+
+  if (!transmitBuf) {
+    if (tracePackets > 1) {
+      Serial.println("Unable to allocate transmitBuf");
+    }
+    return;
+  }
+  hdr_t hdr;
+
+  hdr.duration = 0;
+  hdr.src = _localEthAddr;
+  hdr.dest = dest;
+  hdr.bssid = bssid;
+  hdr.packetType = pkt_type;
+  hdr.seq = ++_txSeq;
+  hdr.len = msg.length();
+
+  memcpy(transmitBuf, &hdr, sizeof(hdr));
+  memcpy(transmitBuf + sizeof(hdr), msg.c_str(), msg.length());
+  _transmitFrame(transmitBuf, tot_len, bulk);
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_flushAggregate() {
+  if (_aggregate.empty()) {
+    return;
+  }
+  hdr_t hdr;
+  hdr.duration = 0;
+  hdr.src = _localEthAddr;
+  hdr.dest = _aggregate.dest();
+  hdr.bssid = _aggregate.bssid();
+  hdr.packetType = PKT_TYPE::AGGREGATE;
+  hdr.seq = ++_txSeq;
+  hdr.len = _aggregate.len();
+  bool single = _aggregate.count() == 1;
+  bool bulk = _aggregate.bulk();
+  uint8_t* frame = _aggregate.take();
+  uint8_t* body = frame + sizeof(hdr_t);
+  if (single) {
+    // Nothing shared the frame, so send the message on its own.
+    const uint8_t* pos = body;
+    size_t remaining = hdr.len;
+    uint8_t type = 0;
+    const uint8_t* data = body;
+    _aggregate.next(pos, remaining, &hdr.dest, &type, &data, &hdr.len);
+    hdr.packetType = PKT_TYPE(type);
+    memmove(body, data, hdr.len);
+  }
+  memcpy(frame, &hdr, sizeof(hdr));
+  _transmitFrame(frame, sizeof(hdr_t) + hdr.len, bulk);
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_transmitFrame(uint8_t* frame, uint16_t len, bool bulk) {
+  if (tracePackets > 1) {
+    Serial.println("Sending:");
+    _tracePacket(frame, len, 0 /* 802.11 header starts at 0 */);
+  }
+
+  if (airtimeBytesPerSecond) {
+    if (!bulk) {
+      if (!_airtime.take(len, 0, _nowMicros)) {
+        _debugPutchar('#');
+        free(frame);
+        ++_airtime.stats.droppedFrames;
+        return;
+      }
+    } else if (_airtime.stats.queuedFrames ||
+               !_airtime.take(len, airtimeControlReserve, _nowMicros)) {
+      // Keep bulk frames in order behind any already waiting.
+      _debugPutchar('#');
+      _airtime.push(frame, len);
+      return;
+    }
+  }
+  _sendFrame(frame, len, bulk);
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_sendFrame(uint8_t* frame, uint16_t len, bool bulk) {
+  // The send may take ownership of frame, so trace first.
+  _traceFrame(TraceEvent::Direction::TX, TraceEvent::Outcome::SENT, frame, len, 0);
+  _captureRecord(CaptureRecord::Type::TX, frame, len);
+  _airtime.sent(len, bulk, _nowMillis);
+  if (rendezvousPeriod && !_radioOn) {
+    // The next loop turns it off again if it's not wanted.
+    _setRadio(true);
+  }
+  LatencyStamp sendStart = latencyHistograms ? latencyNow() : 0;
+  bool sent = _transport->send(frame, len);
+  _latencySpan(LatencySpan::RADIO_SEND, sendStart);
+  if (!sent) {
+    _traceSendFailed();
+    schedule_function(std::bind(&Listener::onError, _listener, "WiFi raw send failed"));
+    return;
+  }
+
+  if (tracePackets > 1) {
+    Serial.print("SENT packet\n");
+  }
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_queueRawFrame(RxPacket* pkt) {
+  hdr_t* hdr = reinterpret_cast<hdr_t*>(pkt->data);
+  if (_lastRxSeq == hdr->seq && !memcmp(&_lastRxSrc, &hdr->src, sizeof(eth_addr))) {
+    // Sometimes we get duplicate packets received?  Not sure why!
+    _debugPutchar('@');
+    return;
+  }
+  _lastRxSeq = hdr->seq;
+  _lastRxSrc = hdr->src;
+
+  // Copy the packet away from the network stack so we'll have it later.
+  LatencyStamp copyStart = latencyHistograms ? latencyNow() : 0;
+  uint32_t totLen = sizeof(RxControl) + pkt->rx_ctl.legacy_length;
+  RxPacket* pktCopy = (RxPacket*)malloc(totLen);
+  if (!pktCopy) {
+    // Out of memory; skip
+    if (tracePackets > 1) {
+      Serial.println("OOM receive packet");
+    }
+    schedule_function(std::bind(&Listener::onError, _listener, "OOM receiving packet"));
+    return;
+  }
+  memcpy(pktCopy, pkt, totLen);
+  _latencySpan(LatencySpan::ISR_COPY, copyStart);
+
+  if (latencyHistograms) {
+    schedule_recurrent_function_us(
+        std::bind(&BasicLazyMeshOta::_receiveQueuedFrame, this, pktCopy, latencyNow()), 0);
+  } else {
+    schedule_recurrent_function_us(
+        std::bind(&BasicLazyMeshOta::onReceiveRawFrame, this, pktCopy), 0);
+  }
+}
+
+template <typename Config>
+bool BasicLazyMeshOta<Config>::_receiveQueuedFrame(RxPacket* pkt, LatencyStamp queuedAt) {
+  _latencySpan(LatencySpan::RX_QUEUE, queuedAt);
+  return onReceiveRawFrame(pkt);
+}
+
+template <typename Config>
+eth_addr BasicLazyMeshOta<Config>::_getLocalBssid() {
+  return _transport->bssid();
+}
+
+template <typename Config>
+bool BasicLazyMeshOta<Config>::onReceiveRawFrame(RxPacket* pkt) {
+  MemoryScope memoryScope(this, MemoryEntry::RECEIVE);
+  uint8_t* frm = pkt->data;
+  uint32_t tot_len = pkt->rx_ctl.legacy_length;
+  _tick();
+  if (_capture) {
+    int8_t rssi = pkt->rx_ctl.rssi;
+    _captureRecord(CaptureRecord::Type::RX, (const uint8_t*)&rssi, sizeof(rssi), frm, tot_len);
+  }
+  if (tracePackets) {
+    _debugPutchar('X');
+  }
+  if (tracePackets > 2) {
+    Serial.printf("\nReceived packet:\n");
+    _tracePacket(frm, tot_len, 0);
+  }
+  // Quick check to filter out any bssids that don't pertain to LazyMeshOta.
+  if (tot_len < sizeof(hdr_t)) {
+    // Packet too short.
+    _traceRx(TraceEvent::Outcome::TOO_SHORT, pkt);
+    free(pkt);
+    return false;
+  }
+  hdr_t* hdr = reinterpret_cast<hdr_t*>(frm);
+  if (hdr->dsap != hdr_t::LMO_ETH_SAP_ID || hdr->ssap != hdr_t::LMO_ETH_SAP_ID) {
+    // Different protocol than ours; skip.
+    if (tracePackets > 1) {
+      Serial.printf("dsap(%02x)", hdr->dsap);
+    }
+    _traceRx(TraceEvent::Outcome::OTHER_PROTOCOL, pkt);
+    free(pkt);
+    return false;
+  }
+  if (memcmp(&hdr->dest, &_localEthAddr, sizeof(_localEthAddr)) != 0 &&
+      memcmp(&hdr->dest, &ethBroadcast, sizeof(ethBroadcast))) {
+    // Not to us.
+    if (tracePackets > 1) {
+      Serial.println("Received packet to wrong target " + ethToString(hdr->dest));
+    }
+    _traceRx(TraceEvent::Outcome::NOT_FOR_US, pkt);
+    free(pkt);
+    return false;
+  }
+
+  if (memcmp(&hdr->src, &_localEthAddr, sizeof(_localEthAddr)) == 0) {
+    // We sent this packet
+    if (tracePackets > 1) {
+      Serial.print("Received a packet we sent\n");
+    }
+    _traceRx(TraceEvent::Outcome::OWN_FRAME, pkt);
+    free(pkt);
+    return false;
+  }
+
+  if (tracePackets > 1) {
+    Serial.printf("\nReceived packet:\n");
+    _tracePacket(frm, tot_len, 0);
+  }
+
+  if (tot_len <= sizeof(hdr_t)) {
+    if (tracePackets > 1) {
+      Serial.printf("Packet too short; tot_len %d <= %d\n", tot_len, sizeof(hdr_t));
+    }
+    _traceRx(TraceEvent::Outcome::TOO_SHORT, pkt);
+    free(pkt);
+    return false;
+  }
+  if (hdr->ssap != hdr_t::LMO_ETH_SAP_ID) {
+    if (tracePackets > 1) {
+      Serial.printf("Wrong ssap %02x\n", hdr->ssap);
+    }
+    _traceRx(TraceEvent::Outcome::OTHER_PROTOCOL, pkt);
+    free(pkt);
+    return false;
+  }
+
+  uint16_t pdu_len = tot_len - sizeof(hdr_t);
+
+  // Don't need the whole header, so just copy out what we care about.
+  uint16_t hdr_len;
+  memcpy(&hdr_len, frm + offsetof(hdr_t, len), sizeof(hdr_len));
+
+  if (hdr_len > pdu_len) {
+    if (tracePackets > 1) {
+      Serial.printf("Packet length mismatch; packet has pdu length %d but says it has length %d\n",
+                    pdu_len, hdr_len);
+    }
+    _traceRx(TraceEvent::Outcome::BAD_LENGTH, pkt);
+    free(pkt);
+    return false;
+  }
+
+  PKT_TYPE receivedPacketType;
+  memcpy(&receivedPacketType, frm + offsetof(hdr_t, packetType), sizeof(receivedPacketType));
+  eth_addr receivedSrc;
+  memcpy(&receivedSrc, frm + offsetof(hdr_t, src), sizeof(receivedSrc));
+  const uint8_t* receivedBody = frm + sizeof(hdr_t);
+  if (tracePackets > 1) {
+    String ethstr = ethToString(receivedSrc);
+    Serial.printf("Got of type %d from %s len %u\n", int(receivedPacketType), ethstr.c_str(),
+                  hdr_len);
+  }
+  _traceRx(receivedPacketType <= PKT_TYPE::AGGREGATE ? TraceEvent::Outcome::ACCEPTED
+                                                      : TraceEvent::Outcome::UNKNOWN_TYPE,
+           pkt);
+  if (receivedPacketType == PKT_TYPE::AGGREGATE) {
+    _receiveAggregate(receivedSrc, receivedBody, hdr_len);
+  } else {
+    _dispatch(receivedPacketType, receivedSrc, receivedBody, hdr_len);
+  }
+  free(pkt);
+  // Handling it may have started or moved a deadline.
+  _scheduleWake();
+  return false;
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_dispatch(PKT_TYPE type, const eth_addr& src, const uint8_t* data,
+                                         uint16_t len) {
+  BufStream body((char*)data, len);
+  if (rendezvousPeriod && (type == PKT_TYPE::REQ || type == PKT_TYPE::HASH_REQ ||
+                           type == PKT_TYPE::GROUP_REQ || type == PKT_TYPE::STREAM_REQ ||
+                           type == PKT_TYPE::BLOCK_REQ)) {
+    // Stay up while a neighbor downloads from us.
+    _lastServed = _nowMillis;
+  }
+  switch (type) {
+    case PKT_TYPE::ADVERTISE:
+      if (rendezvousPeriod) {
+        // Repeats still say where the neighbor's schedule is.
+        _noteRendezvous(data, len);
+      }
+      if (advertCacheSize) {
+        _advertEntry = _advertCache.find(src, data, len, _nowMillis, advertCacheTimeout);
+        if (!_advertEntry) {
+          // Same as last time.
+          break;
+        }
+      }
+      _receiveAdvertise(src, body);
+      _advertEntry = nullptr;
+      break;
+    case PKT_TYPE::REQ:
+      _receiveReq(src, body);
+      break;
+    case PKT_TYPE::REPLY:
+      _receiveReply(src, body);
+      break;
+    case PKT_TYPE::HASH_REQ:
+      _receiveHashReq(src, body);
+      break;
+    case PKT_TYPE::HASH_REPLY:
+      _receiveHashReply(src, body);
+      break;
+    case PKT_TYPE::GROUP_REQ:
+      _receiveGroupReq(src, body);
+      break;
+    case PKT_TYPE::PARITY:
+      if (_update && _updateFec) {
+        uint32_t startOffset = body.parseInt();
+        int parityIndex = body.parseInt();
+        if (body.read() == '\n') {
+          _fecReceive(startOffset, parityIndex, body);
+        }
+      }
+      break;
+    case PKT_TYPE::STREAM_REQ:
+      _receiveStreamReq(src, body);
+      break;
+    case PKT_TYPE::BLOCK_REQ:
+      _receiveBlockReq(src, body);
+      break;
+    default:
+      if (tracePackets > 1) {
+        Serial.printf("Unknown packet type %d\n", int(type));
+      }
+      break;
+  }
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_receiveAggregate(const eth_addr& src, const uint8_t* data,
+                                                 uint16_t len) {
+  size_t remaining = len;
+  eth_addr dest;
+  uint8_t type;
+  const uint8_t* msg;
+  uint16_t msgLen;
+  while (_aggregate.next(data, remaining, &dest, &type, &msg, &msgLen)) {
+    if (type == uint8_t(PKT_TYPE::AGGREGATE) ||
+        (memcmp(&dest, &_localEthAddr, sizeof(dest)) != 0 &&
+         memcmp(&dest, &ethBroadcast, sizeof(dest)) != 0)) {
+      // Aggregates don't nest, and the rest is for other nodes.
+      continue;
+    }
+    _dispatch(PKT_TYPE(type), src, msg, msgLen);
+  }
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_receiveAdvertise(const eth_addr& src, BufStream& body) {
+  // <version>\n<sketchsize>\n<md5sum>\n
+  if (tracePackets > 1) {
+    Serial.printf("Advertisement received '%s'\n", body.peekBuffer());
+  }
+
+  String sketchName = body.readStringUntil('\n');
+
+  int version = body.parseInt();
+  if (_wantBlockSources() && (sketchName != _localSketchName || version != _update->version)) {
+    // Whatever it runs may have some of the blocks we need.
+    _noteBlockSource(src, body.peekBuffer(), body.peekAvailable());
+  }
+  if (version <= _localVersion) {
+    if (tracePackets > 1) {
+      Serial.printf("Advertisement for version %d is not new.\n", version);
+    }
+    bool stale = censusVersions && sketchName == _localSketchName && version < _localVersion;
+    if (_advertEntry && !_wantBlockSources() && !stale) {
+      // Stale ones are still parsed, so convergence notices them.
+      _advertEntry->judged = true;
+    }
+    if (censusVersions && sketchName == _localSketchName) {
+      _noteCensus(src, version);
+    }
+    if ((versionCollectWindow || censusVersions) && sketchName == _localSketchName) {
+      // It may still have heard of something newer, or of other nodes.
+      while (body.available()) {
+        String field = body.readStringUntil('\n');
+        if (!_parseNewestField(field) && censusVersions) {
+          _census.parseField(field);
+        }
+      }
+    }
+    return;
+  }
+
+  int nl = body.read();
+  if (nl != '\n') {
+    if (tracePackets > 1) {
+      Serial.printf("Missing newline after version, '%c'\n", nl);
+    }
+    return;
+  }
+
+  int sketchsize = body.parseInt();
+  if (sketchsize <= 1) {
+    if (tracePackets > 1) {
+      Serial.printf("Bad sketchsize %d\n", sketchsize);
+    }
+    return;
+  }
+
+  nl = body.read();
+  if (nl != '\n') {
+    if (tracePackets > 1) {
+      Serial.printf("Missing newline after sketchsize\n");
+    }
+    return;
+  }
+
+  String md5 = body.readStringUntil('\n');
+  if (md5.length() != 32) {
+    if (tracePackets > 1) {
+      Serial.printf("md5sum '%s' should be exactly 32 chars long\n", md5.c_str());
+    }
+    return;
+  }
+
+  if (!_advertEntry || !_advertEntry->notified ||
+      _nowMillis - _advertEntry->notifiedAt >= neighborSeenInterval) {
+    schedule_function(
+        std::bind(&Listener::onNeighborSeen, _listener, src, sketchName, version, md5));
+    if (_advertEntry) {
+      _advertEntry->notified = true;
+      _advertEntry->notifiedAt = _nowMillis;
+    }
+  } else {
+    ++_advertCache.stats.suppressedNotifications;
+  }
+
+  if (sketchName != _localSketchName) {
+    if (tracePackets > 1) {
+      Serial.printf("Advertisement for sketch '%s', which is not our '%s'.\n", sketchName.c_str(),
+                    _localSketchName.c_str());
+    }
+    if (_advertEntry && !_wantBlockSources()) {
+      _advertEntry->judged = true;
+    }
+    return;
+  }
+  if (versionCollectWindow) {
+    _noteNewest(version, md5, 0);
+  }
+  if (censusVersions) {
+    _noteCensus(src, version);
+  }
+
+  String bssidStr = body.readStringUntil('\n');
+  eth_addr bssid;
+  if (!ethFromString(&bssid, bssidStr)) {
+    if (tracePackets > 1) {
+      Serial.println("Unable to process bssid '" + bssidStr + "'");
+    }
+    return;
+  }
+
+  offer_t offer;
+  bool usable = true;
+  while (body.available()) {
+    if (!_parseAdvertField(body.readStringUntil('\n'), sketchsize, &offer)) {
+      usable = false;
+    }
+  }
+  if (!usable) {
+    return;
+  }
+  uint32_t available = sketchsize;
+  if (offer.partial) {
+    if (!offer.manifest) {
+      // Nothing to check what it passes on against.
+      delete offer.fec;
+      delete offer.stream;
+      return;
+    }
+    // A relay only answers plain REQs and HASH_REQs.
+    available = offer.partial;
+    delete offer.fec;
+    offer.fec = nullptr;
+    delete offer.stream;
+    offer.stream = nullptr;
+  }
+
+  if (_update && _update->version == version && _update->md5 == md5) {
+    bool fromSrc = memcmp(&src, &_update->src, sizeof(src)) == 0;
+    // Hashes have to come from a tree of the same shape.
+    bool sameTree = !_updateManifest ||
+                    (offer.manifest &&
+                     memcmp(offer.manifest->root, _updateManifest->root, hashSize) == 0);
+    if (fromSrc ||
+        (available > _update->srcAvailable && !_updateFec && !_updateStream && sameTree)) {
+      // Follow whoever has the most of the image.
+      bool waiting = _update->offset >= _update->srcAvailable;
+      if (available > _update->srcAvailable) {
+        _update->retryCount = 0;
+      }
+      _update->src = src;
+      _update->bssid = bssid;
+      _update->srcAvailable = available;
+      if (waiting && _update->offset < available) {
+        _requestNextBlock();
+      }
+    }
+  }
+  if (offer.fec && offer.manifest && offer.fec->blockSize != offer.manifest->shape.blockSize) {
+    // Shouldn't happen, since both use the sender's buffer size.
+    delete offer.fec;
+    offer.fec = nullptr;
+  }
+
+  if (_update && _updateManifest && offer.manifest && !offer.partial &&
+      _update->version == version &&
+      memcmp(offer.manifest->root, _updateManifest->root, hashSize) == 0 &&
+      memcmp(&src, &_update->src, sizeof(src)) != 0) {
+    // Someone else has the same image; we can get blocks from them too.
+    _update->haveAltSrc = true;
+    _update->altSrc = src;
+    _update->altBssid = bssid;
+  }
+
+  if (versionCollectWindow && !_update) {
+    _collectOffer(src, bssid, version, sketchsize, md5, &offer);
+    return;
+  }
+  _startUpdate(src, bssid, version, sketchsize, md5, &offer);
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_collectOffer(const eth_addr& src, const eth_addr& bssid,
+                                             int version, uint32_t sketchsize,
+                                             const String& md5, offer_t* offer) {
+  uint32_t available = offer->partial ? offer->partial : sketchsize;
+  if (_pendingOffer) {
+    pending_offer_t* pending = _pendingOffer;
+    bool better = version > pending->version ||
+                  (version == pending->version && md5 == pending->md5 &&
+                   available > pending->available);
+    if (!better) {
+      return;
+    }
+  } else {
+    _pendingOffer = new (std::nothrow) pending_offer_t;
+    if (!_pendingOffer) {
+      return;
+    }
+    _pendingOffer->deadline = _nowMillis + versionCollectWindow;
+  }
+  if (tracePackets > 1) {
+    Serial.printf("Collecting offer of version %d from %s\n", version, ethToString(src).c_str());
+  }
+  pending_offer_t* pending = _pendingOffer;
+  pending->src = src;
+  pending->bssid = bssid;
+  pending->version = version;
+  pending->size = sketchsize;
+  pending->md5 = md5;
+  pending->available = available;
+  // Whatever the previous offer had gets freed along with 'offer'.
+  std::swap(pending->offer.manifest, offer->manifest);
+  std::swap(pending->offer.fec, offer->fec);
+  std::swap(pending->offer.stream, offer->stream);
+  pending->offer.partial = offer->partial;
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_startPendingOffer() {
+  pending_offer_t* pending = _pendingOffer;
+  if (_newestKnown() > pending->version && !pending->extended) {
+    // Something newer is nearby; give it a chance to reach us.
+    pending->extended = true;
+    pending->deadline = _nowMillis + versionCollectWindow;
+    return;
+  }
+  _pendingOffer = nullptr;
+  _startUpdate(pending->src, pending->bssid, pending->version, pending->size, pending->md5,
+               &pending->offer);
+  delete pending;
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_noteNewest(int version, const String& md5, uint32_t age) {
+  if (version <= _localVersion || age >= versionDigestTimeout) {
+    return;
+  }
+  uint32_t expires = _nowMillis + versionDigestTimeout - age;
+  int known = _newestKnown();
+  if (version > known ||
+      (version == known && md5 == _newestMd5 && int32_t(expires - _newestExpires) > 0)) {
+    _newestVersion = version;
+    _newestMd5 = md5;
+    _newestExpires = expires;
+  }
+}
+
+template <typename Config>
+bool BasicLazyMeshOta<Config>::_parseNewestField(const String& field) {
+  // "newest <version> <md5> <age in ms>".  The age only grows as it's
+  // passed on, so a version nobody has any more is eventually forgotten.
+  int version;
+  char md5[33];
+  unsigned long age;
+  if (!versionCollectWindow ||
+      sscanf(field.c_str(), "newest %d %32s %lu", &version, md5, &age) != 3 ||
+      strlen(md5) != 32) {
+    return false;
+  }
+  _noteNewest(version, md5, age);
+  return true;
+}
+
+template <typename Config>
+String BasicLazyMeshOta<Config>::_newestField(int version) {
+  if (!versionCollectWindow || _newestKnown() <= version) {
+    return String();
+  }
+  uint32_t age = versionDigestTimeout - (_newestExpires - _nowMillis);
+  return "newest " + String(_newestVersion) + " " + _newestMd5 + " " + String(age) + "\n";
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_noteCensus(const eth_addr& src, int version) {
+  _census.add(version, src);
+  if (version >= _localVersion) {
+    return;
+  }
+  if (converged()) {
+    // It needs to hear about our version soon, not at the slower rate.
+    uint32_t soon = _nowMillis + _random(0, advertiseInterval);
+    if (int32_t(_nextAdvertise - soon) > 0) {
+      _nextAdvertise = soon;
+    }
+  }
+  _lastStaleAdvert = _nowMillis;
+}
+
+template <typename Config>
+bool BasicLazyMeshOta<Config>::converged() const {
+  return censusVersions && _localSketchMd5.length() && !_update && !_pendingOffer &&
+         _census.newest() == _localVersion && _census.covers(_localVersion) &&
+         _nowMillis - _lastStaleAdvert >= convergedQuietTime;
+}
+
+template <typename Config>
+bool BasicLazyMeshOta<Config>::_parseAdvertField(const String& field, uint32_t sketchsize,
+                                                 offer_t* offer) {
+  char rootStr[hashSize * 2 + 1];
+  unsigned long blockSize;
+  unsigned fanout, dataBlocks, parityBlocks;
+  if (_parseNewestField(field) || (censusVersions && _census.parseField(field))) {
+    return true;
+  }
+  if (useManifest && !offer->manifest &&
+      sscanf(field.c_str(), "manifest %32s %lu %u", rootStr, &blockSize, &fanout) == 3) {
+    manifest_t* manifest = new (std::nothrow) manifest_t;
+    if (!manifest) {
+      // Not without checking it; the next advertisement will do.
+      return false;
+    }
+    if (!hashFromString(manifest->root, rootStr) || blockSize == 0 || fanout < 2 ||
+        fanout > manifestFanout) {
+      if (tracePackets > 1) {
+        Serial.println("Unusable manifest '" + field + "'");
+      }
+      delete manifest;
+      return true;
+    }
+    manifest->shape = ManifestShape(sketchsize, blockSize, fanout);
+    if (manifest->shape.depth > manifestMaxDepth) {
+      if (tracePackets > 1) {
+        Serial.println("Manifest too deep");
+      }
+      delete manifest;
+      return true;
+    }
+    offer->manifest = manifest;
+  } else if (fecParityBlocks && !offer->fec &&
+             sscanf(field.c_str(), "fec %lu %u %u", &blockSize, &dataBlocks, &parityBlocks) ==
+                 3) {
+    if (blockSize == 0 || blockSize > bufferSize || dataBlocks == 0 ||
+        dataBlocks > fecDataBlocks || parityBlocks == 0 || parityBlocks > fecParityBlocks) {
+      if (tracePackets > 1) {
+        Serial.println("Unusable forward error correction '" + field + "'");
+      }
+      return true;
+    }
+    offer->fec = new (std::nothrow) fec_t;
+    if (offer->fec) {
+      offer->fec->blockSize = blockSize;
+      offer->fec->dataBlocks = dataBlocks;
+      offer->fec->parityBlocks = parityBlocks;
+    }
+  } else if (relayPartial && sscanf(field.c_str(), "partial %lu", &blockSize) == 1) {
+    // Not a block size, but the number of bytes available.
+    offer->partial = std::min<uint32_t>(blockSize, sketchsize);
+  } else if (streamWindow && !offer->stream &&
+             sscanf(field.c_str(), "stream %lu", &blockSize) == 1) {
+    if (blockSize == 0 || blockSize > bufferSize) {
+      if (tracePackets > 1) {
+        Serial.println("Unusable stream '" + field + "'");
+      }
+      return true;
+    }
+    offer->stream = new (std::nothrow) stream_t;
+    if (offer->stream) {
+      offer->stream->blockSize = blockSize;
+    }
+  }
+  return true;
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_startUpdate(const eth_addr& src, const eth_addr& bssid,
+                                            int version, uint32_t sketchsize, String md5sum,
+                                            offer_t* offer) {
+  if (_terminate) {
+    // Already finished an update and waiting to restart into it.
+    return;
+  }
+  if (sketchsize > _imageSink->freeSpace()) {
+    schedule_function(
+        std::bind(&Listener::onError, _listener, "Sketch too big; not enough space free"));
+    return;
+  }
+
+  if (tracePackets > 1) {
+    Serial.println("Starting update? src=" + ethToString(src) + " bssid=" + ethToString(bssid));
+  }
+  eth_addr staleSrc = {};
+  bool haveStaleSrc = false;
+  if (_update && _update->version < version) {
+    if (tracePackets > 1) {
+      Serial.println("Aborting previous update!");
+    }
+    _imageSink->end();
+    haveStaleSrc = true;
+    staleSrc = _update->src;
+    _deleteUpdate();
+  }
+
+  if (_update) {
+    if (tracePackets > 1) {
+      Serial.println("Except not, since there's an update already in progress.");
+    }
+    // Update already in progress.
+    return;
+  }
+
+  schedule_function(std::bind(&Listener::onStartUpgrade, _listener, src, version, md5sum));
+
+  _update = new update_t;
+  _reqPending = false;
+  _blockSources = block_sources_t();
+  if (shareBlocks) {
+    // Neighbors we had nothing to do with may now be block sources.
+    _advertCache.clear();
+  }
+  _update->version = version;
+  _update->src = src;
+  _update->size = sketchsize;
+  _update->bssid = bssid;
+  _update->md5 = md5sum;
+  _update->srcAvailable = offer->partial ? offer->partial : sketchsize;
+  _update->haveStaleSrc = haveStaleSrc && memcmp(&staleSrc, &src, sizeof(src)) != 0;
+  _update->staleSrc = staleSrc;
+
+  if (offer->manifest) {
+    for (uint8_t level = 0; level != manifestMaxDepth; ++level) {
+      offer->manifest->loaded[level] = -1;
+    }
+    std::swap(_updateManifest, offer->manifest);
+  }
+  if (relayPartial && _updateManifest && _updateManifest->shape.blockSize == bufferSize) {
+    // From now on serve the new image instead of the running sketch,
+    // along with the hashes to check it.
+    delete[] _relayNodeHashes;
+    _relayShape = _updateManifest->shape;
+    _relayNodesKnown = 0;
+    _relayNodeHashes = new (std::nothrow) uint8_t[_relayShape.levelSize(1) * hashSize];
+    if (_relayNodeHashes) {
+      _relaySize = sketchsize;
+      _relayMd5 = md5sum;
+      _relayAdvertised = 0;
+      _streamSource.active = false;
+    }
+  }
+  std::swap(_updateFec, offer->fec);
+  if (!_updateManifest && !_updateFec) {
+    std::swap(_updateStream, offer->stream);
+  }
+
+  if (!_imageSink->begin(sketchsize, md5sum.c_str())) {
+    schedule_function([this]() {
+      _listener->onError("Could not begin update");
+      _imageSink->printError(Serial);
+    });
+    _deleteUpdate();
+    return;
+  }
+
+  _requestNextBlock();
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_requestNextBlock() {
+  assert(_update);
+
+  if (tracePackets > 1) {
+    Serial.printf("Requesting next block at %u/%u\n", _update->offset, _update->size);
+  }
+
+  if (_updateFec && !_fecFlush()) {
+    return;
+  }
+
+  if (_update->offset == _update->size) {
+    // Update complete!
+    if (!_imageSink->end()) {
+      schedule_function([this]() {
+        _listener->onError("Update failed");
+        _imageSink->printError(Serial);
+      });
+    } else {
+      _terminate = true;
+      if (md5CacheRtcOffset >= 0) {
+        // Save the new version from having to hash itself after rebooting.
+        _storeMd5Cache(md5CacheRtcOffset, _localSketchName, _update->version, _update->size,
+                       _update->md5);
+      }
+      if (_relaying()) {
+        // Tell anyone relaying through us that the rest is available.
+        _advertise();
+      }
+      schedule_function(std::bind(&Listener::onDoneUpgrade, _listener));
+    }
+    uint32_t relaySize = _terminate && _relaying() ? _update->size : 0;
+    _deleteUpdate();
+    // Keep serving the new image until we reboot.
+    _relaySize = relaySize;
+    return;
+  }
+
+  if (_update->offset >= _update->srcAvailable) {
+    // Wait for the source to advertise more.
+    _nextReceiveTimeout = _nowMillis + receiveTimeoutInterval;
+    return;
+  }
+
+  uint8_t level;
+  uint32_t index;
+  if (_updateManifest &&
+      _manifestWantedNode(_update->offset / _updateManifest->shape.blockSize, &level, &index)) {
+    if (tracePackets > 1) {
+      Serial.printf("Requesting hashes for node %u/%u\n", level, index);
+    }
+    _transmit(PKT_TYPE::HASH_REQ, _update->src, _update->bssid,
+              ethToString(_getLocalBssid()) + "\n" + imageId(_update->md5) + "\n" +
+                  String(level) + "\n" + String(index) + "\n");
+    _nextReceiveTimeout = _nowMillis + receiveTimeoutInterval;
+    return;
+  }
+
+  schedule_function(
+      std::bind(&Listener::onRequestChunk, _listener, _update->offset, _update->size));
+  if (_updateStream) {
+    stream_t* stream = _updateStream;
+    uint32_t missing = 0;
+    for (uint32_t i = 0; i != streamWindow; ++i) {
+      if (_update->offset + i * stream->blockSize >= _update->size) {
+        break;
+      }
+      if (!(stream->have & (uint32_t(1) << i))) {
+        missing |= uint32_t(1) << i;
+      }
+    }
+    // Anything past our window was dropped, so have it sent again.
+    uint32_t resume =
+        std::min<uint32_t>(_update->offset + streamWindow * stream->blockSize, _update->size);
+    _transmit(PKT_TYPE::STREAM_REQ, _update->src, _update->bssid,
+              ethToString(_getLocalBssid()) + "\n" + imageId(_update->md5) + "\n" +
+                  String(_update->offset) + "\n" + String(missing) + "\n" + String(resume) +
+                  "\n");
+    stream->gap = false;
+    stream->nextNack = _nowMillis + streamNackInterval;
+  } else if (_updateFec) {
+    fec_t* fec = _updateFec;
+    uint32_t blocks = _groupBlocks(fec->groupStart, fec->blockSize, fec->dataBlocks, _update->size);
+    uint32_t missing = ~fec->haveData & ((uint64_t(1) << blocks) - 1);
+    _transmit(PKT_TYPE::GROUP_REQ, _update->src, _update->bssid,
+              ethToString(_getLocalBssid()) + "\n" + imageId(_update->md5) + "\n" +
+                  String(fec->groupStart) + "\n" + String(missing) + "\n");
+  } else if (shareBlocks && _updateManifest && _blockSources.turn) {
+    uint8_t source = _blockSources.turn - 1;
+    const uint8_t* hash = _manifestBlockHash(_update->offset / _updateManifest->shape.blockSize);
+    _transmit(PKT_TYPE::BLOCK_REQ, _blockSources.src[source], _blockSources.bssid[source],
+              ethToString(_getLocalBssid()) + "\n" + String(_update->offset) + "\n" +
+                  hashToString(hash) + "\n");
+  } else {
+    _reqPending = true;
+    _reqSentAt = latencyHistograms ? latencyNow() : 0;
+    _transmit(PKT_TYPE::REQ, _update->src, _update->bssid,
+              ethToString(_getLocalBssid()) + "\n" + imageId(_update->md5) + "\n" +
+                  String(_update->offset) + "\n");
+  }
+  _nextReceiveTimeout = _nowMillis + receiveTimeoutInterval;
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_receiveTimeout() {
+  assert(_update);
+
+  schedule_function(std::bind(&Listener::onReceiveTimeout, _listener));
+  if (!_countRetry()) {
+    return;
+  }
+
+  if (tracePackets > 1) {
+    Serial.println("Resending due to timeout");
+  }
+
+  // A relaying source may have more than it last advertised.
+  _update->srcAvailable = _update->size;
+  if (shareBlocks && _blockSources.count) {
+    // Try the next block source, coming back around to our source.
+    _blockSources.turn = (_blockSources.turn + 1) % (_blockSources.count + 1);
+  }
+  if (!_blockSources.turn) {
+    _useAltSrc();
+  }
+  _requestNextBlock();
+}
+
+template <typename Config>
+bool BasicLazyMeshOta<Config>::_countRetry() {
+  ++_update->retryCount;
+  if (_update->retryCount <= maxRetries) {
+    return true;
+  }
+  _imageSink->end();
+  _deleteUpdate();
+
+  if (tracePackets > 1) {
+    Serial.println("Update exceeded max retries");
+  }
+  schedule_function(std::bind(&Listener::onError, _listener, "Exceeded max retries"));
+  return false;
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_receiveReq(const eth_addr& src, BufStream& body) {
+  if (tracePackets > 1) {
+    Serial.printf("Request received '%s'\n", body.peekBuffer());
+  }
+  // "<src bssid>\n<image>\n<start>\n".
+  String bssidStr = body.readStringUntil('\n');
+  eth_addr bssid;
+  if (!ethFromString(&bssid, bssidStr)) {
+    if (tracePackets > 1) {
+      Serial.println("Could not parse bssid " + bssidStr);
+    }
+    return;
+  }
+  if (!_servesImage(body.readStringUntil('\n'))) {
+    // For an image we've stopped serving.
+    _debugPutchar('?');
+    return;
+  }
+
+  uint32_t startOffset = body.parseInt();
+  uint32_t available = _relaying() ? _relayAvailable() : _localSketchSize;
+  if (startOffset >= available) {
+    if (tracePackets > 1) {
+      Serial.printf("Start offset %u beyond the %u bytes we have\n", startOffset, available);
+    }
+    return;
+  }
+  if (!_airtimeRoom(1)) {
+    // Over the airtime budget; the requester will ask again.
+    _debugPutchar('#');
+    return;
+  }
+
+  _sendBlock(src, bssid, startOffset);
+}
+
+template <typename Config>
+bool BasicLazyMeshOta<Config>::_sendBlock(const eth_addr& dest, const eth_addr& bssid,
+                                          uint32_t startOffset) {
+  uint32_t imageSize = _relaying() ? _relaySize : _localSketchSize;
+  uint32_t len = bufferSize;
+  if (startOffset + len > imageSize) {
+    len = imageSize - startOffset;
+  }
+  if (_relaying() && startOffset + len > _relayAvailable()) {
+    // Only send whole blocks.
+    return false;
+  }
+
+  if (tracePackets > 1) {
+    Serial.printf("Replying with %u bytes of flash, %u-%u/%u\n", len, startOffset,
+                  startOffset + len, imageSize);
+  }
+
+  _debugPutchar('<');
+  schedule_function(
+      std::bind(&Listener::onSendProgress, _listener, dest, startOffset, len, imageSize));
+
+  String reply = String(startOffset) + "\n";
+  uint8_t buf[bufferSize];
+  LatencyStamp readStart = latencyHistograms ? latencyNow() : 0;
+  bool readOk = _readServed(startOffset, buf, len);
+  _latencySpan(LatencySpan::FLASH_READ, readStart);
+  if (!readOk) {
+    if (tracePackets > 1) {
+      Serial.print("Reading from flash failed");
+    }
+    schedule_function(std::bind(&Listener::onError, _listener, "Reading from flash failed"));
+    return false;
+  }
+
+  if (!concatString(&reply, (char*)buf, len)) {
+    if (tracePackets > 1) {
+      Serial.print("Unable to concat to reply!");
+    }
+
+    schedule_function(std::bind(&Listener::onError, _listener, "Unable to concat to reply"));
+    return false;
+  }
+  _transmit(PKT_TYPE::REPLY, dest, bssid, reply);
+  return true;
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_receiveReply(const eth_addr& src, BufStream& body) {
+  _debugPutchar('$');
+  if (tracePackets > 1) {
+    Serial.printf("Reply received '%s'\n", body.peekBuffer());
+  }
+  if (!_update) {
+    if (tracePackets > 1) {
+      Serial.print("No update in progress!\n");
+    }
+    return;
+  }
+  if (_update->haveStaleSrc && !memcmp(&src, &_update->staleSrc, sizeof(src)) &&
+      memcmp(&src, &_update->src, sizeof(src)) != 0) {
+    // Part of the image we were getting before, which would only fail
+    // the md5 check at the end.
+    _debugPutchar('~');
+    return;
+  }
+
+  uint32_t startOffset = body.parseInt();
+  if (_updateFec) {
+    if (body.read() == '\n') {
+      _fecReceive(startOffset, -1 /* data */, body);
+    }
+    return;
+  }
+  if (_updateStream) {
+    if (body.read() == '\n') {
+      _streamReceive(startOffset, body);
+    }
+    return;
+  }
+  if (startOffset != _update->offset) {
+    char buf[100];
+    sprintf(buf, "Wrong start offset; received %u but we're at %u", startOffset, _update->offset);
+    _debugPutchar('~');
+    schedule_function(std::bind(&Listener::onError, _listener, String(buf)));
+    return;
+  }
+  _debugPutchar('k');
+
+  int nl = body.read();
+  if (nl != '\n') {
+    if (tracePackets > 1) {
+      Serial.printf("Missing newline after received reply offset\n");
+    }
+    return;
+  }
+
+  uint32_t size = body.peekAvailable();
+  if (size + startOffset > _update->size) {
+    if (tracePackets > 1) {
+      Serial.printf("Size %u + startoffset %u too big for sketch size %u\n", size, startOffset,
+                    _update->size);
+    }
+    return;
+  }
+
+  if (_updateManifest &&
+      (startOffset % _updateManifest->shape.blockSize ||
+       !_manifestVerifyBlock(startOffset / _updateManifest->shape.blockSize,
+                             (const uint8_t*)body.peekBuffer(), size))) {
+    // Drop it, and try someone else if we can.
+    _debugPutchar('!');
+    _verificationFailed("Block failed verification");
+    return;
+  }
+
+  if (_reqPending) {
+    _reqPending = false;
+    _latencySpan(LatencySpan::ROUND_TRIP, _reqSentAt);
+  }
+  uint32_t writelen = _updateWrite((uint8_t*)body.peekBuffer(), size);
+  if (writelen != size) {
+    if (tracePackets > 1) {
+      Serial.printf("Tried to write %u to updater, but only got %u\n", size, writelen);
+    }
+    return;
+  }
+
+  if (tracePackets > 1) {
+    Serial.printf("Sent %u bytes to updater at offset %u\n", writelen, startOffset);
+  }
+  _update->offset += writelen;
+  _update->retryCount = 0;
+  _requestNextBlock();
+}
+
+template <typename Config>
+uint32_t BasicLazyMeshOta<Config>::_updateWrite(uint8_t* data, uint32_t len) {
+  if (relayPartial && _update->offset < sizeof(_relayHeader)) {
+    uint32_t headerLen = std::min<uint32_t>(len, sizeof(_relayHeader) - _update->offset);
+    memcpy(_relayHeader + _update->offset, data, headerLen);
+  }
+  LatencyStamp start = latencyHistograms ? latencyNow() : 0;
+  uint32_t written = _imageSink->write(data, len);
+  _latencySpan(LatencySpan::UPDATE_WRITE, start);
+  return written;
+}
+
+template <typename Config>
+uint32_t BasicLazyMeshOta<Config>::_relayAvailable() const {
+  if (!_update) {
+    // Done; the updater has flushed everything.
+    return _relaySize;
+  }
+  if (_update->offset == _update->size) {
+    return _update->size;
+  }
+  return _imageSink->readableSize(_update->offset);
+}
+
+template <typename Config>
+bool BasicLazyMeshOta<Config>::_readServed(uint32_t offset, uint8_t* data, uint32_t len) {
+  if (!_relaying()) {
+    return _imageSource->read(offset, data, len);
+  }
+  if (!_imageSink->readBack(offset, data, len)) {
+    return false;
+  }
+  if (offset < sizeof(_relayHeader)) {
+    uint32_t headerLen = std::min<uint32_t>(len, sizeof(_relayHeader) - offset);
+    memcpy(data, _relayHeader + offset, headerLen);
+  }
+  return true;
+}
+
+template <typename Config>
+bool BasicLazyMeshOta<Config>::_relayNodeHash(uint8_t level, uint32_t index, uint8_t* out) {
+  ManifestHasher hasher;
+  hasher.begin();
+  if (level == 0) {
+    uint32_t len = _relayShape.blockLength(index);
+    uint8_t buf[bufferSize];
+    if (index * bufferSize + len > _relayAvailable() || !_readServed(index * bufferSize, buf, len)) {
+      return false;
+    }
+    hasher.add(buf, len);
+  } else if (level == 1) {
+    if (index >= _relayNodesKnown) {
+      return false;
+    }
+    memcpy(out, _relayNodeHashes + index * hashSize, hashSize);
+    return true;
+  } else {
+    uint32_t children = _relayShape.childCount(level, index);
+    for (uint32_t child = 0; child != children; ++child) {
+      uint8_t childHash[hashSize];
+      if (!_relayNodeHash(level - 1, index * _relayShape.fanout + child, childHash)) {
+        return false;
+      }
+      hasher.add(childHash, hashSize);
+    }
+  }
+  hasher.finish(out);
+  return true;
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_deleteUpdate() {
+  delete _update;
+  _update = nullptr;
+  delete _updateManifest;
+  _updateManifest = nullptr;
+  delete _updateFec;
+  _updateFec = nullptr;
+  delete _updateStream;
+  _updateStream = nullptr;
+  _relaySize = 0;
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_useAltSrc() {
+  if (!_update->haveAltSrc) {
+    return;
+  }
+  if (tracePackets > 1) {
+    Serial.println("Switching source to " + ethToString(_update->altSrc));
+  }
+  std::swap(_update->src, _update->altSrc);
+  std::swap(_update->bssid, _update->altBssid);
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_verificationFailed(const char* error) {
+  schedule_function(std::bind(&Listener::onError, _listener, String(error)));
+  if (!_countRetry()) {
+    return;
+  }
+  if (_update->haveAltSrc) {
+    // Try someone else right away.
+    _useAltSrc();
+    _requestNextBlock();
+  }
+  // Otherwise ask again once the request times out, rather than flooding
+  // a source which keeps sending bad data.
+}
+
+template <typename Config>
+bool BasicLazyMeshOta<Config>::_beginManifest() {
+  _localManifest = ManifestShape(_localSketchSize, bufferSize, manifestFanout);
+  if (_localManifest.blocks() == 0) {
+    return false;
+  }
+
+  delete[] _localManifestCache;
+  _localManifestCache = nullptr;
+  delete[] _blockIndex;
+  _blockIndex = nullptr;
+  _blockIndexSize = 0;
+  if (shareBlocks) {
+    _blockIndex = new (std::nothrow) block_index_t[_localManifest.blocks()];
+  }
+  if (_localManifest.depth > 0) {
+    // Only the hashes of level 1 are kept.
+    _localManifestCache = new (std::nothrow) uint8_t[_localManifest.levelSize(1) * hashSize];
+    if (!_localManifestCache) {
+      return false;
+    }
+  }
+  _manifestBlockHasher.begin();
+  _buildingManifest = true;
+  return true;
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_manifestHashed(uint32_t offset, const uint8_t* data,
+                                               uint32_t len) {
+  _manifestBlockHasher.add(data, len);
+  offset += len;
+  if (offset % bufferSize && offset != _localSketchSize) {
+    return;
+  }
+
+  uint32_t block = (offset - 1) / bufferSize;
+  uint8_t blockHash[hashSize];
+  _manifestBlockHasher.finish(blockHash);
+  _manifestBlockHasher.begin();
+  if (_blockIndex) {
+    memcpy(&_blockIndex[block].key, blockHash, sizeof(uint32_t));
+    _blockIndex[block].block = block;
+  }
+  if (_localManifest.depth == 0) {
+    // The root is the hash of the only block.
+    memcpy(_localManifestRoot, blockHash, hashSize);
+    return;
+  }
+  uint32_t group = block / manifestFanout;
+  uint32_t child = block % manifestFanout;
+  if (child == 0) {
+    _manifestGroupHasher.begin();
+  }
+  _manifestGroupHasher.add(blockHash, hashSize);
+  if (child + 1 == _localManifest.childCount(1, group)) {
+    _manifestGroupHasher.finish(_localManifestCache + group * hashSize);
+  }
+}
+
+template <typename Config>
+bool BasicLazyMeshOta<Config>::_finishManifest() {
+  _buildingManifest = false;
+  // Only the levels above 1 are left, and they're small.
+  _haveLocalManifest = _localManifest.depth == 0 ||
+                       _manifestNodeHash(_localManifest.depth, 0, _localManifestRoot);
+  if (_blockIndex && _haveLocalManifest) {
+    _blockIndexSize = _localManifest.blocks();
+    std::sort(_blockIndex, _blockIndex + _blockIndexSize,
+              [](const block_index_t& a, const block_index_t& b) { return a.key < b.key; });
+  }
+  if (tracePackets > 1 && _haveLocalManifest) {
+    Serial.println("Manifest root " + hashToString(_localManifestRoot) + " depth " +
+                   String(_localManifest.depth));
+  }
+  return _haveLocalManifest;
+}
+
+template <typename Config>
+bool BasicLazyMeshOta<Config>::_loadPrebuiltManifest() {
+  PrebuiltManifestHeader header;
+  if (!_localSketchSize ||
+      !_imageSource->readManifest(0, (uint8_t*)&header, sizeof(header)) ||
+      header.magic != PrebuiltManifestHeader::MAGIC || header.imageSize != _localSketchSize) {
+    return false;
+  }
+  // Make sure it's for this image, not one it replaced.
+  uint8_t nameMd5[hashSize];
+  prebuiltManifestHash((const uint8_t*)_localSketchName.c_str(), _localSketchName.length(),
+                       nameMd5);
+  if (header.version != _localVersion || memcmp(nameMd5, header.nameMd5, hashSize) != 0) {
+    if (tracePackets > 1) {
+      Serial.printf("Ignoring prebuilt manifest for version %d\n", int(header.version));
+    }
+    return false;
+  }
+  uint8_t tail[PrebuiltManifestHeader::tailLength];
+  uint32_t tailLen = std::min<uint32_t>(_localSketchSize, sizeof(tail));
+  uint8_t tailMd5[hashSize];
+  if (!_imageSource->read(_localSketchSize - tailLen, tail, tailLen)) {
+    return false;
+  }
+  prebuiltManifestHash(tail, tailLen, tailMd5);
+  if (memcmp(tailMd5, header.tailMd5, hashSize) != 0) {
+    return false;
+  }
+  _localSketchMd5 = hashToString(header.md5);
+  _localSketchHashed = _localSketchSize;
+  if (tracePackets > 1) {
+    Serial.println("Using prebuilt manifest");
+  }
+
+  // The hash tree is only any use if it has the same shape as ours;
+  // otherwise it's built from flash as usual.
+  ManifestShape shape(_localSketchSize, bufferSize, manifestFanout);
+  if (!useManifest || header.blockSize != bufferSize || header.fanout != manifestFanout ||
+      header.groups != (shape.depth ? shape.levelSize(1) : 0) ||
+      (shareBlocks && header.blocks != shape.blocks())) {
+    return true;
+  }
+  delete[] _localManifestCache;
+  _localManifestCache = nullptr;
+  delete[] _blockIndex;
+  _blockIndex = nullptr;
+  _blockIndexSize = 0;
+  uint32_t offset = sizeof(header);
+  if (header.groups) {
+    _localManifestCache = new (std::nothrow) uint8_t[header.groups * hashSize];
+    if (!_localManifestCache ||
+        !_imageSource->readManifest(offset, _localManifestCache, header.groups * hashSize)) {
+      delete[] _localManifestCache;
+      _localManifestCache = nullptr;
+      return true;
+    }
+  }
+  offset += header.groups * hashSize;
+  if (shareBlocks) {
+    _blockIndex = new (std::nothrow) block_index_t[header.blocks];
+    uint32_t keys[64];
+    for (uint32_t block = 0; _blockIndex && block != header.blocks;) {
+      uint32_t count = std::min<uint32_t>(header.blocks - block, sizeof(keys) / sizeof(keys[0]));
+      if (!_imageSource->readManifest(offset + block * sizeof(keys[0]), (uint8_t*)keys,
+                                      count * sizeof(keys[0]))) {
+        delete[] _blockIndex;
+        _blockIndex = nullptr;
+        break;
+      }
+      for (uint32_t i = 0; i != count; ++i, ++block) {
+        _blockIndex[block].key = keys[i];
+        _blockIndex[block].block = block;
+      }
+    }
+    if (_blockIndex) {
+      _blockIndexSize = header.blocks;
+      std::sort(_blockIndex, _blockIndex + _blockIndexSize,
+                [](const block_index_t& a, const block_index_t& b) { return a.key < b.key; });
+    }
+  }
+  _localManifest = shape;
+  memcpy(_localManifestRoot, header.root, hashSize);
+  _haveLocalManifest = true;
+  return true;
+}
+
+template <typename Config>
+bool BasicLazyMeshOta<Config>::_manifestNodeHash(uint8_t level, uint32_t index, uint8_t* out) {
+  ManifestHasher hasher;
+  hasher.begin();
+  if (level == 0) {
+    uint32_t len = _localManifest.blockLength(index);
+    uint8_t buf[bufferSize];
+    if (!_imageSource->read(index * bufferSize, buf, len)) {
+      return false;
+    }
+    hasher.add(buf, len);
+  } else if (level == 1) {
+    memcpy(out, _localManifestCache + index * hashSize, hashSize);
+    return true;
+  } else {
+    uint32_t children = _localManifest.childCount(level, index);
+    for (uint32_t child = 0; child != children; ++child) {
+      uint8_t childHash[hashSize];
+      if (!_manifestNodeHash(level - 1, index * manifestFanout + child, childHash)) {
+        return false;
+      }
+      hasher.add(childHash, hashSize);
+    }
+  }
+  hasher.finish(out);
+  return true;
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_receiveHashReq(const eth_addr& src, BufStream& body) {
+  // "<src bssid>\n<image>\n<level>\n<index>\n"
+  String bssidStr = body.readStringUntil('\n');
+  eth_addr bssid;
+  if (!ethFromString(&bssid, bssidStr)) {
+    if (tracePackets > 1) {
+      Serial.println("Could not parse bssid " + bssidStr);
+    }
+    return;
+  }
+  if (!_servesImage(body.readStringUntil('\n'))) {
+    _debugPutchar('?');
+    return;
+  }
+  if (!_relaying() && !_haveLocalManifest) {
+    if (tracePackets > 1) {
+      Serial.println("Hash request received, but we have no manifest");
+    }
+    return;
+  }
+
+  // While relaying, the tree is of the image being relayed.
+  const ManifestShape& shape = _relaying() ? _relayShape : _localManifest;
+  long level = body.parseInt();
+  long index = body.parseInt();
+  if (level < 1 || level > shape.depth || index < 0 || uint32_t(index) >= shape.levelSize(level)) {
+    if (tracePackets > 1) {
+      Serial.printf("Hash request for nonexistent node %ld/%ld\n", level, index);
+    }
+    return;
+  }
+
+  String reply = String(level) + "\n" + String(index) + "\n";
+  uint32_t children = shape.childCount(level, index);
+  for (uint32_t child = 0; child != children; ++child) {
+    uint8_t childHash[hashSize];
+    uint32_t childIndex = index * shape.fanout + child;
+    if (_relaying() && _update && _updateManifest->loaded[level - 1] == index) {
+      // The node we're getting blocks under ourselves.
+      memcpy(childHash, _updateManifest->children[level - 1][child], hashSize);
+    } else if (_relaying()) {
+      if (!_relayNodeHash(level - 1, childIndex, childHash)) {
+        // Not that far yet; neither should the requester be.
+        return;
+      }
+    } else if (!_manifestNodeHash(level - 1, childIndex, childHash)) {
+      schedule_function(std::bind(&Listener::onError, _listener, "Reading from flash failed"));
+      return;
+    }
+    if (!concatString(&reply, (char*)childHash, hashSize)) {
+      schedule_function(std::bind(&Listener::onError, _listener, "Unable to concat to reply"));
+      return;
+    }
+  }
+  _transmit(PKT_TYPE::HASH_REPLY, src, bssid, reply);
+}
+
+template <typename Config>
+bool BasicLazyMeshOta<Config>::_manifestWantedNode(uint32_t block, uint8_t* level,
+                                                   uint32_t* index) {
+  const ManifestShape& shape = _updateManifest->shape;
+  // Work down from the top, since each level is verified against the one above.
+  for (uint8_t l = shape.depth; l > 0; --l) {
+    uint32_t node = shape.nodeForBlock(block, l);
+    if (_updateManifest->loaded[l - 1] != int32_t(node)) {
+      *level = l;
+      *index = node;
+      return true;
+    }
+  }
+  return false;
+}
+
+template <typename Config>
+bool BasicLazyMeshOta<Config>::_manifestVerifyBlock(uint32_t block, const uint8_t* data,
+                                                    uint32_t len) {
+  const ManifestShape& shape = _updateManifest->shape;
+  if (block >= shape.blocks() || len != shape.blockLength(block)) {
+    return false;
+  }
+
+  if (shape.depth > 0 && _updateManifest->loaded[0] != int32_t(shape.nodeForBlock(block, 1))) {
+    return false;
+  }
+  const uint8_t* expected = _manifestBlockHash(block);
+
+  uint8_t actual[hashSize];
+  ManifestHasher hasher;
+  hasher.begin();
+  hasher.add(data, len);
+  hasher.finish(actual);
+  return memcmp(actual, expected, hashSize) == 0;
+}
+
+template <typename Config>
+const uint8_t* BasicLazyMeshOta<Config>::_manifestBlockHash(uint32_t block) {
+  const ManifestShape& shape = _updateManifest->shape;
+  if (shape.depth == 0) {
+    return _updateManifest->root;
+  }
+  assert(_updateManifest->loaded[0] == int32_t(shape.nodeForBlock(block, 1)));
+  return _updateManifest->children[0][block % shape.fanout];
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_noteBlockSource(const eth_addr& src, const char* rest,
+                                                size_t len) {
+  // "\n<sketchsize>\n<md5sum>\n<bssid>\n<fields>..."
+  BufStream body((char*)rest, len);
+  body.readStringUntil('\n');
+  body.readStringUntil('\n');
+  body.readStringUntil('\n');
+  eth_addr bssid;
+  if (!ethFromString(&bssid, body.readStringUntil('\n'))) {
+    return;
+  }
+  bool offersBlocks = false;
+  while (body.available()) {
+    unsigned long blockSize;
+    if (sscanf(body.readStringUntil('\n').c_str(), "blocks %lu", &blockSize) == 1 &&
+        blockSize == _updateManifest->shape.blockSize) {
+      offersBlocks = true;
+    }
+  }
+  if (!offersBlocks) {
+    return;
+  }
+
+  block_sources_t& sources = _blockSources;
+  for (uint8_t i = 0; i != sources.count; ++i) {
+    if (memcmp(&sources.src[i], &src, sizeof(src)) == 0) {
+      sources.bssid[i] = bssid;
+      return;
+    }
+  }
+  uint8_t slot = sources.count;
+  if (sources.count == maxBlockSources) {
+    slot = sources.next;
+    sources.next = (sources.next + 1) % maxBlockSources;
+  } else {
+    ++sources.count;
+  }
+  if (tracePackets > 1) {
+    Serial.println("Block source " + ethToString(src));
+  }
+  sources.src[slot] = src;
+  sources.bssid[slot] = bssid;
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_receiveBlockReq(const eth_addr& src, BufStream& body) {
+  // "<src bssid>\n<start>\n<hex md5>\n"
+  if (!shareBlocks || !_blockIndexSize) {
+    return;
+  }
+  String bssidStr = body.readStringUntil('\n');
+  eth_addr bssid;
+  if (!ethFromString(&bssid, bssidStr)) {
+    if (tracePackets > 1) {
+      Serial.println("Could not parse bssid " + bssidStr);
+    }
+    return;
+  }
+  uint32_t startOffset = body.parseInt();
+  int nl = body.read();
+  uint8_t hash[hashSize];
+  if (nl != '\n' || !hashFromString(hash, body.readStringUntil('\n'))) {
+    if (tracePackets > 1) {
+      Serial.println("Unusable block request");
+    }
+    return;
+  }
+  if (!_airtimeRoom(1)) {
+    _debugPutchar('#');
+    return;
+  }
+
+  uint32_t key;
+  memcpy(&key, hash, sizeof(key));
+  block_index_t* end = _blockIndex + _blockIndexSize;
+  block_index_t* it =
+      std::lower_bound(_blockIndex, end, key,
+                       [](const block_index_t& entry, uint32_t k) { return entry.key < k; });
+  // Keys are only a prefix of the hash, so check the whole thing.
+  for (; it != end && it->key == key; ++it) {
+    uint32_t len = _localManifest.blockLength(it->block);
+    uint8_t buf[bufferSize];
+    LatencyStamp readStart = latencyHistograms ? latencyNow() : 0;
+    bool readOk = _imageSource->read(it->block * bufferSize, buf, len);
+    _latencySpan(LatencySpan::FLASH_READ, readStart);
+    if (!readOk) {
+      schedule_function(std::bind(&Listener::onError, _listener, "Reading from flash failed"));
+      return;
+    }
+    uint8_t actual[hashSize];
+    ManifestHasher hasher;
+    hasher.begin();
+    hasher.add(buf, len);
+    hasher.finish(actual);
+    if (memcmp(actual, hash, hashSize) != 0) {
+      continue;
+    }
+    if (tracePackets > 1) {
+      Serial.printf("Sending block %u as %u to %s\n", it->block, startOffset,
+                    ethToString(src).c_str());
+    }
+    String reply = String(startOffset) + "\n";
+    if (!concatString(&reply, (char*)buf, len)) {
+      schedule_function(std::bind(&Listener::onError, _listener, "Unable to concat to reply"));
+      return;
+    }
+    _transmit(PKT_TYPE::REPLY, src, bssid, reply);
+    return;
+  }
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_receiveHashReply(const eth_addr& /* src */, BufStream& body) {
+  // "<level>\n<index>\n<binary hashes>"
+  if (!_update || !_updateManifest) {
+    if (tracePackets > 1) {
+      Serial.print("No update with a manifest in progress!\n");
+    }
+    return;
+  }
+
+  long level = body.parseInt();
+  int nl = body.read();
+  long index = body.parseInt();
+  int nl2 = body.read();
+  if (nl != '\n' || nl2 != '\n') {
+    if (tracePackets > 1) {
+      Serial.printf("Missing newline in hash reply\n");
+    }
+    return;
+  }
+
+  uint8_t wantedLevel;
+  uint32_t wantedIndex;
+  const ManifestShape& shape = _updateManifest->shape;
+  if (!_manifestWantedNode(_update->offset / shape.blockSize, &wantedLevel, &wantedIndex) ||
+      level != wantedLevel || index != long(wantedIndex)) {
+    if (tracePackets > 1) {
+      Serial.printf("Unexpected hashes for node %ld/%ld\n", level, index);
+    }
+    return;
+  }
+
+  uint32_t children = shape.childCount(level, index);
+  if (body.peekAvailable() != children * hashSize) {
+    if (tracePackets > 1) {
+      Serial.printf("Hash reply has %u bytes; expected %u\n", body.peekAvailable(),
+                    children * hashSize);
+    }
+    return;
+  }
+
+  // Verify against the parent, which is either the root or already verified.
+  const uint8_t* expected = _updateManifest->root;
+  if (level != shape.depth) {
+    expected = _updateManifest->children[level][index % shape.fanout];
+  }
+  uint8_t actual[hashSize];
+  ManifestHasher hasher;
+  hasher.begin();
+  hasher.add((const uint8_t*)body.peekBuffer(), children * hashSize);
+  hasher.finish(actual);
+  if (memcmp(actual, expected, hashSize) != 0) {
+    _debugPutchar('!');
+    _verificationFailed("Hashes failed verification");
+    return;
+  }
+
+  memcpy(_updateManifest->children[level - 1], body.peekBuffer(), children * hashSize);
+  _updateManifest->loaded[level - 1] = index;
+  if (level == 1 && _relaying()) {
+    // Level 1 nodes are loaded in order, so everything before this one
+    // is known.
+    memcpy(_relayNodeHashes + index * hashSize, actual, hashSize);
+    _relayNodesKnown = std::max<uint32_t>(_relayNodesKnown, index + 1);
+  }
+  _update->retryCount = 0;
+  _requestNextBlock();
+}
+
+template <typename Config>
+uint32_t BasicLazyMeshOta<Config>::_groupBlocks(uint32_t groupStart, uint32_t blockSize,
+                                                uint8_t dataBlocks, uint32_t imageSize) {
+  uint32_t remaining = (imageSize - groupStart + blockSize - 1) / blockSize;
+  return std::min<uint32_t>(dataBlocks, remaining);
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_receiveGroupReq(const eth_addr& src, BufStream& body) {
+  // "<src bssid>\n<image>\n<start>\n<mask>\n"
+  String bssidStr = body.readStringUntil('\n');
+  eth_addr bssid;
+  if (!fecParityBlocks || _relaying() || !ethFromString(&bssid, bssidStr)) {
+    if (tracePackets > 1) {
+      Serial.println("Unable to process group request from " + bssidStr);
+    }
+    return;
+  }
+  if (!_servesImage(body.readStringUntil('\n'))) {
+    _debugPutchar('?');
+    return;
+  }
+
+  uint32_t groupStart = body.parseInt();
+  uint32_t mask = body.parseInt();
+  if (groupStart >= _localSketchSize || groupStart % bufferSize) {
+    if (tracePackets > 1) {
+      Serial.printf("Bad group start %u for local sketch size %u\n", groupStart,
+                    _localSketchSize);
+    }
+    return;
+  }
+
+  uint32_t blocks = _groupBlocks(groupStart, bufferSize, fecDataBlocks, _localSketchSize);
+  uint32_t frames = __builtin_popcount(mask & ((uint32_t(1) << blocks) - 1)) +
+                    std::min<uint32_t>(fecParityBlocks, blocks);
+  if (!_airtimeRoom(frames)) {
+    // Half a group is no use; the requester will ask again.
+    _debugPutchar('#');
+    return;
+  }
+  schedule_function(std::bind(&Listener::onSendProgress, _listener, src, groupStart,
+                              std::min<uint32_t>(blocks * bufferSize,
+                                                 _localSketchSize - groupStart),
+                              _localSketchSize));
+
+  // Every block has to be read to generate parity, even if it wasn't requested.
+  memset(_fecParity, 0, sizeof(_fecParity));
+  for (uint32_t i = 0; i != blocks; ++i) {
+    uint32_t start = groupStart + i * bufferSize;
+    uint32_t len = std::min<uint32_t>(bufferSize, _localSketchSize - start);
+    uint8_t buf[bufferSize];
+    if (!_imageSource->read(start, buf, len)) {
+      schedule_function(std::bind(&Listener::onError, _listener, "Reading from flash failed"));
+      return;
+    }
+    uint8_t* parity = _fecParity[i % fecParityBlocks];
+    for (uint32_t j = 0; j != len; ++j) {
+      parity[j] ^= buf[j];
+    }
+    if (mask & (uint32_t(1) << i)) {
+      String reply = String(start) + "\n";
+      if (!concatString(&reply, (char*)buf, len)) {
+        schedule_function(std::bind(&Listener::onError, _listener, "Unable to concat to reply"));
+        return;
+      }
+      _transmit(PKT_TYPE::REPLY, src, bssid, reply);
+    }
+  }
+
+  for (uint32_t i = 0; i != std::min<uint32_t>(fecParityBlocks, blocks); ++i) {
+    String reply = String(groupStart) + "\n" + String(i) + "\n";
+    if (!concatString(&reply, (char*)_fecParity[i], bufferSize)) {
+      schedule_function(std::bind(&Listener::onError, _listener, "Unable to concat to reply"));
+      return;
+    }
+    _transmit(PKT_TYPE::PARITY, src, bssid, reply);
+  }
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_fecReceive(uint32_t startOffset, int parityIndex,
+                                           BufStream& body) {
+  fec_t* fec = _updateFec;
+  uint32_t blocks = _groupBlocks(fec->groupStart, fec->blockSize, fec->dataBlocks, _update->size);
+  uint32_t len = body.peekAvailable();
+  uint8_t* dest;
+  if (parityIndex < 0) {
+    // Data block
+    uint32_t i = (startOffset - fec->groupStart) / fec->blockSize;
+    if (startOffset < fec->groupStart || (startOffset - fec->groupStart) % fec->blockSize ||
+        i >= blocks || len != std::min<uint32_t>(fec->blockSize, _update->size - startOffset)) {
+      _debugPutchar('~');
+      return;
+    }
+    fec->haveData |= uint32_t(1) << i;
+    dest = fec->data[i];
+  } else {
+    if (startOffset != fec->groupStart || uint32_t(parityIndex) >= fec->parityBlocks ||
+        uint32_t(parityIndex) >= blocks || len != fec->blockSize) {
+      _debugPutchar('~');
+      return;
+    }
+    fec->haveParity |= uint32_t(1) << parityIndex;
+    dest = fec->parity[parityIndex];
+  }
+  _debugPutchar('k');
+  memcpy(dest, body.peekBuffer(), len);
+  memset(dest + len, 0, fec->blockSize - len);
+
+  _fecRecover();
+
+  uint32_t all = (uint64_t(1) << blocks) - 1;
+  if (fec->haveData == all) {
+    _update->retryCount = 0;
+    _requestNextBlock();
+  } else if (parityIndex + 1 == std::min<int>(fec->parityBlocks, blocks)) {
+    // That was the last of the group, so anything still missing was lost.
+    // Ask for it now instead of waiting for a timeout.
+    ++_update->retryCount;
+    if (_update->retryCount <= maxRetries) {
+      _requestNextBlock();
+    }
+  }
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_fecRecover() {
+  fec_t* fec = _updateFec;
+  uint32_t blocks = _groupBlocks(fec->groupStart, fec->blockSize, fec->dataBlocks, _update->size);
+  for (uint32_t p = 0; p != fec->parityBlocks; ++p) {
+    if (!(fec->haveParity & (uint32_t(1) << p))) {
+      continue;
+    }
+    int missing = -1;
+    for (uint32_t i = p; i < blocks; i += fec->parityBlocks) {
+      if (!(fec->haveData & (uint32_t(1) << i))) {
+        if (missing >= 0) {
+          // Can only rebuild one per parity block.
+          missing = -2;
+          break;
+        }
+        missing = i;
+      }
+    }
+    if (missing < 0) {
+      continue;
+    }
+
+    uint8_t* dest = fec->data[missing];
+    memcpy(dest, fec->parity[p], fec->blockSize);
+    for (uint32_t i = p; i < blocks; i += fec->parityBlocks) {
+      if (int(i) != missing) {
+        for (uint32_t j = 0; j != fec->blockSize; ++j) {
+          dest[j] ^= fec->data[i][j];
+        }
+      }
+    }
+    fec->haveData |= uint32_t(1) << missing;
+    _debugPutchar('+');
+  }
+}
+
+template <typename Config>
+bool BasicLazyMeshOta<Config>::_fecFlush() {
+  fec_t* fec = _updateFec;
+  uint32_t blocks = _groupBlocks(fec->groupStart, fec->blockSize, fec->dataBlocks, _update->size);
+  while (_update->offset != _update->size) {
+    uint32_t i = (_update->offset - fec->groupStart) / fec->blockSize;
+    if (!(fec->haveData & (uint32_t(1) << i))) {
+      break;
+    }
+    uint32_t len = std::min<uint32_t>(fec->blockSize, _update->size - _update->offset);
+    uint8_t level;
+    uint32_t index;
+    if (_updateManifest) {
+      uint32_t block = _update->offset / fec->blockSize;
+      if (_manifestWantedNode(block, &level, &index)) {
+        // Our caller will ask for hashes.
+        break;
+      }
+      if (!_manifestVerifyBlock(block, fec->data[i], len)) {
+        _debugPutchar('!');
+        schedule_function(std::bind(&Listener::onError, _listener, "Block failed verification"));
+        fec->haveData &= ~(uint32_t(1) << i);
+        // Parity that rebuilt it may be bad too.
+        fec->haveParity = 0;
+        _useAltSrc();
+        break;
+      }
+    }
+
+    uint32_t writelen = _updateWrite(fec->data[i], len);
+    if (writelen != len) {
+      if (tracePackets > 1) {
+        Serial.printf("Tried to write %u to updater, but only got %u\n", len, writelen);
+      }
+      return false;
+    }
+    _update->offset += len;
+
+    if (i + 1 == blocks) {
+      // Start on the next group.
+      fec->groupStart = _update->offset;
+      fec->haveData = 0;
+      fec->haveParity = 0;
+      blocks = _groupBlocks(fec->groupStart, fec->blockSize, fec->dataBlocks, _update->size);
+    }
+  }
+  return true;
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_receiveStreamReq(const eth_addr& src, BufStream& body) {
+  // "<src bssid>\n<image>\n<start>\n<mask>\n<resume>\n"
+  String bssidStr = body.readStringUntil('\n');
+  eth_addr bssid;
+  if (!streamWindow || _relaying() || !ethFromString(&bssid, bssidStr)) {
+    if (tracePackets > 1) {
+      Serial.println("Unable to process stream request from " + bssidStr);
+    }
+    return;
+  }
+  if (!_servesImage(body.readStringUntil('\n'))) {
+    _debugPutchar('?');
+    return;
+  }
+
+  uint32_t startOffset = body.parseInt();
+  uint32_t mask = body.parseInt();
+  uint32_t resume = body.parseInt();
+  if (startOffset >= _localSketchSize || startOffset % bufferSize || resume % bufferSize) {
+    if (tracePackets > 1) {
+      Serial.printf("Bad stream start %u resume %u for local sketch size %u\n", startOffset,
+                    resume, _localSketchSize);
+    }
+    return;
+  }
+
+  stream_source_t* source = &_streamSource;
+  if (source->active && memcmp(&source->client, &src, sizeof(src)) == 0) {
+    source->next = std::min(source->next, resume);
+  } else if (source->active && _nowMillis - source->lastReq <= receiveTimeoutInterval) {
+    // Only one stream at a time, and its client is still asking for
+    // it.  Anyone else will ask again once they time out.
+    _debugPutchar('=');
+    return;
+  } else {
+    source->active = true;
+    source->client = src;
+    source->next = resume;
+    source->nextSend = _nowMicros;
+  }
+  source->bssid = bssid;
+  source->lastReq = _nowMillis;
+  source->resendStart = startOffset;
+  source->resendMask = 0;
+  for (uint32_t i = 0; i != 32; ++i) {
+    // Anything from 'next' onwards will be streamed anyway.
+    if ((mask & (uint32_t(1) << i)) && startOffset + i * bufferSize < source->next) {
+      source->resendMask |= uint32_t(1) << i;
+    }
+  }
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_streamSend() {
+  stream_source_t* source = &_streamSource;
+  if (_nowMillis - source->lastReq > receiveTimeoutInterval) {
+    // The client has gone quiet; it'll ask again if it's still there.
+    source->active = false;
+    return;
+  }
+  if (!_relaying() && !source->resendMask && source->next < _localSketchSize) {
+    _imageSource->readAhead(source->next, uint32_t(streamBurst) * bufferSize);
+  }
+  for (uint8_t burst = 0; burst != streamBurst; ++burst) {
+    if (int32_t(_nowMicros - source->nextSend) < 0 || _airtime.stats.queuedFrames) {
+      // Not time yet, or the airtime limit is holding back blocks already.
+      return;
+    }
+    uint32_t startOffset;
+    if (source->resendMask) {
+      uint32_t i = __builtin_ctz(source->resendMask);
+      source->resendMask &= ~(uint32_t(1) << i);
+      startOffset = source->resendStart + i * bufferSize;
+    } else if (source->next < _localSketchSize) {
+      startOffset = source->next;
+      source->next += bufferSize;
+    } else {
+      // All sent; a STREAM_REQ will start it again for anything missing.
+      source->active = false;
+      return;
+    }
+    _sendBlock(source->client, source->bssid, startOffset);
+    source->nextSend += streamPacing;
+    if (int32_t(_nowMicros - source->nextSend) > int32_t(streamPacing)) {
+      // Don't try to make up for lost time.
+      source->nextSend = _nowMicros;
+    }
+  }
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_streamReceive(uint32_t startOffset, BufStream& body) {
+  stream_t* stream = _updateStream;
+  uint32_t len = body.peekAvailable();
+  if (startOffset < _update->offset || startOffset >= _update->size ||
+      (startOffset - _update->offset) % stream->blockSize ||
+      len != std::min<uint32_t>(stream->blockSize, _update->size - startOffset)) {
+    // Probably one we already have.
+    _debugPutchar('~');
+    return;
+  }
+
+  uint32_t i = (startOffset - _update->offset) / stream->blockSize;
+  if (i >= streamWindow) {
+    // No room; it'll be sent again after our next STREAM_REQ.
+    _debugPutchar('>');
+    stream->gap = true;
+    return;
+  }
+  _debugPutchar('k');
+  _nextReceiveTimeout = _nowMillis + receiveTimeoutInterval;
+  _update->retryCount = 0;
+
+  if (i) {
+    memcpy(stream->data[(startOffset / stream->blockSize) % streamWindow], body.peekBuffer(),
+           len);
+    stream->have |= uint32_t(1) << i;
+    stream->gap = true;
+  } else {
+    uint8_t* data = (uint8_t*)body.peekBuffer();
+    for (;;) {
+      uint32_t writelen = _updateWrite(data, len);
+      if (writelen != len) {
+        if (tracePackets > 1) {
+          Serial.printf("Tried to write %u to updater, but only got %u\n", len, writelen);
+        }
+        return;
+      }
+      _update->offset += len;
+      stream->have >>= 1;
+      if (!(stream->have & 1)) {
+        break;
+      }
+      data = stream->data[(_update->offset / stream->blockSize) % streamWindow];
+      len = std::min<uint32_t>(stream->blockSize, _update->size - _update->offset);
+    }
+  }
+
+  // Also report in well before the source gives up on us, even if
+  // nothing has been lost.
+  if (_update->offset == _update->size ||
+      (stream->gap && int32_t(_nowMillis - stream->nextNack) >= 0) ||
+      int32_t(_nowMillis - stream->nextNack) >= int32_t(receiveTimeoutInterval / 2)) {
+    _requestNextBlock();
+  }
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_traceFrame(TraceEvent::Direction direction,
+                                           TraceEvent::Outcome outcome, const uint8_t* frm,
+                                           uint32_t len, int8_t rssi) {
+  if (!traceRingSize || !_trace.enabled()) {
+    return;
+  }
+  TraceEvent* ev = _trace.next();
+  ev->micros = _clock->micros();
+  ev->direction = direction;
+  ev->outcome = outcome;
+  ev->rssi = rssi;
+  ev->len = len;
+  if (len >= sizeof(hdr_t)) {
+    const hdr_t* hdr = reinterpret_cast<const hdr_t*>(frm);
+    memcpy(&ev->packetType, &hdr->packetType, sizeof(ev->packetType));
+    ev->seq = hdr->seq;
+    ev->dest = hdr->dest;
+    ev->src = hdr->src;
+    ev->bssid = hdr->bssid;
+  } else {
+    ev->packetType = 0xff;
+    ev->seq = 0;
+    memset(&ev->dest, 0, sizeof(eth_addr) * 3);
+  }
+}
+
+template <typename Config>
+void BasicLazyMeshOta<Config>::_traceSendFailed() {
+  if (!traceRingSize || !_trace.enabled()) {
+    return;
+  }
+  // Amend the event just recorded by _sendFrame.
+  TraceEvent* ev = _trace.last();
+  if (ev) {
+    ev->outcome = TraceEvent::Outcome::SEND_FAILED;
+  }
+}
+
+template <typename Config>
+size_t BasicLazyMeshOta<Config>::writeTracePcap(Print& out) {
+  writePcapHeader(out);
+  size_t count = 0;
+  TraceEvent ev;
+  while (_trace.pop(&ev)) {
+    writePcapRecord(out, ev);
+    ++count;
+  }
+  return count;
+}
+
+#endif
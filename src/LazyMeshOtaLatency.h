@@ -0,0 +1,95 @@
+#ifndef LAZYMESHOTALATENCY_H
+#define LAZYMESHOTALATENCY_H
+
+#include <Arduino.h>
+
+#if defined(EPOXY_DUINO)
+#include <chrono>
+#endif
+
+// Where time goes while updating.
+enum class LatencySpan : uint8_t {
+  // Copying a frame out of the raw wifi callback.
+  ISR_COPY,
+  // From the raw wifi callback until the frame is handled.
+  RX_QUEUE,
+  // Reading flash to answer a request.
+  FLASH_READ,
+  // Writing received data to the updater.
+  UPDATE_WRITE,
+  // Handing a frame to the transport.
+  RADIO_SEND,
+  // From sending a REQ until its REPLY arrives.
+  ROUND_TRIP,
+  COUNT,
+};
+
+// Timestamps for timing spans: the CPU cycle counter on the ESP, and a
+// monotonic clock in nanoseconds on the host.  Only differences are
+// meaningful.  The cycle counter wraps every 2^32 cycles, 53 seconds
+// at 80 MHz, so longer spans can't be seen on the ESP.
+#if defined(EPOXY_DUINO)
+using LatencyStamp = uint64_t;
+#else
+using LatencyStamp = uint32_t;
+#endif
+
+static inline LatencyStamp latencyNow() {
+#if defined(EPOXY_DUINO)
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#else
+  return ESP.getCycleCount();
+#endif
+}
+
+// Converts a difference of timestamps to nanoseconds, saturating at
+// UINT32_MAX (4.3 seconds) so long stalls land in the top bucket.
+static inline uint32_t latencyNanos(LatencyStamp ticks) {
+#if defined(EPOXY_DUINO)
+  uint64_t nanos = ticks;
+#else
+  uint64_t nanos = uint64_t(ticks) * 1000 / (F_CPU / 1000000);
+#endif
+  return nanos > UINT32_MAX ? UINT32_MAX : uint32_t(nanos);
+}
+
+// Counts spans in power of two buckets of nanoseconds.
+class LatencyHistogram {
+ public:
+  static constexpr size_t bucketCount = 32;
+
+  void add(uint32_t nanos) {
+    ++buckets[nanos ? 31 - __builtin_clz(nanos) : 0];
+    ++count;
+    totalNanos += nanos;
+    if (nanos > maxNanos) {
+      maxNanos = nanos;
+    }
+  }
+
+  // Smallest of the bucket upper bounds which at least the given
+  // fraction of spans fall below, in nanoseconds.
+  uint64_t percentile(float fraction) const {
+    uint32_t seen = 0;
+    for (size_t i = 0; i != bucketCount; ++i) {
+      seen += buckets[i];
+      if (seen && seen >= fraction * count) {
+        return uint64_t(2) << i;
+      }
+    }
+    return 0;
+  }
+
+  void clear() { *this = LatencyHistogram(); }
+
+  // buckets[i] counts spans of at least 2^i and less than 2^(i+1)
+  // nanoseconds; buckets[0] also counts spans of 0.
+  uint32_t buckets[bucketCount] = {};
+  uint32_t count = 0;
+  uint64_t totalNanos = 0;
+  uint32_t maxNanos = 0;
+};
+
+#endif
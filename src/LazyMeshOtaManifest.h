@@ -0,0 +1,109 @@
+#ifndef LAZYMESHOTAMANIFEST_H
+#define LAZYMESHOTAMANIFEST_H
+
+#include <Arduino.h>
+#include <assert.h>
+
+#include <algorithm>
+
+#if defined(EPOXY_DUINO)
+#include <openssl/md5.h>
+#else
+#include <MD5Builder.h>
+#endif
+
+// Incremental hash used for image manifests.  This is MD5, since the
+// ESP core already carries an implementation for checking updates.
+class ManifestHasher {
+ public:
+  static constexpr size_t hashSize = 16;
+
+#if defined(EPOXY_DUINO)
+  void begin() { MD5_Init(&_ctx); }
+  void add(const uint8_t* data, size_t len) { MD5_Update(&_ctx, data, len); }
+  void finish(uint8_t* out) { MD5_Final(out, &_ctx); }
+
+ private:
+  MD5_CTX _ctx;
+#else
+  void begin() { _md5.begin(); }
+  void add(const uint8_t* data, size_t len) {
+    // MD5Builder only takes 16 bit lengths.
+    while (len) {
+      uint16_t chunk = std::min<size_t>(len, 0x8000);
+      _md5.add(data, chunk);
+      data += chunk;
+      len -= chunk;
+    }
+  }
+  void finish(uint8_t* out) {
+    _md5.calculate();
+    _md5.getBytes(out);
+  }
+
+ private:
+  MD5Builder _md5;
+#endif
+};
+
+// Shape of a hash tree over an image.
+//
+// Level 0 holds the hashes of each block of the image.  Each node on
+// level n+1 is the hash of the concatenated hashes of up to 'fanout'
+// consecutive nodes on level n.  The single node on the top level is
+// the root.  An image of a single block has the block hash as its root.
+struct ManifestShape {
+  ManifestShape() = default;
+  ManifestShape(uint32_t imageSizeArg, uint32_t blockSizeArg, uint16_t fanoutArg)
+      : imageSize(imageSizeArg), blockSize(blockSizeArg), fanout(fanoutArg) {
+    assert(blockSize > 0);
+    assert(fanout > 1);
+    uint32_t n = blocks();
+    while (n > 1) {
+      n = (n + fanout - 1) / fanout;
+      ++depth;
+    }
+  }
+
+  uint32_t blocks() const { return (imageSize + blockSize - 1) / blockSize; }
+
+  // Number of nodes on the given level.
+  uint32_t levelSize(uint8_t level) const {
+    uint32_t n = blocks();
+    while (level--) {
+      n = (n + fanout - 1) / fanout;
+    }
+    return n;
+  }
+
+  // Index of the node on the given level which covers the given block.
+  uint32_t nodeForBlock(uint32_t block, uint8_t level) const {
+    while (level--) {
+      block /= fanout;
+    }
+    return block;
+  }
+
+  // Number of children of the given node, which must not be on level 0.
+  uint32_t childCount(uint8_t level, uint32_t index) const {
+    assert(level > 0);
+    uint32_t below = levelSize(level - 1);
+    uint32_t first = index * fanout;
+    assert(first < below);
+    return std::min<uint32_t>(fanout, below - first);
+  }
+
+  // Length of the given block; the last one may be short.
+  uint32_t blockLength(uint32_t block) const {
+    uint32_t start = block * blockSize;
+    assert(start < imageSize);
+    return std::min<uint32_t>(blockSize, imageSize - start);
+  }
+
+  uint32_t imageSize = 0;
+  uint32_t blockSize = 1;
+  uint16_t fanout = 2;
+  uint8_t depth = 0;
+};
+
+#endif
@@ -0,0 +1,7 @@
+#if defined(EPOXY_DUINO)
+
+#include "LazyMeshOtaMemory.h"
+
+thread_local HeapCounters lazyMeshOtaHeap;
+
+#endif
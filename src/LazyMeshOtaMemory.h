@@ -0,0 +1,117 @@
+#ifndef LAZYMESHOTAMEMORY_H
+#define LAZYMESHOTAMEMORY_H
+
+#include <Arduino.h>
+
+#include <algorithm>
+
+#if defined(EPOXY_DUINO)
+#include <alloca.h>
+#endif
+
+// Ways into the library, for memory accounting.
+enum class MemoryEntry : uint8_t {
+  BEGIN,
+  // The loop, whether run by the application or the wake timer.
+  LOOP,
+  // Handling a received frame.
+  RECEIVE,
+  COUNT,
+};
+
+struct MemoryUsage {
+  uint32_t calls = 0;
+  // Deepest the stack went below the entry point, in bytes.
+  uint32_t peakStack = 0;
+  // Most heap in use at once beyond what was in use on entry, in bytes.
+  uint32_t peakHeap = 0;
+  // Allocations made, if they're counted.
+  uint32_t allocations = 0;
+  // Calls which went over a budget.
+  uint32_t overBudget = 0;
+};
+
+#if defined(EPOXY_DUINO)
+// Heap use of the current thread, kept by LazyMeshOtaMemoryHooks.h if
+// the program includes it.
+struct HeapCounters {
+  int64_t inUse;
+  int64_t peak;
+  uint32_t allocations;
+};
+extern thread_local HeapCounters lazyMeshOtaHeap;
+#endif
+
+// Measures the stack and heap used between start() and stop(), which
+// must be called from the same function so the stack pointer is the
+// same for both.
+class MemoryProbe {
+ public:
+#if defined(EPOXY_DUINO)
+  // How far below the entry point the host stack is watched.
+  static constexpr size_t stackWatch = 32768;
+#endif
+
+  __attribute__((always_inline)) void start() {
+#if defined(EPOXY_DUINO)
+    _probeStack(stackWatch, true /* paint */);
+    _heapStart = lazyMeshOtaHeap.inUse;
+    lazyMeshOtaHeap.peak = _heapStart;
+    _allocationsStart = lazyMeshOtaHeap.allocations;
+#else
+    ESP.resetFreeContStack();
+    _stackStart = ESP.getFreeContStack();
+    _heapStart = ESP.getFreeHeap();
+#endif
+  }
+
+  // Adds what was used since start() to 'usage', returning the stack
+  // and heap bytes used.
+  __attribute__((always_inline)) void stop(MemoryUsage* usage, uint32_t* stack,
+                                           uint32_t* heap) {
+#if defined(EPOXY_DUINO)
+    *stack = _probeStack(stackWatch, false /* paint */);
+    *heap = lazyMeshOtaHeap.peak - _heapStart;
+    usage->allocations += lazyMeshOtaHeap.allocations - _allocationsStart;
+#else
+    *stack = _stackStart - ESP.getFreeContStack();
+    // Without allocation hooks, only what's still in use is seen.
+    uint32_t heapEnd = ESP.getFreeHeap();
+    *heap = _heapStart > heapEnd ? _heapStart - heapEnd : 0;
+#endif
+    ++usage->calls;
+    usage->peakStack = std::max(usage->peakStack, *stack);
+    usage->peakHeap = std::max(usage->peakHeap, *heap);
+  }
+
+ private:
+#if defined(EPOXY_DUINO)
+  static constexpr uint8_t _paint = 0xa5;
+
+  // Fills 'len' bytes of stack below the caller with a pattern, or
+  // returns how many of them have since been overwritten.
+  __attribute__((noinline)) static uint32_t _probeStack(size_t len, bool paint) {
+    volatile uint8_t* area = (volatile uint8_t*)alloca(len);
+    if (paint) {
+      for (size_t i = 0; i != len; ++i) {
+        area[i] = _paint;
+      }
+      return 0;
+    }
+    // The stack grows down, so the deepest use is at the start.
+    size_t untouched = 0;
+    while (untouched != len && area[untouched] == _paint) {
+      ++untouched;
+    }
+    return len - untouched;
+  }
+
+  int64_t _heapStart = 0;
+  uint32_t _allocationsStart = 0;
+#else
+  uint32_t _stackStart = 0;
+  uint32_t _heapStart = 0;
+#endif
+};
+
+#endif
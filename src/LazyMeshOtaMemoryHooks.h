@@ -0,0 +1,63 @@
+#ifndef LAZYMESHOTAMEMORYHOOKS_H
+#define LAZYMESHOTAMEMORYHOOKS_H
+
+// Replaces malloc and friends to count the heap used by each thread,
+// for memoryAccounting.  Include in exactly one file of a host program.
+
+#include "LazyMeshOtaMemory.h"
+
+#if defined(EPOXY_DUINO) && defined(__linux__)
+
+#include <malloc.h>
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void __libc_free(void* ptr);
+
+static inline void lazyMeshOtaNoteAlloc(void* ptr) {
+  lazyMeshOtaHeap.inUse += malloc_usable_size(ptr);
+  lazyMeshOtaHeap.peak = std::max(lazyMeshOtaHeap.peak, lazyMeshOtaHeap.inUse);
+  ++lazyMeshOtaHeap.allocations;
+}
+
+void* malloc(size_t size) {
+  void* ptr = __libc_malloc(size);
+  if (ptr) {
+    lazyMeshOtaNoteAlloc(ptr);
+  }
+  return ptr;
+}
+
+void* calloc(size_t count, size_t size) {
+  void* ptr = __libc_calloc(count, size);
+  if (ptr) {
+    lazyMeshOtaNoteAlloc(ptr);
+  }
+  return ptr;
+}
+
+void* realloc(void* ptr, size_t size) {
+  size_t oldSize = ptr ? malloc_usable_size(ptr) : 0;
+  void* newPtr = __libc_realloc(ptr, size);
+  if (newPtr || !size) {
+    lazyMeshOtaHeap.inUse -= oldSize;
+  }
+  if (newPtr) {
+    lazyMeshOtaNoteAlloc(newPtr);
+  }
+  return newPtr;
+}
+
+void free(void* ptr) {
+  if (ptr) {
+    lazyMeshOtaHeap.inUse -= malloc_usable_size(ptr);
+  }
+  __libc_free(ptr);
+}
+}
+
+#endif
+
+#endif
@@ -0,0 +1,93 @@
+#if defined(EPOXY_DUINO)
+
+#include "LazyMeshOtaPrebuilt.h"
+
+#include <vector>
+
+#include "LazyMeshOtaImage.h"
+
+bool writePrebuiltManifest(LazyMeshOtaImageSource& image, const String& sketchName, int version,
+                           uint32_t blockSize, uint16_t fanout, bool blockKeys, Print& out) {
+  constexpr size_t hashSize = ManifestHasher::hashSize;
+  PrebuiltManifestHeader header;
+  header.imageSize = image.size();
+  if (!header.imageSize || (blockSize && fanout < 2)) {
+    return false;
+  }
+  header.version = version;
+  prebuiltManifestHash((const uint8_t*)sketchName.c_str(), sketchName.length(), header.nameMd5);
+
+  // One pass over the image for its md5 and the hashes of each block.
+  ManifestShape shape;
+  if (blockSize) {
+    shape = ManifestShape(header.imageSize, blockSize, fanout);
+  }
+  std::vector<uint8_t> level(blockSize ? shape.blocks() * hashSize : 0);
+  std::vector<uint8_t> buf(blockSize ? blockSize : 4096);
+  ManifestHasher imageHasher;
+  imageHasher.begin();
+  for (uint32_t offset = 0, block = 0; offset < header.imageSize; offset += buf.size(), ++block) {
+    uint32_t len = std::min<uint32_t>(buf.size(), header.imageSize - offset);
+    if (!image.read(offset, buf.data(), len)) {
+      return false;
+    }
+    imageHasher.add(buf.data(), len);
+    if (blockSize) {
+      ManifestHasher blockHasher;
+      blockHasher.begin();
+      blockHasher.add(buf.data(), len);
+      blockHasher.finish(level.data() + block * hashSize);
+    }
+  }
+  imageHasher.finish(header.md5);
+
+  uint8_t tail[PrebuiltManifestHeader::tailLength];
+  uint32_t tailLen = std::min<uint32_t>(header.imageSize, sizeof(tail));
+  if (!image.read(header.imageSize - tailLen, tail, tailLen)) {
+    return false;
+  }
+  prebuiltManifestHash(tail, tailLen, header.tailMd5);
+
+  // Hash each level from the one below, keeping level 1.
+  std::vector<uint8_t> blockHashes;
+  std::vector<uint8_t> groups;
+  if (blockSize) {
+    header.blockSize = blockSize;
+    header.fanout = fanout;
+    blockHashes = level;
+    for (uint8_t depth = 1; depth <= shape.depth; ++depth) {
+      uint32_t nodes = shape.levelSize(depth);
+      std::vector<uint8_t> above(nodes * hashSize);
+      for (uint32_t node = 0; node != nodes; ++node) {
+        ManifestHasher hasher;
+        hasher.begin();
+        hasher.add(level.data() + node * fanout * hashSize,
+                   shape.childCount(depth, node) * hashSize);
+        hasher.finish(above.data() + node * hashSize);
+      }
+      level.swap(above);
+      if (depth == 1) {
+        groups = level;
+      }
+    }
+    memcpy(header.root, level.data(), hashSize);
+    header.groups = groups.size() / hashSize;
+    header.blocks = blockKeys ? shape.blocks() : 0;
+  } else {
+    memset(header.root, 0, hashSize);
+  }
+
+  PrebuiltManifestFooter footer;
+  footer.length = sizeof(header) + groups.size() + header.blocks * sizeof(uint32_t) +
+                  sizeof(footer);
+  out.write((const uint8_t*)&header, sizeof(header));
+  out.write(groups.data(), groups.size());
+  for (uint32_t block = 0; block != header.blocks; ++block) {
+    // The first bytes of the block hash, as the nodes' block index keys.
+    out.write(blockHashes.data() + block * hashSize, sizeof(uint32_t));
+  }
+  out.write((const uint8_t*)&footer, sizeof(footer));
+  return true;
+}
+
+#endif
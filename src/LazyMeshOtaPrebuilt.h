@@ -0,0 +1,94 @@
+#ifndef LAZYMESHOTAPREBUILT_H
+#define LAZYMESHOTAPREBUILT_H
+
+#include <Arduino.h>
+#include <string.h>
+
+#include "LazyMeshOtaManifest.h"
+
+// A manifest computed at build time, by tests/ManifestTool, and stored
+// right after the image it describes, so a node knows its own md5 and
+// hash tree at boot without hashing anything.  Flashing the image
+// along with the manifest leaves the manifest where
+// FlashImageSource::readManifest finds it.
+//
+// The manifest is this header, then 'groups' level 1 hashes of the hash
+// tree, then 'blocks' block keys (the first 4 bytes of each block hash),
+// then the footer, so it can also be found from the end of a file.  All
+// fields are little endian.
+struct PrebuiltManifestHeader {
+  static constexpr uint32_t MAGIC = 0x4d4f4d4c;  // "LMOM"
+  uint32_t magic = MAGIC;
+  uint32_t imageSize = 0;
+  uint8_t md5[ManifestHasher::hashSize];
+  // Hash of the last tailLength bytes of the image, so a manifest left
+  // behind by a different image of the same size isn't believed.
+  uint8_t tailMd5[ManifestHasher::hashSize];
+  // The hash tree, if blockSize is nonzero.
+  uint32_t blockSize = 0;
+  uint16_t fanout = 0;
+  uint16_t reserved = 0;
+  uint8_t root[ManifestHasher::hashSize];
+  uint32_t groups = 0;
+  uint32_t blocks = 0;
+  // The version and hash of the sketch name passed to begin.  An update
+  // of the same size can leave the manifest of the sketch it replaced
+  // right after it, matching tailMd5 if only the middle changed, but
+  // it's never the same version.
+  int32_t version = 0;
+  uint8_t nameMd5[ManifestHasher::hashSize];
+
+  static constexpr uint32_t tailLength = 256;
+};
+static_assert(sizeof(PrebuiltManifestHeader) == 92, "prebuilt manifest header has padding");
+
+struct PrebuiltManifestFooter {
+  static constexpr uint32_t MAGIC = 0x454d4f4c;  // "LOME"
+  // Of the whole manifest, from the header to the end of the footer.
+  uint32_t length = 0;
+  uint32_t magic = MAGIC;
+};
+
+// Length of the manifest at the end of the given image file contents,
+// or 0 if there isn't one.
+static inline uint32_t prebuiltManifestLength(const uint8_t* data, uint32_t len) {
+  PrebuiltManifestFooter footer;
+  if (len < sizeof(PrebuiltManifestHeader) + sizeof(footer)) {
+    return 0;
+  }
+  memcpy(&footer, data + len - sizeof(footer), sizeof(footer));
+  if (footer.magic != PrebuiltManifestFooter::MAGIC || footer.length > len ||
+      footer.length < sizeof(PrebuiltManifestHeader) + sizeof(footer)) {
+    return 0;
+  }
+  PrebuiltManifestHeader header;
+  memcpy(&header, data + len - footer.length, sizeof(header));
+  if (header.magic != PrebuiltManifestHeader::MAGIC ||
+      header.imageSize != len - footer.length) {
+    return 0;
+  }
+  return footer.length;
+}
+
+// Hash of the end of an image, as PrebuiltManifestHeader::tailMd5, or
+// of a sketch name, as nameMd5.
+static inline void prebuiltManifestHash(const uint8_t* data, uint32_t len, uint8_t* out) {
+  ManifestHasher hasher;
+  hasher.begin();
+  hasher.add(data, len);
+  hasher.finish(out);
+}
+
+#if defined(EPOXY_DUINO)
+class LazyMeshOtaImageSource;
+
+// Hashes an image and writes its manifest, for the sketch name and
+// version it passes to begin.  A nonzero blockSize adds the hash tree
+// for that block size and fanout, which must match the nodes'
+// bufferSize and manifestFanout; blockKeys adds the keys needed for
+// shareBlocks.  Returns false if the image couldn't be read.
+bool writePrebuiltManifest(LazyMeshOtaImageSource& image, const String& sketchName, int version,
+                           uint32_t blockSize, uint16_t fanout, bool blockKeys, Print& out);
+#endif
+
+#endif
@@ -0,0 +1,198 @@
+#ifndef LAZYMESHOTAREPLAY_H
+#define LAZYMESHOTAREPLAY_H
+
+#include <LazyMeshOta.h>
+
+#include <string>
+#include <vector>
+
+#if defined(EPOXY_DUINO)
+
+// Replays a capture written by setCapture into a fresh instance on the
+// host.  The instance runs under a virtual clock which reads whatever
+// the captured instance's clock read, draws the captured random
+// numbers, and is called whenever the captured one was.  The replay
+// checks that it sends the same frames at the same times and makes the
+// same listener calls, so anything seen in the field can be reproduced.
+//
+// The local sketch in the current FakeUpdateContext must be the one the
+// captured node was running.  Listener calls go to 'next', if set.
+class LazyMeshOtaReplay : public LazyMeshOtaClock,
+                          public LazyMeshOtaTransport,
+                          public LazyMeshOtaBase::StateListener {
+ public:
+  // Returns false if the capture is malformed.
+  bool load(const std::string& capture) {
+    _records.clear();
+    if (capture.size() < sizeof(captureMagic) + 1 ||
+        memcmp(capture.data(), captureMagic, sizeof(captureMagic)) ||
+        uint8_t(capture[sizeof(captureMagic)]) != captureVersion) {
+      return false;
+    }
+    size_t pos = sizeof(captureMagic) + 1;
+    while (pos != capture.size()) {
+      record_t rec;
+      if (capture.size() - pos < sizeof(rec.hdr)) {
+        return false;
+      }
+      memcpy(&rec.hdr, capture.data() + pos, sizeof(rec.hdr));
+      pos += sizeof(rec.hdr);
+      if (capture.size() - pos < rec.hdr.len) {
+        return false;
+      }
+      rec.payload = capture.substr(pos, rec.hdr.len);
+      pos += rec.hdr.len;
+      _records.push_back(rec);
+    }
+    return !_records.empty() && _records[0].hdr.type == CaptureRecord::Type::BEGIN &&
+           _records[0].payload.size() >= sizeof(eth_addr) * 2 + sizeof(int32_t);
+  }
+
+  // Runs the loaded capture through 'ota', which must not have begun.
+  // Returns false at the first difference, which error() describes.
+  template <typename Ota>
+  bool run(Ota& ota) {
+    _error = String();
+    _tx.clear();
+    _states.clear();
+    _randoms.clear();
+    for (const record_t& rec : _records) {
+      switch (rec.hdr.type) {
+        case CaptureRecord::Type::TX:
+          _tx.push_back(&rec);
+          break;
+        case CaptureRecord::Type::STATE:
+          _states.push_back(&rec);
+          break;
+        case CaptureRecord::Type::RANDOM:
+          _randoms.push_back(&rec);
+          break;
+        default:
+          break;
+      }
+    }
+    _txPos = _statePos = _randomPos = 0;
+
+    const std::string& begin = _records[0].payload;
+    memcpy(&_macAddress, begin.data(), sizeof(eth_addr));
+    memcpy(&_bssid, begin.data() + sizeof(eth_addr), sizeof(eth_addr));
+    int32_t version;
+    memcpy(&version, begin.data() + sizeof(eth_addr) * 2, sizeof(version));
+    String sketchName = begin.substr(sizeof(eth_addr) * 2 + sizeof(version)).c_str();
+
+    ota.setClock(this);
+    ota.setTransport(this);
+    ota.setListener(this);
+    for (const record_t& rec : _records) {
+      _millis = rec.hdr.millis;
+      _micros = rec.hdr.micros;
+      switch (rec.hdr.type) {
+        case CaptureRecord::Type::BEGIN:
+          ota.begin(sketchName, version);
+          break;
+        case CaptureRecord::Type::LOOP:
+          ota.loop();
+          break;
+        case CaptureRecord::Type::RX: {
+          size_t len = rec.payload.size() - 1;
+          RxPacket* pkt = (RxPacket*)malloc(sizeof(RxControl) + len);
+          pkt->rx_ctl.rssi = rec.payload[0];
+          pkt->rx_ctl.legacy_length = len;
+          memcpy(pkt->data, rec.payload.data() + 1, len);
+          ota.onReceiveRawFrame(pkt);
+          break;
+        }
+        default:
+          break;
+      }
+      if (_error.length()) {
+        return false;
+      }
+    }
+    if (_txPos != _tx.size()) {
+      _diverged(_tx[_txPos]->hdr.millis, "captured frame " + String(_txPos) + " was never sent");
+    } else if (_statePos != _states.size()) {
+      _diverged(_states[_statePos]->hdr.millis,
+                "captured listener call " + String(_statePos) + " never happened");
+    } else if (_randomPos != _randoms.size()) {
+      _diverged(_randoms[_randomPos]->hdr.millis, "fewer random numbers drawn");
+    }
+    return !_error.length();
+  }
+
+  const String& error() const { return _error; }
+
+  // LazyMeshOtaClock
+  uint32_t millis() override { return _millis; }
+  uint32_t micros() override { return _micros; }
+  long random(long min, long /* max */) override {
+    if (_randomPos == _randoms.size()) {
+      _diverged(_millis, "more random numbers drawn");
+      return min;
+    }
+    int32_t value;
+    memcpy(&value, _randoms[_randomPos++]->payload.data(), sizeof(value));
+    return value;
+  }
+
+  // LazyMeshOtaTransport
+  eth_addr macAddress() override { return _macAddress; }
+  eth_addr bssid() override { return _bssid; }
+  bool send(uint8_t* frame, uint16_t len) override {
+    if (_txPos == _tx.size()) {
+      _diverged(_millis, "sent a frame not in the capture");
+    } else {
+      const record_t* expected = _tx[_txPos];
+      if (expected->hdr.millis != _millis || expected->hdr.micros != _micros) {
+        _diverged(_millis, "sent frame " + String(_txPos) + " at a different time than at " +
+                               String(expected->hdr.millis));
+      } else if (expected->payload.size() != len ||
+                 memcmp(expected->payload.data(), frame, len)) {
+        _diverged(_millis, "sent frame " + String(_txPos) + " differs from the capture");
+      }
+      ++_txPos;
+    }
+    free(frame);
+    return true;
+  }
+
+  // LazyMeshOtaBase::StateListener
+  void onState(CaptureState state, const String& description) override {
+    if (_statePos == _states.size()) {
+      _diverged(_millis, "listener call not in the capture: " + description);
+      return;
+    }
+    const std::string& expected = _states[_statePos++]->payload;
+    if (expected.empty() || CaptureState(expected[0]) != state ||
+        expected.substr(1) != description.c_str()) {
+      _diverged(_millis, "listener call '" + description + "' differs from the capture's '" +
+                             String(expected.substr(1).c_str()) + "'");
+    }
+  }
+
+ private:
+  struct record_t {
+    CaptureRecord hdr;
+    std::string payload;
+  };
+
+  void _diverged(uint32_t millis, const String& what) {
+    if (!_error.length()) {
+      _error = "At " + String(millis) + " ms: " + what;
+    }
+  }
+
+  std::vector<record_t> _records;
+  // Outputs expected, in the order they were captured.
+  std::vector<const record_t*> _tx, _states, _randoms;
+  size_t _txPos = 0, _statePos = 0, _randomPos = 0;
+  uint32_t _millis = 0;
+  uint32_t _micros = 0;
+  eth_addr _macAddress;
+  eth_addr _bssid;
+  String _error;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef LAZYMESHOTATRACE_H
+#define LAZYMESHOTATRACE_H
+
+#include <Arduino.h>
+
+// One frame sent or received by LazyMeshOta, as recorded in the trace ring.
+struct TraceEvent {
+  enum class Direction : uint8_t { RX, TX };
+  enum class Outcome : uint8_t {
+    SENT,
+    SEND_FAILED,
+    // Dispatched to a packet handler.
+    ACCEPTED,
+    // Not a LazyMeshOta frame.
+    OTHER_PROTOCOL,
+    // Addressed to another node.
+    NOT_FOR_US,
+    // Sent by us.
+    OWN_FRAME,
+    TOO_SHORT,
+    BAD_LENGTH,
+    UNKNOWN_TYPE,
+  };
+
+  uint32_t micros;
+  Direction direction;
+  Outcome outcome;
+  int8_t rssi;
+  uint8_t packetType;
+  uint16_t seq;
+  // Length of the whole frame.
+  uint16_t len;
+  eth_addr dest;
+  eth_addr src;
+  eth_addr bssid;
+};
+
+// Fixed size ring of trace events.  When full, the oldest events are
+// overwritten and counted in 'overwritten'.
+template <size_t capacity>
+class TraceRing {
+ public:
+  bool enabled() const { return _enabled; }
+  void setEnabled(bool enabled) { _enabled = enabled; }
+
+  // Returns the slot to fill in for a new event.
+  TraceEvent* next() {
+    TraceEvent* ev = &_events[(_start + _count) % capacity];
+    if (_count == capacity) {
+      _start = (_start + 1) % capacity;
+      ++overwritten;
+    } else {
+      ++_count;
+    }
+    return ev;
+  }
+
+  // Returns the most recent event, or null if empty.
+  TraceEvent* last() {
+    if (!_count) {
+      return nullptr;
+    }
+    return &_events[(_start + _count - 1) % capacity];
+  }
+
+  // Removes the oldest event.  Returns false if empty.
+  bool pop(TraceEvent* out) {
+    if (!_count) {
+      return false;
+    }
+    *out = _events[_start];
+    _start = (_start + 1) % capacity;
+    --_count;
+    return true;
+  }
+
+  size_t size() const { return _count; }
+
+  uint32_t overwritten = 0;
+
+ private:
+  bool _enabled = false;
+  size_t _start = 0;
+  size_t _count = 0;
+  TraceEvent _events[capacity];
+};
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef LAZYMESHOTATRANSPORT_H
+#define LAZYMESHOTATRANSPORT_H
+
+#include <Arduino.h>
+
+#if defined(EPOXY_DUINO)
+#include "fake_wifi.h"
+#else
+#include <lwip/prot/ethernet.h>
+#include <user_interface.h>
+#include <wifi_raw.h>
+#endif
+
+// Sends LazyMeshOta's frames and says who we are.  Received frames are
+// passed to BasicLazyMeshOta::onReceiveRawFrame by whoever owns the
+// transport.
+class LazyMeshOtaTransport {
+ public:
+  virtual ~LazyMeshOtaTransport() = default;
+
+  // Address we send from.
+  virtual eth_addr macAddress() = 0;
+  // BSSID neighbors should use when replying to us.
+  virtual eth_addr bssid() = 0;
+  // Sends a frame allocated with malloc, taking ownership of it whether
+  // or not the send succeeds.  Returns false on failure.
+  virtual bool send(uint8_t* frame, uint16_t len) = 0;
+  // Powers the radio up or down, for rendezvousPeriod.  Nothing is
+  // received while it's down; it's brought up again before sending.
+  virtual void setRadioOn(bool /* on */) {}
+};
+
+// The ESP8266's raw wifi interface.  This is the default transport.
+class RawWifiTransport : public LazyMeshOtaTransport {
+ public:
+  eth_addr macAddress() override {
+    eth_addr addr;
+    wifi_get_macaddr(0 /* STATION_IF */, addr.addr);
+    return addr;
+  }
+  eth_addr bssid() override {
+    eth_addr bssid;
+    station_config sc;
+    wifi_station_get_config(&sc);
+    memcpy(&bssid, sc.bssid, sizeof(bssid));
+    return bssid;
+  }
+  bool send(uint8_t* frame, uint16_t len) override {
+    if (_waking) {
+      // The radio takes a moment to come back after wakeup.
+      _waking = false;
+      delay(1);
+    }
+    if (wifi_send_raw_packet(frame, len) < 0) {
+      free(frame);
+      return false;
+    }
+    return true;
+  }
+  // Like ESP8266WiFi's forceSleepBegin and forceSleepWake: wifi is
+  // turned off before forcing modem sleep, and its mode restored after.
+  void setRadioOn(bool on) override {
+    if (on) {
+      if (!_asleep) {
+        return;
+      }
+      _asleep = false;
+      _waking = true;
+      wifi_fpm_do_wakeup();
+      wifi_fpm_close();
+      _restoreMode();
+    } else {
+      if (_asleep) {
+        return;
+      }
+      _sleepMode = wifi_get_opmode();
+      if (!wifi_set_opmode_current(NULL_MODE)) {
+        return;
+      }
+      wifi_fpm_set_sleep_type(MODEM_SLEEP_T);
+      wifi_fpm_open();
+      if (wifi_fpm_do_sleep(0xfffffff) != 0) {
+        // Stay awake rather than leave wifi off.
+        wifi_fpm_close();
+        _restoreMode();
+        return;
+      }
+      _asleep = true;
+    }
+  }
+
+ private:
+  void _restoreMode() {
+    wifi_set_opmode_current(_sleepMode);
+    if (_sleepMode & STATION_MODE) {
+      wifi_station_connect();
+    }
+  }
+
+  // Whether we put the radio to sleep, and the mode it was in then.
+  bool _asleep = false;
+  uint8_t _sleepMode = NULL_MODE;
+  // Set on wakeup until the next send.
+  bool _waking = false;
+};
+
+#endif
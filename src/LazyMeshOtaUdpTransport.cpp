@@ -0,0 +1,95 @@
+#if defined(EPOXY_DUINO) && defined(__linux__)
+
+#include "LazyMeshOtaUdpTransport.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+constexpr const char* UdpTransport::defaultGroup;
+constexpr uint16_t UdpTransport::defaultPort;
+
+// Largest frame we can receive; legacy_length is 12 bits.
+static constexpr size_t maxFrameLength = 4095;
+
+UdpTransport::UdpTransport(eth_addr macAddress, eth_addr bssid, const char* group, uint16_t port)
+    : _macAddress(macAddress), _bssid(bssid), _groupAddr(inet_addr(group)), _port(port) {
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return;
+  }
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+  // Everyone on the group hears everything, so take as much buffer as
+  // we're allowed.
+  int bufSize = 4 << 20;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufSize, sizeof(bufSize));
+
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = _groupAddr;
+  if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return;
+  }
+
+  in_addr loopback;
+  loopback.s_addr = htonl(INADDR_LOOPBACK);
+  ip_mreq mreq;
+  mreq.imr_multiaddr.s_addr = _groupAddr;
+  mreq.imr_interface = loopback;
+  unsigned char loop = 1;
+  if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0 ||
+      setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &loopback, sizeof(loopback)) < 0 ||
+      setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0) {
+    close(fd);
+    return;
+  }
+  _fd = fd;
+}
+
+UdpTransport::~UdpTransport() {
+  if (_fd >= 0) {
+    close(_fd);
+  }
+}
+
+bool UdpTransport::send(uint8_t* frame, uint16_t len) {
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(_port);
+  addr.sin_addr.s_addr = _groupAddr;
+  ssize_t sent = sendto(_fd, frame, len, 0, (sockaddr*)&addr, sizeof(addr));
+  free(frame);
+  if (sent != len) {
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      ++sendDrops;
+    }
+    return false;
+  }
+  return true;
+}
+
+RxPacket* UdpTransport::receive() {
+  uint8_t buf[maxFrameLength];
+  ssize_t len = recv(_fd, buf, sizeof(buf), 0);
+  if (len <= 0) {
+    return nullptr;
+  }
+  RxPacket* pkt = (RxPacket*)malloc(sizeof(RxControl) + len);
+  if (!pkt) {
+    return nullptr;
+  }
+  memcpy(pkt->data, buf, len);
+  pkt->rx_ctl.rssi = 0;
+  pkt->rx_ctl.legacy_length = len;
+  return pkt;
+}
+
+#endif
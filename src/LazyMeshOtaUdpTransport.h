@@ -0,0 +1,46 @@
+#ifndef LAZYMESHOTAUDPTRANSPORT_H
+#define LAZYMESHOTAUDPTRANSPORT_H
+
+#include "LazyMeshOtaTransport.h"
+
+#if defined(EPOXY_DUINO) && defined(__linux__)
+
+// Carries frames in UDP datagrams to a multicast group on loopback, so
+// any number of processes on one host share a broadcast medium.  Frames
+// are delivered unchanged, 802.11 header and all.
+class UdpTransport : public LazyMeshOtaTransport {
+ public:
+  static constexpr const char* defaultGroup = "239.255.76.77";
+  static constexpr uint16_t defaultPort = 7677;
+
+  UdpTransport(eth_addr macAddress, eth_addr bssid, const char* group = defaultGroup,
+               uint16_t port = defaultPort);
+  ~UdpTransport();
+
+  // False if the socket couldn't be set up.
+  bool ok() const { return _fd >= 0; }
+  // Nonblocking socket to wait on for received frames.
+  int fd() const { return _fd; }
+
+  eth_addr macAddress() override { return _macAddress; }
+  eth_addr bssid() override { return _bssid; }
+  bool send(uint8_t* frame, uint16_t len) override;
+
+  // Returns the next received frame, allocated with malloc, or null if
+  // none are waiting.
+  RxPacket* receive();
+
+  // Frames which couldn't be sent because the socket buffer was full.
+  uint32_t sendDrops = 0;
+
+ private:
+  int _fd = -1;
+  eth_addr _macAddress;
+  eth_addr _bssid;
+  uint32_t _groupAddr;
+  uint16_t _port;
+};
+
+#endif
+
+#endif
@@ -2,7 +2,7 @@
 
 #include "fake_update.h"
 
-FakeUpdateContext* FakeUpdateContext::curContext = nullptr;
+thread_local FakeUpdateContext* FakeUpdateContext::curContext = nullptr;
 FakeUpdateForwarder Update;
 
 #endif
@@ -11,10 +11,25 @@
 class FakeUpdateContext {
  public:
   FakeUpdateContext(const std::string &localSketchData, uint32_t chipId)
-      : _localSketchData(localSketchData), _chipId(chipId) {
+      : _localSketchData(localSketchData),
+        _localData((const uint8_t *)_localSketchData.data()),
+        _localSize(_localSketchData.size()),
+        _chipId(chipId) {
     enable();
   }
+  // Uses a local sketch owned by someone else, such as a
+  // MappedFileImageSource shared by many nodes, instead of a copy.
+  FakeUpdateContext(const uint8_t *localSketch, size_t size, uint32_t chipId)
+      : _localData(localSketch), _localSize(size), _chipId(chipId) {
+    enable();
+  }
+  ~FakeUpdateContext() {
+    if (curContext == this) {
+      curContext = nullptr;
+    }
+  }
 
+  // Makes this the context used by the calling thread.
   void enable() { curContext = this; }
 
   // Set to true if an update was successful.
@@ -28,6 +43,7 @@ class FakeUpdateContext {
     _size = 0;
     _curError = String();
     _inProgress = true;
+    _updateData.clear();
     MD5_Init(&_md5);
     didBegin = true;
     return true;
@@ -39,6 +55,7 @@ class FakeUpdateContext {
   void printError(Print &out) { out.print(_curError); }
   size_t write(uint8_t *data, size_t len) {
     MD5_Update(&_md5, data, len);
+    _updateData.append((const char *)data, len);
     _size += len;
     return len;
   }
@@ -75,28 +92,71 @@ class FakeUpdateContext {
   // Fakes for reading existing local flash
   inline uint32_t getLocalSketchSize() {
     assert(FakeUpdateContext::curContext);
-    return _localSketchData.size();
+    return _localSize;
   }
   String getLocalSketchMD5() {
     assert(FakeUpdateContext::curContext);
-    uint8_t result[MD5_DIGEST_LENGTH];
-    MD5((const uint8_t *)_localSketchData.data(), _localSketchData.size(), result);
-    return md5ToString(result);
+    if (!_localMd5.length()) {
+      // The local sketch never changes, so only hash it once.
+      uint8_t result[MD5_DIGEST_LENGTH];
+      MD5(_localData, _localSize, result);
+      _localMd5 = md5ToString(result);
+    }
+    return _localMd5;
   }
   bool localFlashRead(uint32_t address, uint8_t *data, size_t size) {
     assert(FakeUpdateContext::curContext);
-    if (address + size > _localSketchData.size()) {
+    if (address + size > _localSize) {
       return false;
     }
 
-    memcpy(data, _localSketchData.data() + address, size);
+    _simulateFlashRead(size);
+    memcpy(data, _localData + address, size);
+    return true;
+  }
+
+  // Fakes for reading back the update partition.  Like the real
+  // updater, only whole sectors of what's been written are in flash.
+  uint32_t flashSectorSize = 1;
+  bool updateFlashRead(uint32_t address, uint8_t *data, size_t size) {
+    if (address + size > updateFlashedSize(_updateData.size())) {
+      return false;
+    }
+    memcpy(data, _updateData.data() + address, size);
+    return true;
+  }
+  uint32_t updateFlashedSize(uint32_t written) {
+    return _inProgress ? written / flashSectorSize * flashSectorSize : written;
+  }
+
+  uint32_t freeSketchSpace = 64 * 1024;
+
+  // Time to read flash, to model how long it takes to hash a sketch.
+  uint32_t flashReadMicrosPerKb = 0;
+  // Total bytes read from local flash.
+  uint64_t flashBytesRead = 0;
+
+  // RTC user memory, which survives "reboots" of the same context.
+  bool rtcUserMemoryRead(uint32_t offset, uint32_t *data, size_t size) {
+    if (offset * 4 + size > sizeof(_rtcMemory)) {
+      return false;
+    }
+    memcpy(data, _rtcMemory + offset, size);
+    return true;
+  }
+  bool rtcUserMemoryWrite(uint32_t offset, uint32_t *data, size_t size) {
+    if (offset * 4 + size > sizeof(_rtcMemory)) {
+      return false;
+    }
+    memcpy(_rtcMemory + offset, data, size);
     return true;
   }
   uint32_t getLocalChipId() { return _chipId; }
 
   void espRestart() { didRestart = true; }
 
-  static FakeUpdateContext *curContext;
+  // Context being processed by this thread.
+  static thread_local FakeUpdateContext *curContext;
 
  private:
   MD5_CTX _md5;
@@ -106,8 +166,20 @@ class FakeUpdateContext {
   String _expected_md5;
   String _curError;
 
+  void _simulateFlashRead(size_t size) {
+    flashBytesRead += size;
+    if (flashReadMicrosPerKb) {
+      delayMicroseconds(uint64_t(size) * flashReadMicrosPerKb / 1024);
+    }
+  }
+
   std::string _localSketchData;
+  const uint8_t *_localData;
+  size_t _localSize;
+  String _localMd5;
+  std::string _updateData;
   uint32_t _chipId;
+  uint32_t _rtcMemory[128] = {};
 };
 
 class FakeUpdateForwarder {
@@ -128,9 +200,9 @@ static inline uint32_t getSketchSize() {
   assert(FakeUpdateContext::curContext);
   return FakeUpdateContext::curContext->getLocalSketchSize();
 }
-static inline String getSketchMD5() {
+static inline uint32_t getFreeSketchSpace() {
   assert(FakeUpdateContext::curContext);
-  return FakeUpdateContext::curContext->getLocalSketchMD5();
+  return FakeUpdateContext::curContext->freeSketchSpace;
 }
 static inline bool flashRead(uint32_t address, uint8_t *data, size_t size) {
   assert(FakeUpdateContext::curContext);
@@ -140,6 +212,23 @@ static inline uint32_t getChipId() {
   assert(FakeUpdateContext::curContext);
   return FakeUpdateContext::curContext->getLocalChipId();
 }
+static inline bool rtcUserMemoryRead(uint32_t offset, uint32_t *data, size_t size) {
+  assert(FakeUpdateContext::curContext);
+  return FakeUpdateContext::curContext->rtcUserMemoryRead(offset, data, size);
+}
+static inline bool rtcUserMemoryWrite(uint32_t offset, uint32_t *data, size_t size) {
+  assert(FakeUpdateContext::curContext);
+  return FakeUpdateContext::curContext->rtcUserMemoryWrite(offset, data, size);
+}
+static inline bool updateFlashRead(uint32_t /* imageSize */, uint32_t offset, uint8_t *data,
+                                   size_t size) {
+  assert(FakeUpdateContext::curContext);
+  return FakeUpdateContext::curContext->updateFlashRead(offset, data, size);
+}
+static inline uint32_t updateFlashedSize(uint32_t written) {
+  assert(FakeUpdateContext::curContext);
+  return FakeUpdateContext::curContext->updateFlashedSize(written);
+}
 static inline void espRestart() {
   assert(FakeUpdateContext::curContext);
   return FakeUpdateContext::curContext->espRestart();
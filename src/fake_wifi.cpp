@@ -2,7 +2,7 @@
 
 #include "fake_wifi.h"
 
-FakeWifiContext* FakeWifiContext::curContext = nullptr;
-RxPacket* FakeWifiContext::rawWifiPacket = nullptr;
+thread_local FakeWifiContext* FakeWifiContext::curContext = nullptr;
+FakeWifiMedium FakeWifiMedium::shared;
 
 #endif
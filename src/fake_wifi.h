@@ -4,6 +4,11 @@
 #include <Arduino.h>
 #include <assert.h>
 
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <vector>
+
 // from lwip
 struct eth_addr {
   uint8_t addr[6];
@@ -27,28 +32,103 @@ typedef void (*wifi_raw_recv_cb_fn)(struct RxPacket*);
 extern void wifi_raw_set_recv_cb(wifi_raw_recv_cb_fn rx_fn);
 
 // esp8266 core stubs
+
+struct FakeWifiContext;
+
+// Contexts which hear each other.  Contexts on different media never
+// interact, so a large simulation can be split into independent cells
+// run on different threads.
+struct FakeWifiMedium {
+  // Guards contexts and their inboxes.
+  std::mutex mutex;
+  std::vector<FakeWifiContext*> contexts;
+
+  // Where contexts go if not given a medium.
+  static FakeWifiMedium shared;
+};
+
+// Each context has its own inbox; sent packets are copied to the inbox
+// of every other context on the medium, like a broadcast medium.
 struct FakeWifiContext {
  public:
-  FakeWifiContext(eth_addr macaddrArg, eth_addr bssidArg) : macaddr(macaddrArg), bssid(bssidArg) {
+  FakeWifiContext(eth_addr macaddrArg, eth_addr bssidArg,
+                  FakeWifiMedium* mediumArg = &FakeWifiMedium::shared)
+      : macaddr(macaddrArg), bssid(bssidArg), medium(mediumArg) {
+    {
+      std::lock_guard<std::mutex> lock(medium->mutex);
+      medium->contexts.push_back(this);
+    }
+    _radioChanged = micros();
     enable();
   }
+  ~FakeWifiContext() {
+    {
+      std::lock_guard<std::mutex> lock(medium->mutex);
+      medium->contexts.erase(
+          std::find(medium->contexts.begin(), medium->contexts.end(), this));
+    }
+    discardInbox();
+    if (curContext == this) {
+      curContext = nullptr;
+    }
+  }
 
+  // Makes this the context used by the calling thread.
   void enable() { curContext = this; }
 
-  static void discardRawWifiPacket() {
-    if (rawWifiPacket) {
-      free(rawWifiPacket);
-      rawWifiPacket = nullptr;
+  // Removes and returns the oldest packet received, or null if none.
+  RxPacket* nextPacket() {
+    std::lock_guard<std::mutex> lock(medium->mutex);
+    if (inbox.empty()) {
+      return nullptr;
+    }
+    RxPacket* pkt = inbox.front();
+    inbox.pop_front();
+    return pkt;
+  }
+
+  void discardInbox() {
+    while (RxPacket* pkt = nextPacket()) {
+      free(pkt);
+    }
+  }
+
+  // Powers the simulated radio up or down.  Frames only reach contexts
+  // whose radio is on, and can't be sent while it's off.
+  void setRadioOn(bool on) {
+    std::lock_guard<std::mutex> lock(medium->mutex);
+    if (on == radioOn) {
+      return;
+    }
+    uint32_t now = micros();
+    if (radioOn) {
+      _radioOnMicros += now - _radioChanged;
     }
+    radioOn = on;
+    _radioChanged = now;
+  }
+  // Time the radio has been on since the context was created, to
+  // account for energy.
+  uint64_t radioOnMicros() {
+    std::lock_guard<std::mutex> lock(medium->mutex);
+    return _radioOnMicros + (radioOn ? micros() - _radioChanged : 0);
   }
 
   eth_addr macaddr;
   eth_addr bssid;
-
-  // Current context being processed
-  static FakeWifiContext* curContext;
-  // packet shared by all contexts.
-  static RxPacket* rawWifiPacket;
+  FakeWifiMedium* medium;
+  std::deque<RxPacket*> inbox;
+  // Guarded by the medium's mutex.
+  bool radioOn = true;
+  // From wifi_set_opmode_current.
+  uint8_t opmode = 0x01;  // STATION_MODE
+
+  // Context being processed by this thread.
+  static thread_local FakeWifiContext* curContext;
+
+ private:
+  uint64_t _radioOnMicros = 0;
+  uint32_t _radioChanged = 0;
 };
 
 static inline bool wifi_get_macaddr(uint8_t /* if_index */, uint8_t* macaddr) {
@@ -57,13 +137,24 @@ static inline bool wifi_get_macaddr(uint8_t /* if_index */, uint8_t* macaddr) {
   return true;
 }
 static inline int wifi_send_raw_packet(void* buf, int len) {
-  FakeWifiContext::discardRawWifiPacket();
-  auto& rawWifiPacket = FakeWifiContext::rawWifiPacket;
-  rawWifiPacket = (RxPacket*)malloc(sizeof(RxControl) + len);
-  memcpy(rawWifiPacket->data, buf, len);
+  FakeWifiContext* cur = FakeWifiContext::curContext;
+  assert(cur);
+  std::lock_guard<std::mutex> lock(cur->medium->mutex);
+  if (!cur->radioOn) {
+    // Like the SDK, the frame is only taken over once it's sent.
+    return -1;
+  }
+  for (FakeWifiContext* ctx : cur->medium->contexts) {
+    if (ctx == cur || !ctx->radioOn) {
+      continue;
+    }
+    RxPacket* pkt = (RxPacket*)malloc(sizeof(RxControl) + len);
+    memcpy(pkt->data, buf, len);
+    pkt->rx_ctl.rssi = 1;
+    pkt->rx_ctl.legacy_length = len;
+    ctx->inbox.push_back(pkt);
+  }
   free(buf);
-  rawWifiPacket->rx_ctl.rssi = 1;
-  rawWifiPacket->rx_ctl.legacy_length = len;
   return len;
 }
 
@@ -76,6 +167,41 @@ static inline void wifi_station_get_config(station_config* sc) {
   memcpy(sc->bssid, &FakeWifiContext::curContext->bssid, sizeof(sc->bssid));
 }
 
+#define NULL_MODE 0x00
+#define STATION_MODE 0x01
+#define SOFTAP_MODE 0x02
+#define STATIONAP_MODE 0x03
+
+static inline uint8_t wifi_get_opmode() {
+  assert(FakeWifiContext::curContext);
+  return FakeWifiContext::curContext->opmode;
+}
+static inline bool wifi_set_opmode_current(uint8_t opmode) {
+  assert(FakeWifiContext::curContext);
+  FakeWifiContext::curContext->opmode = opmode;
+  return true;
+}
+static inline bool wifi_station_connect() { return true; }
+
+// Forced modem sleep turns the context's radio off.  As on the ESP, it
+// fails unless wifi is off first.
+enum sleep_type { NONE_SLEEP_T = 0, LIGHT_SLEEP_T, MODEM_SLEEP_T };
+static inline bool wifi_fpm_set_sleep_type(sleep_type /* type */) { return true; }
+static inline void wifi_fpm_open() {}
+static inline void wifi_fpm_close() {}
+static inline int8_t wifi_fpm_do_sleep(uint32_t /* us */) {
+  assert(FakeWifiContext::curContext);
+  if (FakeWifiContext::curContext->opmode != NULL_MODE) {
+    return -1;
+  }
+  FakeWifiContext::curContext->setRadioOn(false);
+  return 0;
+}
+static inline void wifi_fpm_do_wakeup() {
+  assert(FakeWifiContext::curContext);
+  FakeWifiContext::curContext->setRadioOn(true);
+}
+
 // No need for interrupt stuff to be in the IRAM when testing.
 #define IRAM_ATTR
 
@@ -0,0 +1,160 @@
+// Measures update completion time against packet loss rate, with and
+// without forward error correction, and with streaming.  Time is
+// virtual: every frame sent takes its airtime at the 802.11b basic
+// rate, lost or not, and idle nodes skip ahead to their next timer, so
+// results don't depend on how fast the host is.
+//
+// Build and run with "make -C tests benchmarks".
+
+#include <Arduino.h>
+#include <LazyMeshOta.h>
+#include <LazyMeshOtaImpl.h>
+
+#include "../QuietListener.h"
+
+eth_addr testBssid = {3, 1, 3, 3, 3, 7};
+
+void wifi_raw_set_recv_cb(wifi_raw_recv_cb_fn /* rx_fn */) {
+  assert(0 /* this should not be called */);
+}
+
+struct BenchConfig : LazyMeshOtaConfig {
+  static constexpr uint32_t advertiseInterval = 100;
+  static constexpr uint32_t receiveTimeoutInterval = 50;
+  static constexpr uint16_t bufferSize = 64;
+  static constexpr uint16_t maxRetries = 1000;
+};
+
+struct FecBenchConfig : BenchConfig {
+  static constexpr uint8_t fecDataBlocks = 8;
+  static constexpr uint8_t fecParityBlocks = 2;
+};
+
+struct StreamBenchConfig : BenchConfig {
+  static constexpr uint8_t streamWindow = 16;
+  static constexpr uint32_t streamPacing = 100;
+  static constexpr uint32_t streamNackInterval = 2;
+};
+
+// Virtual time shared by both nodes.
+class BenchClock : public LazyMeshOtaClock {
+ public:
+  uint32_t millis() override { return _micros / 1000; }
+  uint32_t micros() override { return _micros; }
+  long random(long min, long max) override { return ::random(min, max); }
+
+  void advance(uint64_t micros) { _micros += micros; }
+
+ private:
+  uint64_t _micros = 0;
+};
+
+// Airtime of a frame at 1 Mbit/s, after a long preamble.
+static uint32_t frameMicros(uint16_t len) { return 192 + uint32_t(len) * 8; }
+
+// Deterministic loss pattern, so runs are comparable.
+class Loss {
+ public:
+  Loss(uint32_t percent) : _percent(percent) {}
+  bool drop() {
+    _state = _state * 1103515245 + 12345;
+    return (_state >> 16) % 100 < _percent;
+  }
+
+ private:
+  uint32_t _percent;
+  uint32_t _state = 1;
+};
+
+struct Result {
+  uint32_t millis;
+  uint32_t frames;
+  uint32_t timeouts;
+  bool done;
+};
+
+template <typename Ota>
+uint32_t deliver(Ota& ota, FakeWifiContext& wifiCtx, FakeUpdateContext& updateCtx, Loss& loss,
+                 BenchClock& clock) {
+  wifiCtx.enable();
+  updateCtx.enable();
+  uint32_t frames = 0;
+  while (RxPacket* pkt = wifiCtx.nextPacket()) {
+    ++frames;
+    clock.advance(frameMicros(pkt->rx_ctl.legacy_length));
+    if (loss.drop()) {
+      free(pkt);
+    } else {
+      ota.onReceiveRawFrame(pkt);
+    }
+  }
+  ota.loop();
+  return frames;
+}
+
+template <typename Config>
+Result run(uint32_t lossPercent, const std::string& sketch1, const std::string& sketch2) {
+  Loss loss(lossPercent);
+  BenchClock clock;
+  QuietListener listener;
+
+  FakeWifiContext wifi1({1, 2, 3, 4, 5, 6}, testBssid);
+  FakeUpdateContext update1(sketch1, 12345);
+  BasicLazyMeshOta<Config> lmo1;
+  lmo1.setClock(&clock);
+  lmo1.setListener(&listener);
+  lmo1.begin("FecBench", 2);
+
+  FakeWifiContext wifi2({7, 8, 9, 10, 11, 12}, testBssid);
+  FakeUpdateContext update2(sketch2, 789101);
+  QuietListener listener2;
+  BasicLazyMeshOta<Config> lmo2;
+  lmo2.setClock(&clock);
+  lmo2.setListener(&listener2);
+  lmo2.begin("FecBench", 1);
+
+  Result result = {0, 0, 0, false};
+  // Don't count the wait for the first advertisement.
+  uint32_t start = 0;
+  while (!update2.didUpdate && clock.millis() < 120000) {
+    uint32_t frames = deliver(lmo1, wifi1, update1, loss, clock);
+    frames += deliver(lmo2, wifi2, update2, loss, clock);
+    result.frames += frames;
+    if (!start && update2.didBegin) {
+      start = clock.millis();
+      result.frames = 0;
+    }
+    if (!frames) {
+      // Nothing on the air; skip to whichever node has work next.
+      uint32_t wait = std::min(lmo1.millisUntilWork(), lmo2.millisUntilWork());
+      clock.advance(wait ? wait * 1000 : 100);
+    }
+  }
+  result.millis = clock.millis() - start;
+  result.timeouts = listener2.timeouts;
+  result.done = update2.didUpdate;
+  return result;
+}
+
+void printResult(const char* mode, uint32_t lossPercent, const Result& result) {
+  Serial.printf("%-8s %5u%% %10u %8u %9u%s\n", mode, lossPercent, result.millis, result.frames,
+                result.timeouts, result.done ? "" : " (did not finish)");
+}
+
+void setup() {
+  std::string sketch1, sketch2;
+  for (int i = 0; i != 8192; ++i) {
+    sketch1.push_back(char(i * 7));
+    sketch2.push_back(char(i * 13));
+  }
+
+  Serial.printf("%-8s %6s %10s %8s %9s\n", "mode", "loss", "millis", "frames", "timeouts");
+  for (uint32_t lossPercent : {0, 5, 10, 20, 30}) {
+    printResult("plain", lossPercent, run<BenchConfig>(lossPercent, sketch1, sketch2));
+    printResult("fec 8+2", lossPercent, run<FecBenchConfig>(lossPercent, sketch1, sketch2));
+    printResult("stream", lossPercent, run<StreamBenchConfig>(lossPercent, sketch1, sketch2));
+  }
+  exit(0);
+}
+
+void loop() {}
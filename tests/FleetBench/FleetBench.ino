@@ -0,0 +1,182 @@
+// Runs a fleet of simulated nodes sharded across worker threads, and
+// measures how many node loop iterations per second the host manages
+// with one thread and with all of them.
+//
+// The fleet is split into cells, each on its own fake wifi medium, with
+// one node in each cell holding a new version which spreads through
+// the rest.  A worker thread steps every node of the cells it owns.
+//
+// Build and run with "make -C tests benchmarks".  Options:
+//   --nodes <n>      total number of nodes (default 2000)
+//   --cell <n>       nodes per cell (default 8)
+//   --threads <n>    worker threads for the parallel run (default: one
+//                    per core)
+//   --seconds <n>    give up on a run after this long (default 30)
+
+#include <Arduino.h>
+#include <LazyMeshOta.h>
+#include <LazyMeshOtaImpl.h>
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "../QuietListener.h"
+
+eth_addr testBssid = {3, 1, 3, 3, 3, 7};
+
+void wifi_raw_set_recv_cb(wifi_raw_recv_cb_fn /* rx_fn */) {
+  assert(0 /* this should not be called */);
+}
+
+struct FleetConfig : LazyMeshOtaConfig {
+  static constexpr uint32_t advertiseInterval = 200;
+  static constexpr uint32_t receiveTimeoutInterval = 100;
+  static constexpr uint16_t bufferSize = 256;
+  static constexpr uint16_t maxRetries = 1000;
+  static constexpr bool useManifest = true;
+  static constexpr bool relayPartial = true;
+  static constexpr uint32_t relayAdvertiseInterval = 50;
+};
+
+using FleetOta = BasicLazyMeshOta<FleetConfig>;
+
+// Nodes share their sketch's bytes instead of each keeping a copy.
+struct Node {
+  Node(eth_addr mac, FakeWifiMedium* medium, const std::string& sketch)
+      : wifi(mac, testBssid, medium),
+        update((const uint8_t*)sketch.data(), sketch.size(), mac.addr[2] << 8 | mac.addr[3]) {}
+
+  FakeWifiContext wifi;
+  FakeUpdateContext update;
+  QuietListener listener;
+  FleetOta ota;
+};
+
+struct Cell {
+  FakeWifiMedium medium;
+  std::vector<std::unique_ptr<Node>> nodes;
+};
+
+struct Result {
+  uint64_t steps = 0;
+  uint32_t updated = 0;
+  uint32_t millis = 0;
+};
+
+static std::string newImage() {
+  std::string image;
+  for (uint32_t i = 0; i != 8192; ++i) {
+    image += char(i * 7 + (i >> 8));
+  }
+  return image;
+}
+
+// Builds, begins, and steps the given cells until every node has
+// updated or time runs out.  Runs on a worker thread; the fake contexts
+// it enables are only current for that thread.
+static void runCells(uint32_t firstCell, uint32_t cellCount, uint32_t cellSize,
+                     uint32_t seconds, std::atomic<uint64_t>* steps,
+                     std::atomic<uint32_t>* updated) {
+  std::string image = newImage();
+  std::string old = "old";
+  std::vector<std::unique_ptr<Cell>> cells;
+  for (uint32_t c = firstCell; c != firstCell + cellCount; ++c) {
+    cells.emplace_back(new Cell);
+    Cell& cell = *cells.back();
+    for (uint32_t i = 0; i != cellSize; ++i) {
+      eth_addr mac = {0x02, 0x46, uint8_t(c >> 8), uint8_t(c), uint8_t(i), 0};
+      cell.nodes.emplace_back(new Node(mac, &cell.medium, i ? old : image));
+      Node& node = *cell.nodes.back();
+      node.wifi.enable();
+      node.update.enable();
+      node.ota.setListener(&node.listener);
+      node.ota.begin("FleetBench", i ? 1 : 2);
+    }
+  }
+
+  uint32_t pending = cellCount * (cellSize - 1);
+  uint64_t localSteps = 0;
+  uint32_t start = millis();
+  while (pending && millis() - start < seconds * 1000) {
+    pending = 0;
+    for (auto& cell : cells) {
+      for (auto& node : cell->nodes) {
+        node->wifi.enable();
+        node->update.enable();
+        while (RxPacket* pkt = node->wifi.nextPacket()) {
+          node->ota.onReceiveRawFrame(pkt);
+        }
+        node->ota.loop();
+        ++localSteps;
+        if (node.get() != cell->nodes.front().get() && !node->update.didUpdate) {
+          ++pending;
+        }
+      }
+    }
+  }
+  *steps += localSteps;
+  *updated += cellCount * (cellSize - 1) - pending;
+}
+
+static Result runFleet(uint32_t cellCount, uint32_t cellSize, uint32_t threadCount,
+                       uint32_t seconds) {
+  std::atomic<uint64_t> steps(0);
+  std::atomic<uint32_t> updated(0);
+  std::vector<std::thread> threads;
+  uint32_t start = millis();
+  uint32_t firstCell = 0;
+  for (uint32_t t = 0; t != threadCount; ++t) {
+    uint32_t count = cellCount / threadCount + (t < cellCount % threadCount ? 1 : 0);
+    threads.emplace_back(runCells, firstCell, count, cellSize, seconds, &steps, &updated);
+    firstCell += count;
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  Result result;
+  result.millis = millis() - start;
+  result.steps = steps;
+  result.updated = updated;
+  return result;
+}
+
+static void printResult(uint32_t threadCount, uint32_t total, const Result& r) {
+  Serial.printf("%3u threads: %u/%u nodes updated in %u ms, %.0f node steps/s\n", threadCount,
+                r.updated, total, r.millis, r.steps * 1000.0 / r.millis);
+}
+
+void setup() {
+  uint32_t nodes = 2000;
+  uint32_t cellSize = 8;
+  uint32_t threadCount = std::max(1u, std::thread::hardware_concurrency());
+  uint32_t seconds = 30;
+  for (int i = 1; i < epoxy_argc; ++i) {
+    String arg = epoxy_argv[i];
+    if (arg == "--nodes" && i + 1 < epoxy_argc) {
+      nodes = atoi(epoxy_argv[++i]);
+    } else if (arg == "--cell" && i + 1 < epoxy_argc) {
+      cellSize = atoi(epoxy_argv[++i]);
+    } else if (arg == "--threads" && i + 1 < epoxy_argc) {
+      threadCount = atoi(epoxy_argv[++i]);
+    } else if (arg == "--seconds" && i + 1 < epoxy_argc) {
+      seconds = atoi(epoxy_argv[++i]);
+    }
+  }
+  cellSize = std::max(2u, std::min(cellSize, 256u));
+  uint32_t cellCount = std::max(1u, std::min(nodes / cellSize, 65536u));
+  threadCount = std::max(1u, std::min(threadCount, cellCount));
+  uint32_t total = cellCount * (cellSize - 1);
+
+  Serial.printf("%u cells of %u nodes\n", cellCount, cellSize);
+  Result serial = runFleet(cellCount, cellSize, 1, seconds);
+  printResult(1, total, serial);
+  Result parallel = runFleet(cellCount, cellSize, threadCount, seconds);
+  printResult(threadCount, total, parallel);
+  Serial.printf("speedup %.2fx\n", (parallel.steps * 1000.0 / parallel.millis) /
+                                       (serial.steps * 1000.0 / serial.millis));
+  exit(0);
+}
+
+void loop() {}
@@ -0,0 +1,429 @@
+// Measures the per-packet CPU cost of parsing, building and dispatching
+// frames, which bounds how many packets a seeder can handle.  Each row
+// feeds prebuilt frames through one path and reports time, heap
+// allocations and bytes passed to memcpy per operation.
+//
+// Build and run with "make -C tests benchmarks".  Results are compared
+// against baseline.txt next to the binary, if present.  Options:
+//   --baseline <file>        compare against this file instead
+//   --write-baseline <file>  save results as a new baseline
+//   --ops <n>                operations per row (default 100000)
+
+#include <Arduino.h>
+#include <LazyMeshOta.h>
+#include <LazyMeshOtaImpl.h>
+
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include "../QuietListener.h"
+
+void wifi_raw_set_recv_cb(wifi_raw_recv_cb_fn /* rx_fn */) {
+  assert(0 /* this should not be called */);
+}
+
+static uint64_t allocCount = 0;
+static uint64_t copyBytes = 0;
+
+#if defined(__GLIBC__)
+// Count allocations and copies made anywhere in the process.
+extern "C" {
+void* __libc_malloc(size_t);
+void* __libc_calloc(size_t, size_t);
+void* __libc_realloc(void*, size_t);
+
+void* malloc(size_t size) {
+  ++allocCount;
+  return __libc_malloc(size);
+}
+void* calloc(size_t count, size_t size) {
+  ++allocCount;
+  return __libc_calloc(count, size);
+}
+void* realloc(void* ptr, size_t size) {
+  ++allocCount;
+  return __libc_realloc(ptr, size);
+}
+void* memcpy(void* dest, const void* src, size_t len) {
+  copyBytes += len;
+  return memmove(dest, src, len);
+}
+}
+#endif
+
+struct BenchConfig : LazyMeshOtaConfig {
+  static constexpr uint16_t bufferSize = 1024;
+  static constexpr uint8_t advertCacheSize = 16;
+};
+
+using BenchOta = BasicLazyMeshOta<BenchConfig>;
+
+static const eth_addr localAddr = {0x02, 0x48, 0x50, 0x42, 0, 1};
+static const eth_addr peerAddr = {0x02, 0x48, 0x50, 0x42, 0, 2};
+static const eth_addr otherAddr = {0x02, 0x48, 0x50, 0x42, 0, 3};
+static const eth_addr benchBssid = {3, 1, 3, 3, 3, 7};
+static constexpr uint32_t imageSize = 60 * 1024;
+
+// Sends frames nowhere.
+class NullTransport : public LazyMeshOtaTransport {
+ public:
+  eth_addr macAddress() override { return localAddr; }
+  eth_addr bssid() override { return benchBssid; }
+  bool send(uint8_t* frame, uint16_t len) override {
+    free(frame);
+    ++frames;
+    bytes += len;
+    return true;
+  }
+  uint64_t frames = 0;
+  uint64_t bytes = 0;
+};
+
+// Reaches the private handlers of BasicLazyMeshOta.  The handlers only
+// read the bodies they're given, so those can be reused.
+struct LazyMeshOtaBench {
+  using hdr_t = BenchOta::hdr_t;
+  using PKT_TYPE = BenchOta::PKT_TYPE;
+  using BufStream = BenchOta::BufStream;
+
+  static RxPacket* frame(PKT_TYPE type, const eth_addr& dest, const eth_addr& src,
+                         const std::string& body) {
+    hdr_t hdr;
+    hdr.dest = dest;
+    hdr.src = src;
+    hdr.bssid = benchBssid;
+    hdr.packetType = type;
+    hdr.seq = 1;
+    hdr.len = body.size();
+    RxPacket* pkt = (RxPacket*)malloc(sizeof(RxControl) + sizeof(hdr) + body.size());
+    pkt->rx_ctl.rssi = 1;
+    pkt->rx_ctl.legacy_length = sizeof(hdr) + body.size();
+    memcpy(pkt->data, &hdr, sizeof(hdr));
+    memcpy(pkt->data + sizeof(hdr), body.data(), body.size());
+    return pkt;
+  }
+
+  static void receiveAdvertise(BenchOta& ota, std::string& body) {
+    BufStream stream(&body[0], body.size());
+    ota._receiveAdvertise(peerAddr, stream);
+  }
+  static void receiveReq(BenchOta& ota, std::string& body) {
+    BufStream stream(&body[0], body.size());
+    ota._receiveReq(peerAddr, stream);
+  }
+  static void receiveReply(BenchOta& ota, std::string& body) {
+    BufStream stream(&body[0], body.size());
+    ota._receiveReply(peerAddr, stream);
+  }
+  static void transmit(BenchOta& ota, const String& msg) {
+    ota._transmit(PKT_TYPE::REPLY, peerAddr, benchBssid, msg);
+  }
+  static bool md5Ready(BenchOta& ota) { return ota._localSketchMd5.length(); }
+  static bool updating(BenchOta& ota) { return ota._update; }
+};
+
+// A node running the given sketch, ready to advertise.
+struct Node {
+  Node(const std::string& sketch, int version) : update(sketch, 1) {
+    update.enable();
+    ota.setListener(&listener);
+    ota.setTransport(&transport);
+    ota.begin("HotPathBench", version);
+    while (!LazyMeshOtaBench::md5Ready(ota)) {
+      ota.loop();
+    }
+  }
+
+  FakeUpdateContext update;
+  NullTransport transport;
+  QuietListener listener;
+  BenchOta ota;
+};
+
+struct Result {
+  double nsPerOp = 0;
+  double allocsPerOp = 0;
+  double bytesPerOp = 0;
+};
+
+// Accumulates the cost of operations, excluding any setup between them.
+class Meter {
+ public:
+  void start() {
+    _allocs = allocCount;
+    _bytes = copyBytes;
+    _start = std::chrono::steady_clock::now();
+  }
+  void stop(uint64_t ops) {
+    auto end = std::chrono::steady_clock::now();
+    _ns += std::chrono::duration_cast<std::chrono::nanoseconds>(end - _start).count();
+    _allocTotal += allocCount - _allocs;
+    _byteTotal += copyBytes - _bytes;
+    _ops += ops;
+  }
+  Result result() const {
+    Result r;
+    r.nsPerOp = double(_ns) / _ops;
+    r.allocsPerOp = double(_allocTotal) / _ops;
+    r.bytesPerOp = double(_byteTotal) / _ops;
+    return r;
+  }
+
+ private:
+  std::chrono::steady_clock::time_point _start;
+  uint64_t _allocs = 0, _bytes = 0;
+  uint64_t _ns = 0, _allocTotal = 0, _byteTotal = 0, _ops = 0;
+};
+
+static std::string image() {
+  std::string data;
+  for (uint32_t i = 0; i != imageSize; ++i) {
+    data += char(i * 7 + (i >> 8));
+  }
+  return data;
+}
+
+static std::string md5Hex(const std::string& data) {
+  uint8_t md5[16];
+  MD5((const uint8_t*)data.data(), data.size(), md5);
+  char hex[33];
+  for (int i = 0; i != 16; ++i) {
+    sprintf(hex + i * 2, "%02x", md5[i]);
+  }
+  return hex;
+}
+
+static std::string advertBody(int version, const std::string& md5) {
+  return "HotPathBench\n" + std::to_string(version) + "\n" + std::to_string(imageSize) + "\n" +
+         md5 + "\n" + LazyMeshOtaBase::ethToString(benchBssid).c_str() + "\n";
+}
+
+// Copies of a frame, through the whole receive path.
+static Result dispatchCopies(Node& node, RxPacket* proto, uint32_t ops) {
+  size_t len = sizeof(RxControl) + proto->rx_ctl.legacy_length;
+  std::vector<RxPacket*> pkts;
+  Meter meter;
+  for (uint32_t done = 0; done < ops; done += pkts.size()) {
+    pkts.clear();
+    for (uint32_t i = 0; i != std::min<uint32_t>(1000, ops - done); ++i) {
+      RxPacket* pkt = (RxPacket*)malloc(len);
+      memmove(pkt, proto, len);
+      pkts.push_back(pkt);
+    }
+    meter.start();
+    for (RxPacket* pkt : pkts) {
+      node.ota.onReceiveRawFrame(pkt);
+    }
+    meter.stop(pkts.size());
+  }
+  free(proto);
+  return meter.result();
+}
+
+// Frames not addressed to us.
+static Result benchDispatch(uint32_t ops) {
+  Node node("sketch", 1);
+  return dispatchCopies(node, LazyMeshOtaBench::frame(LazyMeshOtaBench::PKT_TYPE::ADVERTISE,
+                                                      otherAddr, peerAddr, "x\n"),
+                        ops);
+}
+
+// The same advertisement from a neighbor running our version, over and
+// over, as in a dense mesh.
+static Result benchRepeatAdvertise(uint32_t ops) {
+  Node node("sketch", 1);
+  std::string body = advertBody(1, md5Hex("sketch"));
+  return dispatchCopies(node, LazyMeshOtaBench::frame(LazyMeshOtaBench::PKT_TYPE::ADVERTISE,
+                                                      ethBroadcast, peerAddr, body),
+                        ops);
+}
+
+// An advertisement from the source of an update in progress, which is
+// parsed in full.
+static Result benchAdvertise(uint32_t ops) {
+  std::string data = image();
+  std::string md5 = md5Hex(data);
+  Node node("sketch", 1);
+  std::string first = advertBody(2, md5);
+  LazyMeshOtaBench::receiveAdvertise(node.ota, first);
+  assert(LazyMeshOtaBench::updating(node.ota));
+  Meter meter;
+  meter.start();
+  for (uint32_t i = 0; i != ops; ++i) {
+    LazyMeshOtaBench::receiveAdvertise(node.ota, first);
+  }
+  meter.stop(ops);
+  return meter.result();
+}
+
+// Requests for successive blocks, each answered with a reply.
+static Result benchReq(uint32_t ops) {
+  Node node(image(), 1);
+  std::vector<std::string> bodies;
+  std::string id = LazyMeshOtaBase::imageId(md5Hex(image()).c_str()).c_str();
+  for (uint32_t offset = 0; offset < imageSize; offset += BenchConfig::bufferSize) {
+    bodies.push_back(std::string(LazyMeshOtaBase::ethToString(benchBssid).c_str()) + "\n" + id +
+                     "\n" + std::to_string(offset) + "\n");
+  }
+  Meter meter;
+  meter.start();
+  for (uint32_t i = 0; i != ops; ++i) {
+    LazyMeshOtaBench::receiveReq(node.ota, bodies[i % bodies.size()]);
+  }
+  meter.stop(ops);
+  assert(node.transport.frames >= ops);
+  return meter.result();
+}
+
+// Replies for successive blocks of an update.  The update starts over
+// before the last block, so it never completes.
+static Result benchReply(uint32_t ops) {
+  std::string data = image();
+  std::string md5 = md5Hex(data);
+  uint32_t blocks = imageSize / BenchConfig::bufferSize;
+  std::vector<std::string> bodies;
+  for (uint32_t b = 0; b != blocks; ++b) {
+    uint32_t offset = b * BenchConfig::bufferSize;
+    bodies.push_back(std::to_string(offset) + "\n" +
+                     data.substr(offset, BenchConfig::bufferSize));
+  }
+  Meter meter;
+  for (uint32_t done = 0; done < ops;) {
+    std::unique_ptr<Node> node(new Node("sketch", 1));
+    std::string advert = advertBody(2, md5);
+    LazyMeshOtaBench::receiveAdvertise(node->ota, advert);
+    uint32_t count = std::min(blocks - 1, ops - done);
+    meter.start();
+    for (uint32_t b = 0; b != count; ++b) {
+      LazyMeshOtaBench::receiveReply(node->ota, bodies[b]);
+    }
+    meter.stop(count);
+    done += count;
+  }
+  return meter.result();
+}
+
+// Building and sending a full size reply.
+static Result benchTransmit(uint32_t ops) {
+  Node node("sketch", 1);
+  String msg = "0\n";
+  for (uint32_t i = 0; i != BenchConfig::bufferSize; ++i) {
+    msg += char('a' + i % 26);
+  }
+  Meter meter;
+  meter.start();
+  for (uint32_t i = 0; i != ops; ++i) {
+    LazyMeshOtaBench::transmit(node.ota, msg);
+  }
+  meter.stop(ops);
+  return meter.result();
+}
+
+static Result benchEthToString(uint32_t ops) {
+  eth_addr addr = peerAddr;
+  size_t total = 0;
+  Meter meter;
+  meter.start();
+  for (uint32_t i = 0; i != ops; ++i) {
+    addr.addr[5] = i;
+    total += LazyMeshOtaBase::ethToString(addr).length();
+  }
+  meter.stop(ops);
+  assert(total == ops * 17);
+  return meter.result();
+}
+
+static Result benchEthFromString(uint32_t ops) {
+  String str = LazyMeshOtaBase::ethToString(peerAddr);
+  eth_addr addr;
+  uint32_t parsed = 0;
+  Meter meter;
+  meter.start();
+  for (uint32_t i = 0; i != ops; ++i) {
+    parsed += LazyMeshOtaBase::ethFromString(&addr, str);
+  }
+  meter.stop(ops);
+  assert(parsed == ops);
+  return meter.result();
+}
+
+// Lines of "<name> <ns/op> <allocs/op> <bytes/op>".
+static std::map<std::string, Result> readBaseline(const std::string& path) {
+  std::map<std::string, Result> baseline;
+  std::ifstream in(path);
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::istringstream fields(line);
+    std::string name;
+    Result r;
+    if (fields >> name >> r.nsPerOp >> r.allocsPerOp >> r.bytesPerOp) {
+      baseline[name] = r;
+    }
+  }
+  return baseline;
+}
+
+void setup() {
+  uint32_t ops = 100000;
+  std::string self = epoxy_argv[0];
+  std::string baselinePath = self.substr(0, self.rfind('/') + 1) + "baseline.txt";
+  std::string writePath;
+  for (int i = 1; i < epoxy_argc; ++i) {
+    String arg = epoxy_argv[i];
+    if (arg == "--baseline" && i + 1 < epoxy_argc) {
+      baselinePath = epoxy_argv[++i];
+    } else if (arg == "--write-baseline" && i + 1 < epoxy_argc) {
+      writePath = epoxy_argv[++i];
+    } else if (arg == "--ops" && i + 1 < epoxy_argc) {
+      ops = std::max(1, atoi(epoxy_argv[++i]));
+    }
+  }
+
+  std::map<std::string, Result> baseline = readBaseline(baselinePath);
+  std::vector<std::pair<std::string, Result (*)(uint32_t)>> benches = {
+      {"onReceiveRawFrame", benchDispatch}, {"repeatAdvertise", benchRepeatAdvertise},
+      {"_receiveAdvertise", benchAdvertise},
+      {"_receiveReq", benchReq},            {"_receiveReply", benchReply},
+      {"_transmit", benchTransmit},         {"ethToString", benchEthToString},
+      {"ethFromString", benchEthFromString},
+  };
+  std::ofstream out;
+  if (!writePath.empty()) {
+    out.open(writePath);
+    out << "# Written by HotPathBench --write-baseline.\n";
+    out << "# name ns/op allocs/op bytes-copied/op\n";
+  }
+
+  Serial.printf("%-20s %10s %10s %10s %s\n", "", "ns/op", "allocs/op", "bytes/op",
+                baseline.empty() ? "" : "  vs baseline");
+  for (auto& bench : benches) {
+    Result r = bench.second(ops);
+    Serial.printf("%-20s %10.1f %10.2f %10.1f", bench.first.c_str(), r.nsPerOp, r.allocsPerOp,
+                  r.bytesPerOp);
+    auto base = baseline.find(bench.first);
+    if (base != baseline.end()) {
+      Serial.printf("  %+6.1f%% time, %+.2f allocs, %+.1f bytes",
+                    (r.nsPerOp / base->second.nsPerOp - 1) * 100,
+                    r.allocsPerOp - base->second.allocsPerOp,
+                    r.bytesPerOp - base->second.bytesPerOp);
+    }
+    Serial.printf("\n");
+    if (out.is_open()) {
+      char line[128];
+      snprintf(line, sizeof(line), "%s %.1f %.2f %.1f\n", bench.first.c_str(), r.nsPerOp,
+               r.allocsPerOp, r.bytesPerOp);
+      out << line;
+    }
+  }
+  out.close();
+  exit(0);
+}
+
+void loop() {}
@@ -6,29 +6,36 @@
 
 #include <Arduino.h>
 #include <LazyMeshOta.h>
+#include <LazyMeshOtaFileImage.h>
+#include <LazyMeshOtaImpl.h>
+#include <LazyMeshOtaMemoryHooks.h>
+#include <LazyMeshOtaReplay.h>
+#include <unistd.h>
 
 #include <iostream>
+#include <thread>
+#include <vector>
 
 using namespace aunit;
 
 eth_addr testBssid = {3, 1, 3, 3, 3, 7};
 
-void wifi_raw_set_recv_cb(wifi_raw_recv_cb_fn /* rx_fn */) {
-  assert(0 /* this should not be called */);
-}
+// Set by register_wifi_cb; only wifiRoutingTest calls it.
+wifi_raw_recv_cb_fn rawRecvCb = nullptr;
+void wifi_raw_set_recv_cb(wifi_raw_recv_cb_fn rx_fn) { rawRecvCb = rx_fn; }
 
-void runSome(LazyMeshOta& ota, FakeWifiContext& wifiCtx, FakeUpdateContext& updateCtx) {
+template <typename Ota>
+void runSome(Ota& ota, FakeWifiContext& wifiCtx, FakeUpdateContext& updateCtx) {
   wifiCtx.enable();
   updateCtx.enable();
-  if (FakeWifiContext::rawWifiPacket) {
-    RxPacket* pkt = FakeWifiContext::rawWifiPacket;
-    FakeWifiContext::rawWifiPacket = nullptr;
+  while (RxPacket* pkt = wifiCtx.nextPacket()) {
     ota.onReceiveRawFrame(pkt);
   }
   ota.loop();
 }
 
 test(simpleTest) {
+  FakeWifiContext wifi1({1, 2, 3, 4, 5, 6}, testBssid);
   FakeUpdateContext update1("sketch1", 12345);
   LazyMeshOta lmo;
   lmo.begin("LazyMeshOtaTest", 1);
@@ -123,11 +130,13 @@ test(retryTest) {
     }
 
     runSome(lmo1, wifi1, update1);
-    if (FakeWifiContext::rawWifiPacket) {
-      if ((pktCount % 2) == 1) {
-        FakeWifiContext::discardRawWifiPacket();
+    for (auto it = wifi2.inbox.begin(); it != wifi2.inbox.end();) {
+      if ((pktCount++ % 2) == 1) {
+        free(*it);
+        it = wifi2.inbox.erase(it);
+      } else {
+        ++it;
       }
-      ++pktCount;
     }
 
     runSome(lmo2, wifi2, update2);
@@ -142,6 +151,1409 @@ test(retryTest) {
   assertTrue(update2.didRestart);
 }
 
+struct ProductionBlockConfig : LazyMeshOtaConfig {
+  static constexpr uint16_t bufferSize = 1024;
+};
+
+test(productionBlockTest) {
+  std::string sketch1, sketch2;
+  for (int i = 0; i != 5000; ++i) {
+    sketch1.push_back(char(i * 7));
+    sketch2.push_back(char(i * 13));
+  }
+
+  FakeWifiContext wifi1({1, 2, 3, 4, 5, 6}, testBssid);
+  FakeUpdateContext update1(sketch1, 12345);
+  BasicLazyMeshOta<ProductionBlockConfig> lmo1;
+  lmo1.begin("productionBlockTest", 2);
+
+  FakeWifiContext wifi2({7, 8, 9, 10, 11, 12}, testBssid);
+  FakeUpdateContext update2(sketch2, 789101);
+  BasicLazyMeshOta<ProductionBlockConfig> lmo2;
+  lmo2.begin("productionBlockTest", 1);
+
+  uint32_t start = millis();
+  for (;;) {
+    uint32_t cur = millis();
+    uint32_t elapsed = cur - start;
+
+    if (elapsed > 5000 || update2.didUpdate) {
+      break;
+    }
+
+    runSome(lmo1, wifi1, update1);
+    runSome(lmo2, wifi2, update2);
+
+    delay(10);
+  }
+  assertFalse(update1.didBegin);
+  assertTrue(update2.didBegin);
+  assertTrue(update2.didUpdate);
+  assertTrue(update2.didRestart);
+}
+
+// Offset of the packet type within a frame, and the type of a REPLY.
+static constexpr size_t pktTypeOffset = 30;
+static constexpr uint8_t replyPktType = 2;
+static constexpr uint8_t hashReplyPktType = 4;
+
+class CountingListener : public LazyMeshOta::Listener {
+ public:
+  void onError(String err) override {
+    LazyMeshOta::Listener::onError(err);
+    ++errors;
+    aborts += err == "Exceeded max retries";
+  }
+  void onReceiveTimeout() override { ++timeouts; }
+  void onRequestChunk(size_t, size_t) override { ++requests; }
+  int errors = 0;
+  int aborts = 0;
+  int timeouts = 0;
+  int requests = 0;
+};
+
+struct ManifestConfig : LazyMeshOtaConfig {
+  static constexpr bool useManifest = true;
+  static constexpr uint16_t manifestFanout = 4;
+};
+
+template <typename Config = ManifestConfig, typename Corrupter>
+void runManifestTransfer(const std::string& sketch1, const std::string& sketch2,
+                         CountingListener* listener2, FakeUpdateContext* update2,
+                         Corrupter corrupt) {
+  FakeWifiContext wifi1({1, 2, 3, 4, 5, 6}, testBssid);
+  FakeUpdateContext update1(sketch1, 12345);
+  BasicLazyMeshOta<Config> lmo1;
+  lmo1.begin("manifestTest", 2);
+
+  FakeWifiContext wifi2({7, 8, 9, 10, 11, 12}, testBssid);
+  update2->enable();
+  BasicLazyMeshOta<Config> lmo2;
+  lmo2.setListener(listener2);
+  lmo2.begin("manifestTest", 1);
+
+  uint32_t start = millis();
+  for (;;) {
+    uint32_t cur = millis();
+    uint32_t elapsed = cur - start;
+
+    if (elapsed > 5000 || update2->didUpdate) {
+      break;
+    }
+
+    runSome(lmo1, wifi1, update1);
+    for (auto it = wifi2.inbox.begin(); it != wifi2.inbox.end();) {
+      if (corrupt(*it)) {
+        free(*it);
+        it = wifi2.inbox.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    runSome(lmo2, wifi2, *update2);
+
+    delay(10);
+  }
+}
+
+test(manifestTransferTest) {
+  std::string sketch1, sketch2;
+  for (int i = 0; i != 100; ++i) {
+    sketch1.push_back(char(i * 7));
+    sketch2.push_back(char(i * 13));
+  }
+  CountingListener listener2;
+  FakeUpdateContext update2(sketch2, 789101);
+  runManifestTransfer(sketch1, sketch2, &listener2, &update2, [](RxPacket*) { return false; });
+  assertTrue(update2.didBegin);
+  assertTrue(update2.didUpdate);
+  assertTrue(update2.didRestart);
+  assertEqual(listener2.errors, 0);
+}
+
+test(manifestCorruptionTest) {
+  std::string sketch1, sketch2;
+  for (int i = 0; i != 100; ++i) {
+    sketch1.push_back(char(i * 7));
+    sketch2.push_back(char(i * 13));
+  }
+  CountingListener listener2;
+  FakeUpdateContext update2(sketch2, 789101);
+  size_t replyCount = 0;
+  runManifestTransfer(sketch1, sketch2, &listener2, &update2, [&replyCount](RxPacket* pkt) {
+    if (pkt->data[pktTypeOffset] == replyPktType && (replyCount++ % 6) == 1) {
+      // Flip a bit in the last byte of block data.
+      pkt->data[pkt->rx_ctl.legacy_length - 1] ^= 1;
+    }
+    return false;
+  });
+  // Bad blocks are dropped on arrival and fetched again after a
+  // timeout, so the final md5 still matches.
+  assertTrue(update2.didBegin);
+  assertTrue(update2.didUpdate);
+  assertMore(listener2.errors, 0);
+}
+
+test(manifestCorruptSourceTest) {
+  std::string sketch1, sketch2;
+  for (int i = 0; i != 100; ++i) {
+    sketch1.push_back(char(i * 7));
+    sketch2.push_back(char(i * 13));
+  }
+  CountingListener listener2;
+  FakeUpdateContext update2(sketch2, 789101);
+  runManifestTransfer(sketch1, sketch2, &listener2, &update2, [](RxPacket* pkt) {
+    if (pkt->data[pktTypeOffset] == replyPktType) {
+      pkt->data[pkt->rx_ctl.legacy_length - 1] ^= 1;
+    }
+    return false;
+  });
+  // Every block is bad, so the update is given up on instead of asking
+  // for the same block as fast as it's refused.
+  assertFalse(update2.didUpdate);
+  assertMore(listener2.aborts, 0);
+  assertLess(listener2.requests, 5000 / int(ManifestConfig::receiveTimeoutInterval) * 2 + 4);
+}
+
+struct FecConfig : LazyMeshOtaConfig {
+  static constexpr uint8_t fecDataBlocks = 4;
+  static constexpr uint8_t fecParityBlocks = 1;
+};
+
+test(fecRecoveryTest) {
+  std::string sketch1, sketch2;
+  for (int i = 0; i != 100; ++i) {
+    sketch1.push_back(char(i * 7));
+    sketch2.push_back(char(i * 13));
+  }
+  CountingListener listener2;
+  FakeUpdateContext update2(sketch2, 789101);
+  size_t replyCount = 0;
+  runManifestTransfer<FecConfig>(sketch1, sketch2, &listener2, &update2,
+                                 [&replyCount](RxPacket* pkt) {
+                                   // Lose one block out of every group.
+                                   return pkt->data[pktTypeOffset] == replyPktType &&
+                                          (replyCount++ % 4) == 1;
+                                 });
+  assertTrue(update2.didUpdate);
+  assertEqual(listener2.errors, 0);
+  // Every lost block was rebuilt from parity, so nothing had to be sent twice.
+  assertEqual(listener2.timeouts, 0);
+  assertEqual(replyCount, size_t(25));
+}
+
+struct FecManifestConfig : ManifestConfig {
+  static constexpr uint8_t fecDataBlocks = 3;
+  static constexpr uint8_t fecParityBlocks = 2;
+};
+
+test(fecManifestTest) {
+  std::string sketch1, sketch2;
+  for (int i = 0; i != 100; ++i) {
+    sketch1.push_back(char(i * 7));
+    sketch2.push_back(char(i * 13));
+  }
+  CountingListener listener2;
+  FakeUpdateContext update2(sketch2, 789101);
+  size_t pktCount = 0;
+  runManifestTransfer<FecManifestConfig>(
+      sketch1, sketch2, &listener2, &update2,
+      [&pktCount](RxPacket* pkt) { return (pktCount++ % 6) == 1; });
+  assertTrue(update2.didUpdate);
+  assertEqual(listener2.errors, 0);
+}
+
+struct RelayConfig : ManifestConfig {
+  static constexpr bool relayPartial = true;
+};
+
+// Drops frames in the context's inbox sent by the given address.
+static void dropFrom(FakeWifiContext& wifi, const eth_addr& src) {
+  for (auto it = wifi.inbox.begin(); it != wifi.inbox.end();) {
+    if (memcmp((*it)->data + 10 /* 802.11 source address */, &src, sizeof(src)) == 0) {
+      free(*it);
+      it = wifi.inbox.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+test(relayTest) {
+  std::string sketch1, sketch2, sketch3;
+  for (int i = 0; i != 200; ++i) {
+    sketch1.push_back(char(i * 7));
+    sketch2.push_back(char(i * 13));
+    sketch3.push_back(char(i * 17));
+  }
+  // A line of three nodes; 1 and 3 can't hear each other.
+  eth_addr addr1 = {1, 2, 3, 4, 5, 6};
+  eth_addr addr3 = {13, 14, 15, 16, 17, 18};
+  FakeWifiContext wifi1(addr1, testBssid);
+  FakeUpdateContext update1(sketch1, 12345);
+  BasicLazyMeshOta<RelayConfig> lmo1;
+  lmo1.begin("relayTest", 2);
+
+  FakeWifiContext wifi2({7, 8, 9, 10, 11, 12}, testBssid);
+  FakeUpdateContext update2(sketch2, 789101);
+  BasicLazyMeshOta<RelayConfig> lmo2;
+  lmo2.begin("relayTest", 1);
+
+  FakeWifiContext wifi3(addr3, testBssid);
+  FakeUpdateContext update3(sketch3, 112131);
+  CountingListener listener3;
+  BasicLazyMeshOta<RelayConfig> lmo3;
+  lmo3.setListener(&listener3);
+  lmo3.begin("relayTest", 1);
+
+  bool pipelined = false;
+  size_t relayedHashes = 0;
+  uint32_t start = millis();
+  while (!update3.didUpdate && millis() - start < 10000) {
+    runSome(lmo1, wifi1, update1);
+    dropFrom(wifi1, addr3);
+    runSome(lmo2, wifi2, update2);
+    dropFrom(wifi3, addr1);
+    if (!update2.didUpdate) {
+      for (RxPacket* pkt : wifi3.inbox) {
+        relayedHashes += pkt->data[pktTypeOffset] == hashReplyPktType;
+      }
+    }
+    runSome(lmo3, wifi3, update3);
+    if (update3.didBegin && !update2.didUpdate) {
+      pipelined = true;
+    }
+    delay(10);
+  }
+  assertTrue(update2.didUpdate);
+  assertTrue(update3.didUpdate);
+  assertEqual(listener3.errors, 0);
+  // Node 3 started before node 2 had the whole image.
+  assertTrue(pipelined);
+  // And checked what node 2 passed on against the same hash tree.
+  assertMore(relayedHashes, size_t(0));
+}
+
+test(imageIdTest) {
+  std::string sketch1, sketch1b, sketch2;
+  for (int i = 0; i != 200; ++i) {
+    sketch1.push_back(char(i * 7));
+    sketch1b.push_back(char(i * 11));
+    sketch2.push_back(char(i * 13));
+  }
+  FakeWifiContext wifi1({1, 2, 3, 4, 5, 6}, testBssid);
+  std::unique_ptr<FakeUpdateContext> update1(new FakeUpdateContext(sketch1, 12345));
+  std::unique_ptr<LazyMeshOta> lmo1(new LazyMeshOta);
+  lmo1->begin("imageIdTest", 2);
+
+  FakeWifiContext wifi2({7, 8, 9, 10, 11, 12}, testBssid);
+  FakeUpdateContext update2(sketch2, 789101);
+  CountingListener listener2;
+  LazyMeshOta lmo2;
+  lmo2.setListener(&listener2);
+  lmo2.begin("imageIdTest", 1);
+
+  bool reflashed = false;
+  uint32_t start = millis();
+  while (!update2.didUpdate && millis() - start < 20000) {
+    if (!reflashed && listener2.requests >= 10) {
+      // Node 1 is reflashed with another build of the same version
+      // halfway through node 2's transfer.
+      reflashed = true;
+      lmo1.reset();
+      wifi1.enable();
+      update1.reset(new FakeUpdateContext(sketch1b, 12345));
+      lmo1.reset(new LazyMeshOta);
+      lmo1->begin("imageIdTest", 2);
+    }
+    runSome(*lmo1, wifi1, *update1);
+    runSome(lmo2, wifi2, update2);
+    delay(10);
+  }
+  assertTrue(reflashed);
+  // Node 2 gave up on the first build instead of mixing in the second.
+  assertTrue(update2.didUpdate);
+  assertEqual(listener2.aborts, 1);
+  assertEqual(listener2.errors, listener2.aborts);
+}
+
+struct StreamConfig : LazyMeshOtaConfig {
+  static constexpr uint8_t streamWindow = 8;
+};
+
+test(streamTransferTest) {
+  std::string sketch1, sketch2;
+  for (int i = 0; i != 100; ++i) {
+    sketch1.push_back(char(i * 7));
+    sketch2.push_back(char(i * 13));
+  }
+  CountingListener listener2;
+  FakeUpdateContext update2(sketch2, 789101);
+  size_t replyCount = 0;
+  runManifestTransfer<StreamConfig>(sketch1, sketch2, &listener2, &update2,
+                                    [&replyCount](RxPacket* pkt) {
+                                      replyCount += pkt->data[pktTypeOffset] == replyPktType;
+                                      return false;
+                                    });
+  assertTrue(update2.didUpdate);
+  assertEqual(listener2.errors, 0);
+  // A single request for all 25 blocks.
+  assertEqual(listener2.requests, 1);
+  assertEqual(replyCount, size_t(25));
+}
+
+test(streamLossTest) {
+  std::string sketch1, sketch2;
+  for (int i = 0; i != 100; ++i) {
+    sketch1.push_back(char(i * 7));
+    sketch2.push_back(char(i * 13));
+  }
+  CountingListener listener2;
+  FakeUpdateContext update2(sketch2, 789101);
+  size_t replyCount = 0;
+  runManifestTransfer<StreamConfig>(sketch1, sketch2, &listener2, &update2,
+                                    [&replyCount](RxPacket* pkt) {
+                                      return pkt->data[pktTypeOffset] == replyPktType &&
+                                             (replyCount++ % 5) == 2;
+                                    });
+  assertTrue(update2.didUpdate);
+  assertEqual(listener2.errors, 0);
+  // Losses are repaired by NACKs rather than a request per block.
+  assertLess(listener2.requests, 10);
+}
+
+test(streamIdleTest) {
+  std::string sketch1;
+  for (int i = 0; i != 100; ++i) {
+    sketch1.push_back(char(i * 7));
+  }
+  FakeWifiContext wifi1({1, 2, 3, 4, 5, 6}, testBssid);
+  FakeUpdateContext update1(sketch1, 12345);
+  BasicLazyMeshOta<StreamConfig> lmo1;
+  lmo1.begin("streamIdleTest", 2);
+
+  FakeWifiContext wifi2({7, 8, 9, 10, 11, 12}, testBssid);
+  FakeUpdateContext update2("sketch2", 789101);
+  BasicLazyMeshOta<StreamConfig> lmo2;
+  lmo2.begin("streamIdleTest", 1);
+
+  uint32_t start = millis();
+  while (!update2.didUpdate && millis() - start < 5000) {
+    runSome(lmo1, wifi1, update1);
+    runSome(lmo2, wifi2, update2);
+    delay(1);
+  }
+  assertTrue(update2.didUpdate);
+
+  // Once the stream is done, the source only has advertisements to do.
+  for (int i = 0; i != 10; ++i) {
+    runSome(lmo1, wifi1, update1);
+    delay(1);
+  }
+  assertMore(lmo1.millisUntilWork(), uint32_t(0));
+}
+
+test(streamClientsTest) {
+  std::string sketch1;
+  for (int i = 0; i != 2000; ++i) {
+    sketch1.push_back(char(i * 7));
+  }
+  FakeWifiContext wifi1({1, 2, 3, 4, 5, 6}, testBssid);
+  FakeUpdateContext update1(sketch1, 12345);
+  BasicLazyMeshOta<StreamConfig> lmo1;
+  lmo1.begin("streamClientsTest", 2);
+
+  FakeWifiContext wifi2({7, 8, 9, 10, 11, 12}, testBssid);
+  FakeUpdateContext update2("sketch2", 789101);
+  BasicLazyMeshOta<StreamConfig> lmo2;
+  CountingListener listener2;
+  lmo2.setListener(&listener2);
+  lmo2.begin("streamClientsTest", 1);
+  FakeWifiContext wifi3({13, 14, 15, 16, 17, 18}, testBssid);
+  FakeUpdateContext update3("sketch2", 112131);
+  BasicLazyMeshOta<StreamConfig> lmo3;
+  CountingListener listener3;
+  lmo3.setListener(&listener3);
+  lmo3.begin("streamClientsTest", 1);
+
+  uint32_t start = millis();
+  while (!(update2.didUpdate && update3.didUpdate) && millis() - start < 10000) {
+    runSome(lmo1, wifi1, update1);
+    if (!update2.didUpdate) {
+      runSome(lmo2, wifi2, update2);
+    }
+    if (!update3.didUpdate) {
+      runSome(lmo3, wifi3, update3);
+    }
+    delay(1);
+  }
+  assertTrue(update2.didUpdate);
+  assertTrue(update3.didUpdate);
+  // Whoever got the stream first kept it until done, rather than the
+  // two taking it from each other with every keepalive.
+  assertEqual(std::min(listener2.timeouts, listener3.timeouts), 0);
+}
+
+struct AggregateConfig : StreamConfig {
+  static constexpr uint32_t aggregateWindow = 1000;
+};
+
+test(aggregateTest) {
+  std::string sketch1, sketch2;
+  for (int i = 0; i != 100; ++i) {
+    sketch1.push_back(char(i * 7));
+    sketch2.push_back(char(i * 13));
+  }
+  CountingListener listener2;
+  FakeUpdateContext update2(sketch2, 789101);
+  size_t replyCount = 0;
+  size_t aggregateCount = 0;
+  runManifestTransfer<AggregateConfig>(sketch1, sketch2, &listener2, &update2,
+                                       [&replyCount, &aggregateCount](RxPacket* pkt) {
+                                         replyCount += pkt->data[pktTypeOffset] == replyPktType;
+                                         aggregateCount += pkt->data[pktTypeOffset] == 9;
+                                         return false;
+                                       });
+  assertTrue(update2.didUpdate);
+  assertEqual(listener2.errors, 0);
+  // The 25 blocks went out in fewer frames.
+  assertMore(aggregateCount, size_t(0));
+  assertLess(replyCount + aggregateCount, size_t(25));
+}
+
+class NeighborListener : public LazyMeshOta::Listener {
+ public:
+  void onNeighborSeen(eth_addr, String, int, String md5) override {
+    lastMd5 = md5;
+    ++seen;
+  }
+  String lastMd5;
+  int seen = 0;
+};
+
+struct Md5CacheConfig : LazyMeshOtaConfig {
+  static constexpr int md5CacheRtcOffset = 0;
+};
+
+test(deferredMd5Test) {
+  std::string sketch1;
+  for (int i = 0; i != 200 * 1024; ++i) {
+    sketch1.push_back(char(i * 7));
+  }
+  FakeWifiContext wifi1({1, 2, 3, 4, 5, 6}, testBssid);
+  FakeUpdateContext update1(sketch1, 12345);
+  // 100ms to hash the whole sketch.
+  update1.flashReadMicrosPerKb = 500;
+
+  FakeWifiContext wifi2({7, 8, 9, 10, 11, 12}, testBssid);
+  FakeUpdateContext update2("sketch2", 12345);
+  NeighborListener listener2;
+  LazyMeshOta lmo2;
+  lmo2.setListener(&listener2);
+  lmo2.begin("md5Test", 0);
+
+  for (int boot = 0; boot != 2; ++boot) {
+    wifi1.enable();
+    update1.enable();
+    update1.flashBytesRead = 0;
+    listener2.lastMd5 = String();
+    BasicLazyMeshOta<Md5CacheConfig> lmo1;
+    uint32_t start = micros();
+    lmo1.begin("md5Test", 1);
+    assertLess(micros() - start, uint32_t(20000));
+    assertTrue(update1.flashBytesRead == 0);
+
+    start = millis();
+    while (!listener2.lastMd5.length() && millis() - start < 3000) {
+      runSome(lmo1, wifi1, update1);
+      runSome(lmo2, wifi2, update2);
+      delay(10);
+    }
+    assertEqual(listener2.lastMd5, update1.getLocalSketchMD5());
+    if (boot) {
+      // Warm reboot; the md5 should have come from RTC memory.
+      assertTrue(update1.flashBytesRead == 0);
+    } else {
+      assertTrue(update1.flashBytesRead == sketch1.size());
+    }
+    lmo1.end();
+  }
+}
+
+test(deferredManifestTest) {
+  std::string sketch1;
+  for (int i = 0; i != 16 * 1024; ++i) {
+    sketch1.push_back(char(i * 7));
+  }
+  FakeWifiContext wifi1({1, 2, 3, 4, 5, 6}, testBssid);
+  FakeUpdateContext update1(sketch1, 12345);
+  BasicLazyMeshOta<ManifestConfig> lmo1;
+  lmo1.begin("manifestTest", 1);
+  assertTrue(update1.flashBytesRead == 0);
+
+  // The hash tree is built in the same slices as the md5, reading the
+  // sketch once.
+  for (int i = 0; i != 100 && lmo1.millisUntilWork() == 0; ++i) {
+    uint32_t before = update1.flashBytesRead;
+    runSome(lmo1, wifi1, update1);
+    assertLessOrEqual(update1.flashBytesRead - before, ManifestConfig::md5SliceSize);
+  }
+  assertMore(lmo1.millisUntilWork(), uint32_t(0));
+  assertTrue(update1.flashBytesRead == sketch1.size());
+}
+
+class StringPrint : public Print {
+ public:
+  size_t write(uint8_t c) override {
+    data.push_back(char(c));
+    return 1;
+  }
+  std::string data;
+};
+
+test(traceTest) {
+  FakeWifiContext wifi1({1, 2, 3, 4, 5, 6}, testBssid);
+  FakeUpdateContext update1("sketch1", 12345);
+  LazyMeshOta lmo1;
+  lmo1.setTraceEnabled(true);
+  lmo1.begin("traceTest", 1);
+
+  FakeWifiContext wifi2({7, 8, 9, 10, 11, 12}, testBssid);
+  FakeUpdateContext update2("sketch2", 12345);
+  LazyMeshOta lmo2;
+  lmo2.begin("traceTest", 1);
+
+  uint32_t start = millis();
+  while (millis() - start < 2500) {
+    runSome(lmo1, wifi1, update1);
+    runSome(lmo2, wifi2, update2);
+    delay(10);
+  }
+
+  StringPrint pcap;
+  size_t frames = lmo1.writeTracePcap(pcap);
+  // At least one advertisement sent and one received.
+  assertMore(frames, size_t(1));
+  TraceEvent ev;
+  assertFalse(lmo1.nextTraceEvent(&ev));
+
+  const std::string& d = pcap.data;
+  assertMore(d.size(), size_t(24 + 16 + 24));
+  uint32_t magic, linkType;
+  memcpy(&magic, d.data(), 4);
+  memcpy(&linkType, d.data() + 20, 4);
+  assertEqual(magic, uint32_t(0xa1b2c3d4));
+  assertEqual(linkType, uint32_t(105));
+  // The first frame's LLC header starts after the 802.11 header.
+  assertEqual(uint8_t(d[24 + 16 + 24]), uint8_t(0x31));
+}
+
+test(captureReplayTest) {
+  FakeWifiContext wifi1({1, 2, 3, 4, 5, 6}, testBssid);
+  FakeUpdateContext update1("sketch1datadatadata", 12345);
+  LazyMeshOta lmo1;
+  lmo1.begin("captureReplayTest", 2);
+
+  FakeWifiContext wifi2({7, 8, 9, 10, 11, 12}, testBssid);
+  FakeUpdateContext update2("sketch2datadatadata", 789101);
+  LazyMeshOta lmo2;
+  StringPrint capture;
+  lmo2.setCapture(&capture);
+  lmo2.begin("captureReplayTest", 1);
+
+  // Lose some replies, so there are timeouts to reproduce.
+  uint32_t start = millis();
+  size_t replies = 0;
+  while (!update2.didUpdate && millis() - start < 10000) {
+    runSome(lmo1, wifi1, update1);
+    for (RxPacket* pkt : wifi2.inbox) {
+      if (pkt->data[pktTypeOffset] == replyPktType && ++replies % 3 == 0) {
+        pkt->data[pktTypeOffset] = 0xff;
+      }
+    }
+    runSome(lmo2, wifi2, update2);
+    delay(10);
+  }
+  assertTrue(update2.didUpdate);
+
+  FakeUpdateContext update3("sketch2datadatadata", 789101);
+  LazyMeshOtaReplay replay;
+  assertTrue(replay.load(capture.data));
+  {
+    LazyMeshOta lmo3;
+    bool same = replay.run(lmo3);
+    assertEqual(replay.error(), String());
+    assertTrue(same);
+    assertTrue(update3.didUpdate);
+  }
+
+  // Lose the first reply which did arrive.
+  std::string altered = capture.data;
+  size_t pos = sizeof(captureMagic) + 1;
+  CaptureRecord rec;
+  for (;;) {
+    memcpy(&rec, altered.data() + pos, sizeof(rec));
+    if (rec.type == CaptureRecord::Type::RX &&
+        uint8_t(altered[pos + sizeof(rec) + 1 /* rssi */ + pktTypeOffset]) == replyPktType) {
+      break;
+    }
+    pos += sizeof(rec) + rec.len;
+  }
+  altered[pos + sizeof(rec) + 1 + pktTypeOffset] = 0xff;
+  FakeUpdateContext update4("sketch2datadatadata", 789101);
+  assertTrue(replay.load(altered));
+  LazyMeshOta lmo4;
+  assertFalse(replay.run(lmo4));
+  assertNotEqual(replay.error(), String());
+}
+
+struct AirtimeConfig : LazyMeshOtaConfig {
+  static constexpr uint32_t airtimeBytesPerSecond = 500;
+  static constexpr uint32_t airtimeBurstBytes = 200;
+  static constexpr uint32_t airtimeControlReserve = 80;
+  static constexpr uint8_t airtimeQueueFrames = 4;
+};
+
+test(airtimeTest) {
+  FakeWifiContext wifi1({1, 2, 3, 4, 5, 6}, testBssid);
+  FakeUpdateContext update1("sketch1datadatadatadatadatadatadata", 12345);
+  BasicLazyMeshOta<AirtimeConfig> lmo1;
+  lmo1.begin("airtimeTest", 2);
+
+  FakeWifiContext wifi2({7, 8, 9, 10, 11, 12}, testBssid);
+  FakeUpdateContext update2("sketch2", 789101);
+  BasicLazyMeshOta<AirtimeConfig> lmo2;
+  lmo2.begin("airtimeTest", 1);
+
+  uint32_t start = millis();
+  uint32_t longestWait = 0;
+  while (!update2.didUpdate && millis() - start < 10000) {
+    runSome(lmo1, wifi1, update1);
+    runSome(lmo2, wifi2, update2);
+    if (lmo1.airtimeStats().queuedFrames) {
+      longestWait = std::max(longestWait, lmo1.millisUntilWork());
+    }
+    delay(1);
+  }
+  uint32_t elapsed = millis() - start;
+  assertTrue(update2.didUpdate);
+
+  // Waiting for budget leaves the node idle until it has refilled.
+  assertMore(longestWait, uint32_t(0));
+  uint32_t refill = AirtimeConfig::airtimeBurstBytes * 1000 / AirtimeConfig::airtimeBytesPerSecond;
+  assertLessOrEqual(longestWait, refill + 1);
+
+  // Image data had to wait, but was never over budget.
+  AirtimeStats stats = lmo1.airtimeStats();
+  assertMore(stats.bulkBytes, uint64_t(0));
+  assertMore(stats.deferredFrames, uint32_t(0));
+  assertLessOrEqual(stats.controlBytes + stats.bulkBytes,
+                    uint64_t(AirtimeConfig::airtimeBurstBytes +
+                             AirtimeConfig::airtimeBytesPerSecond * (elapsed + 10) / 1000));
+}
+
+struct FecAirtimeConfig : AirtimeConfig {
+  static constexpr uint8_t fecDataBlocks = 3;
+  static constexpr uint8_t fecParityBlocks = 1;
+};
+
+test(fecAirtimeTest) {
+  FakeWifiContext wifi1({1, 2, 3, 4, 5, 6}, testBssid);
+  FakeUpdateContext update1("sketch1datadatadatadatadatadatadata", 12345);
+  BasicLazyMeshOta<FecAirtimeConfig> lmo1;
+  lmo1.begin("fecAirtimeTest", 2);
+
+  FakeWifiContext wifi2({7, 8, 9, 10, 11, 12}, testBssid);
+  FakeUpdateContext update2("sketch2", 789101);
+  BasicLazyMeshOta<FecAirtimeConfig> lmo2;
+  lmo2.begin("fecAirtimeTest", 1);
+
+  uint32_t start = millis();
+  while (!update2.didUpdate && millis() - start < 10000) {
+    runSome(lmo1, wifi1, update1);
+    runSome(lmo2, wifi2, update2);
+    delay(1);
+  }
+  assertTrue(update2.didUpdate);
+
+  // Group requests repeated while a group was still queued went
+  // unanswered rather than overflowing the queue.
+  AirtimeStats stats = lmo1.airtimeStats();
+  assertMore(stats.deferredFrames, uint32_t(0));
+  assertEqual(stats.droppedFrames, uint32_t(0));
+}
+
+struct LatencyConfig : LazyMeshOtaConfig {
+  static constexpr bool latencyHistograms = true;
+};
+
+test(latencyTest) {
+  FakeWifiContext wifi1({1, 2, 3, 4, 5, 6}, testBssid);
+  FakeUpdateContext update1("sketch1datadatadatadatadatadatadata", 12345);
+  BasicLazyMeshOta<LatencyConfig> lmo1;
+  lmo1.begin("latencyTest", 2);
+
+  FakeWifiContext wifi2({7, 8, 9, 10, 11, 12}, testBssid);
+  FakeUpdateContext update2("sketch2", 789101);
+  BasicLazyMeshOta<LatencyConfig> lmo2;
+  lmo2.begin("latencyTest", 1);
+
+  uint32_t start = millis();
+  while (!update2.didUpdate && millis() - start < 10000) {
+    runSome(lmo1, wifi1, update1);
+    runSome(lmo2, wifi2, update2);
+    delay(1);
+  }
+  assertTrue(update2.didUpdate);
+
+  assertMore(lmo1.latency(LatencySpan::FLASH_READ).count, uint32_t(0));
+  assertMore(lmo1.latency(LatencySpan::RADIO_SEND).count, uint32_t(0));
+  const LatencyHistogram& writes = lmo2.latency(LatencySpan::UPDATE_WRITE);
+  assertMore(writes.count, uint32_t(0));
+  const LatencyHistogram& roundTrips = lmo2.latency(LatencySpan::ROUND_TRIP);
+  assertMore(roundTrips.count, uint32_t(0));
+  assertLessOrEqual(roundTrips.count, lmo2.latency(LatencySpan::RADIO_SEND).count);
+  assertMoreOrEqual(roundTrips.percentile(1), uint64_t(roundTrips.maxNanos));
+  assertLessOrEqual(roundTrips.percentile(0.5), roundTrips.percentile(0.99));
+
+  lmo2.clearLatency();
+  assertEqual(lmo2.latency(LatencySpan::ROUND_TRIP).count, uint32_t(0));
+
+  // Stalls longer than 4.3 s go in the top bucket rather than wrapping.
+  assertEqual(latencyNanos(LatencyStamp(5000000000ull)), uint32_t(UINT32_MAX));
+  assertEqual(latencyNanos(LatencyStamp(1000)), uint32_t(1000));
+}
+
+struct MemoryConfig : LazyMeshOtaConfig {
+  static constexpr bool memoryAccounting = true;
+  static constexpr uint32_t memoryStackBudget = 8192;
+  static constexpr uint32_t memoryHeapBudget = 16384;
+};
+
+struct TightMemoryConfig : MemoryConfig {
+  static constexpr uint32_t memoryStackBudget = 64;
+};
+
+test(memoryTest) {
+  FakeWifiContext wifi1({1, 2, 3, 4, 5, 6}, testBssid);
+  FakeUpdateContext update1("sketch1datadatadata", 12345);
+  CountingListener listener1;
+  BasicLazyMeshOta<MemoryConfig> lmo1;
+  lmo1.setListener(&listener1);
+  lmo1.begin("memoryTest", 2);
+
+  FakeWifiContext wifi2({7, 8, 9, 10, 11, 12}, testBssid);
+  FakeUpdateContext update2("sketch2", 789101);
+  CountingListener listener2;
+  BasicLazyMeshOta<TightMemoryConfig> lmo2;
+  lmo2.setListener(&listener2);
+  lmo2.begin("memoryTest", 1);
+
+  uint32_t start = millis();
+  while (!update2.didUpdate && millis() - start < 5000) {
+    runSome(lmo1, wifi1, update1);
+    runSome(lmo2, wifi2, update2);
+    delay(10);
+  }
+  assertTrue(update2.didUpdate);
+
+  // Serving stayed within budget.
+  assertEqual(listener1.errors, 0);
+  const MemoryUsage& receive = lmo1.memoryUsage(MemoryEntry::RECEIVE);
+  assertMore(receive.calls, uint32_t(0));
+  assertMore(receive.peakStack, uint32_t(0));
+  assertMore(receive.peakHeap, uint32_t(0));
+  assertMore(receive.allocations, uint32_t(0));
+  assertEqual(receive.overBudget, uint32_t(0));
+  assertMore(lmo1.memoryUsage(MemoryEntry::BEGIN).calls, uint32_t(0));
+  assertMore(lmo1.memoryUsage(MemoryEntry::LOOP).calls, uint32_t(0));
+
+  // No call fits in 64 bytes of stack.
+  assertMore(listener2.errors, 0);
+  assertMore(lmo2.memoryUsage(MemoryEntry::LOOP).overBudget, uint32_t(0));
+}
+
+struct VersionSkipConfig : LazyMeshOtaConfig {
+  static constexpr uint32_t versionCollectWindow = 2000;
+};
+
+class StartListener : public LazyMeshOta::Listener {
+ public:
+  void onStartUpgrade(eth_addr, int version, String) override {
+    ++starts;
+    lastVersion = version;
+  }
+  int starts = 0;
+  int lastVersion = 0;
+};
+
+test(versionSkipTest) {
+  FakeWifiContext wifi1({1, 2, 3, 4, 5, 6}, testBssid);
+  FakeUpdateContext update1("sketch1", 12345);
+  BasicLazyMeshOta<VersionSkipConfig> lmo1;
+  lmo1.begin("versionSkipTest", 1);
+
+  FakeWifiContext wifi2({7, 8, 9, 10, 11, 12}, testBssid);
+  FakeUpdateContext update2("sketch2", 789101);
+  BasicLazyMeshOta<VersionSkipConfig> lmo2;
+  lmo2.begin("versionSkipTest", 2);
+
+  FakeWifiContext wifi3({13, 14, 15, 16, 17, 18}, testBssid);
+  FakeUpdateContext update3("sketch3", 112131);
+  BasicLazyMeshOta<VersionSkipConfig> lmo3;
+  StartListener listener1;
+  lmo1.setListener(&listener1);
+  bool started3 = false;
+
+  uint32_t start = millis();
+  while (!update1.didUpdate && millis() - start < 15000) {
+    runSome(lmo1, wifi1, update1);
+    runSome(lmo2, wifi2, update2);
+    if (!started3 && millis() - start > 500) {
+      // Version 3 shows up after node 1 has heard of version 2.
+      wifi3.enable();
+      update3.enable();
+      lmo3.begin("versionSkipTest", 3);
+      started3 = true;
+    }
+    if (started3) {
+      runSome(lmo3, wifi3, update3);
+    }
+    delay(10);
+  }
+  assertTrue(update1.didUpdate);
+  // Went straight to version 3.
+  assertEqual(listener1.starts, 1);
+  assertEqual(listener1.lastVersion, 3);
+}
+
+class FailureListener : public StartListener {
+ public:
+  void onError(String err) override { failures += err.startsWith("Update failed"); }
+  int failures = 0;
+};
+
+test(preemptedReplyTest) {
+  FakeWifiContext wifi1({1, 2, 3, 4, 5, 6}, testBssid);
+  FakeUpdateContext update1("sketch1", 12345);
+  FailureListener listener1;
+  LazyMeshOta lmo1;
+  lmo1.setListener(&listener1);
+  lmo1.begin("preemptedReplyTest", 1);
+
+  FakeWifiContext wifi2({7, 8, 9, 10, 11, 12}, testBssid);
+  FakeUpdateContext update2("sketch2", 789101);
+  LazyMeshOta lmo2;
+  lmo2.begin("preemptedReplyTest", 2);
+
+  // Node 1 starts on version 2 and asks for the first block.
+  uint32_t start = millis();
+  while (!listener1.starts && millis() - start < 5000) {
+    runSome(lmo2, wifi2, update2);
+    runSome(lmo1, wifi1, update1);
+    delay(10);
+  }
+  assertEqual(listener1.lastVersion, 2);
+
+  // Before node 2 answers, version 3 shows up and preempts it.
+  FakeWifiContext wifi3({13, 14, 15, 16, 17, 18}, testBssid);
+  FakeUpdateContext update3("sketch3", 112131);
+  LazyMeshOta lmo3;
+  lmo3.begin("preemptedReplyTest", 3);
+  while (listener1.lastVersion != 3 && millis() - start < 10000) {
+    runSome(lmo3, wifi3, update3);
+    runSome(lmo1, wifi1, update1);
+    delay(10);
+  }
+  assertEqual(listener1.lastVersion, 3);
+
+  // Node 2's reply for version 2 arrives first, and has to be ignored.
+  while (!update1.didUpdate && millis() - start < 20000) {
+    runSome(lmo2, wifi2, update2);
+    runSome(lmo1, wifi1, update1);
+    runSome(lmo3, wifi3, update3);
+    delay(10);
+  }
+  assertTrue(update1.didUpdate);
+  assertEqual(listener1.starts, 2);
+  assertEqual(listener1.failures, 0);
+}
+
+// Number of frames received according to the trace ring, which is
+// drained.
+template <typename Ota>
+size_t tracedReceives(Ota& ota) {
+  size_t count = 0;
+  TraceEvent ev;
+  while (ota.nextTraceEvent(&ev)) {
+    if (ev.direction == TraceEvent::Direction::RX) {
+      ++count;
+    }
+  }
+  return count;
+}
+
+struct AdvertCacheConfig : LazyMeshOtaConfig {
+  static constexpr uint8_t advertCacheSize = 4;
+};
+
+test(advertCacheTest) {
+  FakeWifiContext wifi1({1, 2, 3, 4, 5, 6}, testBssid);
+  FakeUpdateContext update1("sketch1", 12345);
+  NeighborListener listener1;
+  BasicLazyMeshOta<AdvertCacheConfig> lmo1;
+  lmo1.setListener(&listener1);
+  lmo1.begin("advertCacheTest", 1);
+
+  FakeWifiContext wifi2({7, 8, 9, 10, 11, 12}, testBssid);
+  FakeUpdateContext update2("sketch1", 789101);
+  BasicLazyMeshOta<AdvertCacheConfig> lmo2;
+  lmo2.begin("advertCacheTest", 1);
+
+  // Something newer, but for another sketch.
+  FakeWifiContext wifi3({13, 14, 15, 16, 17, 18}, testBssid);
+  FakeUpdateContext update3("sketch3", 112131);
+  BasicLazyMeshOta<AdvertCacheConfig> lmo3;
+  lmo3.begin("otherSketch", 5);
+
+  uint32_t start = millis();
+  while (millis() - start < 5000) {
+    runSome(lmo1, wifi1, update1);
+    runSome(lmo2, wifi2, update2);
+    runSome(lmo3, wifi3, update3);
+    delay(10);
+  }
+  assertFalse(update1.didBegin);
+
+  // Each neighbor was parsed once, and only reported once.
+  AdvertCacheStats stats = lmo1.advertCacheStats();
+  assertEqual(stats.misses, uint32_t(2));
+  assertMore(stats.hits, uint32_t(2));
+  assertEqual(stats.evictions, uint32_t(0));
+  assertEqual(listener1.seen, 1);
+}
+
+struct CensusConfig : LazyMeshOtaConfig {
+  static constexpr uint8_t censusVersions = 4;
+  static constexpr uint32_t convergedQuietTime = 2000;
+};
+
+test(censusTest) {
+  FakeWifiContext wifi1({1, 2, 3, 4, 5, 6}, testBssid);
+  FakeUpdateContext update1("sketch1", 12345);
+  BasicLazyMeshOta<CensusConfig> lmo1;
+  lmo1.begin("censusTest", 2);
+
+  FakeWifiContext wifi2({7, 8, 9, 10, 11, 12}, testBssid);
+  FakeUpdateContext update2("sketch1", 789101);
+  BasicLazyMeshOta<CensusConfig> lmo2;
+  lmo2.begin("censusTest", 2);
+
+  FakeWifiContext wifi3({13, 14, 15, 16, 17, 18}, testBssid);
+  FakeUpdateContext update3("sketch3", 112131);
+  BasicLazyMeshOta<CensusConfig> lmo3;
+  lmo3.begin("censusTest", 1);
+
+  uint32_t start = millis();
+  while (!update3.didUpdate && millis() - start < 10000) {
+    // Give node 3 a chance to advertise its old version first.
+    if (millis() - start > 1600) {
+      runSome(lmo1, wifi1, update1);
+      runSome(lmo2, wifi2, update2);
+    }
+    runSome(lmo3, wifi3, update3);
+    delay(10);
+  }
+  assertTrue(update3.didUpdate);
+  assertFalse(lmo1.converged());
+  assertEqual(lmo1.census().estimate(1), uint32_t(1));
+
+  // Node 3 comes back running the new version.
+  FakeUpdateContext update3b("sketch1", 112131);
+  BasicLazyMeshOta<CensusConfig> lmo3b;
+  lmo3b.begin("censusTest", 2);
+  start = millis();
+  while (millis() - start < 4000) {
+    runSome(lmo1, wifi1, update1);
+    runSome(lmo2, wifi2, update2);
+    runSome(lmo3b, wifi3, update3b);
+    delay(10);
+  }
+  assertTrue(lmo1.converged());
+  assertTrue(lmo3b.converged());
+  assertEqual(lmo3b.census().estimate(2), uint32_t(3));
+  assertEqual(lmo3b.census().estimateTotal(), uint32_t(3));
+  // Node 3 ran version 1 once, and still counts for it.
+  assertEqual(lmo1.census().estimate(1), uint32_t(1));
+  assertEqual(lmo3b.census().estimate(1), uint32_t(1));
+  // Advertising slowed down.
+  assertMore(lmo1.millisUntilWork(), CensusConfig::advertiseInterval * 3 / 2);
+}
+
+struct ShareConfig : LazyMeshOtaConfig {
+  static constexpr bool useManifest = true;
+  static constexpr uint16_t manifestFanout = 16;
+  static constexpr bool shareBlocks = true;
+};
+
+test(blockShareTest) {
+  std::string sketch1;
+  for (int i = 0; i != 40; ++i) {
+    sketch1.push_back(char(i * 7));
+  }
+  // Another sketch with the same blocks in a different order.
+  std::string sketch3 = "xyzw";
+  for (int offset = 36; offset >= 0; offset -= 4) {
+    sketch3 += sketch1.substr(offset, 4);
+  }
+
+  FakeWifiContext wifi1({1, 2, 3, 4, 5, 6}, testBssid);
+  FakeUpdateContext update1(sketch1, 12345);
+  BasicLazyMeshOta<ShareConfig> lmo1;
+  lmo1.begin("blockShareTest", 2);
+
+  FakeWifiContext wifi2({7, 8, 9, 10, 11, 12}, testBssid);
+  FakeUpdateContext update2("sketch2", 789101);
+  CountingListener listener2;
+  BasicLazyMeshOta<ShareConfig> lmo2;
+  lmo2.setListener(&listener2);
+  lmo2.begin("blockShareTest", 1);
+
+  FakeWifiContext wifi3({13, 14, 15, 16, 17, 18}, testBssid);
+  FakeUpdateContext update3(sketch3, 112131);
+  BasicLazyMeshOta<ShareConfig> lmo3;
+  lmo3.begin("otherSketch", 7);
+
+  uint32_t start = millis();
+  while (!update2.didUpdate && millis() - start < 10000) {
+    // The source goes away after a few blocks.
+    if (listener2.requests < 3) {
+      runSome(lmo1, wifi1, update1);
+    }
+    runSome(lmo2, wifi2, update2);
+    runSome(lmo3, wifi3, update3);
+    delay(10);
+  }
+  assertTrue(update2.didUpdate);
+  assertFalse(update3.didBegin);
+}
+
+// Counts what's read of the image, to see that nothing is hashed.
+class CountingImageSource : public RamImageSource {
+ public:
+  using RamImageSource::RamImageSource;
+  bool read(uint32_t offset, uint8_t* data, size_t len) override {
+    bytesRead += len;
+    return RamImageSource::read(offset, data, len);
+  }
+  uint32_t bytesRead = 0;
+};
+
+struct PrebuiltConfig : ShareConfig {
+  static constexpr uint16_t manifestFanout = 4;
+};
+
+test(prebuiltManifestTest) {
+  std::string sketch1;
+  for (int i = 0; i != 200; ++i) {
+    sketch1.push_back(char(i * 7));
+  }
+  RamImageSource plain((const uint8_t*)sketch1.data(), sketch1.size());
+  StringPrint manifest;
+  assertTrue(writePrebuiltManifest(plain, "prebuiltTest", 2, PrebuiltConfig::bufferSize,
+                                   PrebuiltConfig::manifestFanout, true /* block keys */,
+                                   manifest));
+  std::string image = sketch1 + manifest.data;
+  CountingImageSource source((const uint8_t*)image.data(), image.size());
+  assertEqual(source.size(), uint32_t(sketch1.size()));
+
+  FakeWifiContext wifi1({1, 2, 3, 4, 5, 6}, testBssid);
+  FakeUpdateContext update1("", 12345);
+  {
+    // As if version 3 had been flashed over it without a manifest.
+    BasicLazyMeshOta<PrebuiltConfig> stale;
+    stale.setImageSource(&source);
+    stale.begin("prebuiltTest", 3);
+    for (int i = 0; i != 10; ++i) {
+      runSome(stale, wifi1, update1);
+    }
+    assertEqual(source.bytesRead, uint32_t(sketch1.size()));
+    stale.end();
+    source.bytesRead = 0;
+  }
+  BasicLazyMeshOta<PrebuiltConfig> lmo1;
+  lmo1.setImageSource(&source);
+  lmo1.begin("prebuiltTest", 2);
+  for (int i = 0; i != 10; ++i) {
+    runSome(lmo1, wifi1, update1);
+  }
+  // Only enough to check the manifest belongs to the image.
+  assertLessOrEqual(source.bytesRead, uint32_t(PrebuiltManifestHeader::tailLength));
+
+  // The tree is checked against the image as it's served.
+  FakeWifiContext wifi2({7, 8, 9, 10, 11, 12}, testBssid);
+  FakeUpdateContext update2("sketch2", 789101);
+  CountingListener listener2;
+  BasicLazyMeshOta<PrebuiltConfig> lmo2;
+  lmo2.setListener(&listener2);
+  lmo2.begin("prebuiltTest", 1);
+  uint32_t start = millis();
+  while (!update2.didUpdate && millis() - start < 10000) {
+    runSome(lmo1, wifi1, update1);
+    runSome(lmo2, wifi2, update2);
+    delay(10);
+  }
+  assertTrue(update2.didUpdate);
+  assertEqual(listener2.errors, 0);
+}
+
+struct RendezvousConfig : LazyMeshOtaConfig {
+  static constexpr uint32_t advertiseInterval = 200;
+  static constexpr uint32_t rendezvousPeriod = 1000;
+  static constexpr uint32_t rendezvousWindow = 150;
+  static constexpr uint16_t rendezvousScanPeriods = 0;
+};
+
+test(rendezvousTest) {
+  std::string sketch1;
+  for (int i = 0; i != 100; ++i) {
+    sketch1.push_back(char(i * 7));
+  }
+  FakeWifiContext wifi2({7, 8, 9, 10, 11, 12}, testBssid);
+  FakeUpdateContext update2("sketch2", 789101);
+  BasicLazyMeshOta<RendezvousConfig> lmo2;
+  lmo2.begin("rendezvousTest", 1);
+  FakeWifiContext wifi3({13, 14, 15, 16, 17, 18}, testBssid);
+  FakeUpdateContext update3("sketch2", 112131);
+  BasicLazyMeshOta<RendezvousConfig> lmo3;
+  lmo3.begin("rendezvousTest", 1);
+
+  // Once they've found each other, they're mostly asleep.
+  uint32_t start = millis();
+  uint64_t radio2 = 0, radio3 = 0;
+  while (millis() - start < 5000) {
+    if (millis() - start >= 2000 && !radio2) {
+      radio2 = wifi2.radioOnMicros();
+      radio3 = wifi3.radioOnMicros();
+    }
+    runSome(lmo2, wifi2, update2);
+    runSome(lmo3, wifi3, update3);
+    delay(1);
+  }
+  assertLess(wifi2.radioOnMicros() - radio2, uint64_t(3000000 * 3 / 10));
+  assertLess(wifi3.radioOnMicros() - radio3, uint64_t(3000000 * 3 / 10));
+
+  // A node with a new version joins their schedule, and they update
+  // from it in their windows.
+  FakeWifiContext wifi1({19, 20, 21, 22, 23, 24}, testBssid);
+  FakeUpdateContext update1(sketch1, 12345);
+  BasicLazyMeshOta<RendezvousConfig> lmo1;
+  lmo1.begin("rendezvousTest", 2);
+  start = millis();
+  while (!(update2.didUpdate && update3.didUpdate) && millis() - start < 10000) {
+    runSome(lmo1, wifi1, update1);
+    if (!update2.didUpdate) {
+      runSome(lmo2, wifi2, update2);
+    }
+    if (!update3.didUpdate) {
+      runSome(lmo3, wifi3, update3);
+    }
+    delay(1);
+  }
+  assertTrue(update2.didUpdate);
+  assertTrue(update3.didUpdate);
+
+  // Wifi is only off while the radio sleeps.
+  assertEqual(wifi1.opmode, uint8_t(lmo1.radioOn() ? STATION_MODE : NULL_MODE));
+
+  // With no one left to serve, the source sleeps outside its windows.
+  start = millis();
+  while (lmo1.radioOn() && millis() - start < 2000) {
+    runSome(lmo1, wifi1, update1);
+    delay(1);
+  }
+  assertFalse(lmo1.radioOn());
+  assertFalse(wifi1.radioOn);
+  assertEqual(wifi1.opmode, uint8_t(NULL_MODE));
+}
+
+struct FileImageConfig : LazyMeshOtaConfig {
+  static constexpr uint16_t bufferSize = 1024;
+  static constexpr uint8_t streamWindow = 16;
+};
+
+test(fileImageTest) {
+  // Bigger than FakeUpdateContext lets an update be.
+  std::string image;
+  for (uint32_t i = 0; i != 96 * 1024; ++i) {
+    image.push_back(char(i * 7 + (i >> 10)));
+  }
+  char imagePath[] = "/tmp/fileImageTestXXXXXX";
+  int fd = mkstemp(imagePath);
+  assertTrue(fd >= 0);
+  assertEqual(write(fd, image.data(), image.size()), ssize_t(image.size()));
+  close(fd);
+  std::string updatePath = std::string(imagePath) + ".update";
+
+  MappedFileImageSource source(imagePath);
+  assertTrue(source.ok());
+  FakeWifiContext wifi1({1, 2, 3, 4, 5, 6}, testBssid);
+  FakeUpdateContext update1("", 12345);
+  BasicLazyMeshOta<FileImageConfig> lmo1;
+  lmo1.setImageSource(&source);
+  lmo1.begin("fileImageTest", 2);
+
+  FakeWifiContext wifi2({7, 8, 9, 10, 11, 12}, testBssid);
+  FakeUpdateContext update2("sketch2", 789101);
+  FileImageSink sink(updatePath.c_str(), 1024 * 1024);
+  BasicLazyMeshOta<FileImageConfig> lmo2;
+  lmo2.setImageSink(&sink);
+  lmo2.begin("fileImageTest", 1);
+
+  uint32_t start = millis();
+  while (!sink.complete() && millis() - start < 10000) {
+    runSome(lmo1, wifi1, update1);
+    runSome(lmo2, wifi2, update2);
+    delay(1);
+  }
+  assertTrue(sink.complete());
+  assertTrue(update2.didRestart);
+  assertFalse(update2.didBegin);
+
+  MappedFileImageSource written(updatePath.c_str());
+  assertEqual(written.size(), uint32_t(image.size()));
+  assertTrue(memcmp(written.data(), image.data(), image.size()) == 0);
+  unlink(imagePath);
+  unlink(updatePath.c_str());
+}
+
+test(wakeTest) {
+  FakeWifiContext wifi1({1, 2, 3, 4, 5, 6}, testBssid);
+  FakeUpdateContext update1("sketch1", 12345);
+  LazyMeshOta lmo1;
+  lmo1.setTraceEnabled(true);
+  lmo1.begin("wakeTest", 1);
+  // Busy until the sketch is hashed.
+  assertEqual(lmo1.millisUntilWork(), uint32_t(0));
+  lmo1.loop();
+
+  uint32_t wait = lmo1.millisUntilWork();
+  assertMore(wait, uint32_t(0));
+  assertLessOrEqual(wait, LazyMeshOtaConfig::advertiseInterval * 3 / 2 + 1);
+  uint32_t start = millis();
+  delay(wait / 2);
+  lmo1.loop();
+  TraceEvent ev;
+  assertFalse(lmo1.nextTraceEvent(&ev));
+
+  // Then it advertises.
+  delay(wait - (millis() - start) + 1);
+  lmo1.loop();
+  assertTrue(lmo1.nextTraceEvent(&ev));
+  assertTrue(ev.direction == TraceEvent::Direction::TX);
+  assertEqual(ev.packetType, uint8_t(0) /* ADVERTISE */);
+}
+
+test(wifiRoutingTest) {
+  FakeWifiContext wifi1({1, 2, 3, 4, 5, 6}, testBssid);
+  FakeUpdateContext update1("sketch1", 12345);
+  LazyMeshOta lmo1;
+  lmo1.setTraceEnabled(true);
+  lmo1.begin("wifiRoutingTest", 1);
+  lmo1.register_wifi_cb();
+
+  FakeWifiContext wifi2({7, 8, 9, 10, 11, 12}, testBssid);
+  FakeUpdateContext update2("sketch1", 789101);
+  LazyMeshOta lmo2;
+  lmo2.setTraceEnabled(true);
+  lmo2.begin("wifiRoutingTest", 1);
+  lmo2.register_wifi_cb();
+  assertTrue(rawRecvCb != nullptr);
+
+  // Instances with other configurations share the callback.
+  FakeWifiContext wifi4({19, 20, 21, 22, 23, 24}, testBssid);
+  FakeUpdateContext update4("sketch1", 1415);
+  BasicLazyMeshOta<LatencyConfig> lmo4;
+  lmo4.setTraceEnabled(true);
+  lmo4.begin("wifiRoutingTest", 1);
+  lmo4.register_wifi_cb();
+
+  FakeWifiContext wifi3({13, 14, 15, 16, 17, 18}, testBssid);
+  FakeUpdateContext update3("sketch1", 1213);
+  LazyMeshOta lmo3;
+  lmo3.begin("wifiRoutingTest", 1);
+  uint32_t start = millis();
+  while (wifi1.inbox.empty() && millis() - start < 2000) {
+    runSome(lmo3, wifi3, update3);
+    delay(10);
+  }
+  RxPacket* advert = wifi1.nextPacket();
+  assertTrue(advert != nullptr);
+  wifi2.discardInbox();
+  wifi4.discardInbox();
+
+  // Broadcasts go to everyone, once.
+  rawRecvCb(advert);
+  rawRecvCb(advert);
+  assertEqual(tracedReceives(lmo1), size_t(1));
+  assertEqual(tracedReceives(lmo2), size_t(1));
+  assertEqual(tracedReceives(lmo4), size_t(1));
+
+  // A frame for one instance only goes to that one.
+  memcpy(advert->data + 4, &wifi2.macaddr, sizeof(eth_addr));
+  ++advert->data[22];
+  rawRecvCb(advert);
+  assertEqual(tracedReceives(lmo1), size_t(0));
+  assertEqual(tracedReceives(lmo2), size_t(1));
+  assertEqual(tracedReceives(lmo4), size_t(0));
+
+  // Nothing arrives after end.
+  lmo2.end();
+  ++advert->data[22];
+  rawRecvCb(advert);
+  assertEqual(tracedReceives(lmo1), size_t(1));
+  assertEqual(tracedReceives(lmo2), size_t(0));
+
+  lmo1.end();
+  lmo4.end();
+  free(advert);
+}
+
+test(threadedTransferTest) {
+  // Each thread runs its own pair of nodes on its own medium.
+  static constexpr int threadCount = 4;
+  bool updated[threadCount] = {};
+  std::vector<std::thread> threads;
+  for (int t = 0; t != threadCount; ++t) {
+    threads.emplace_back([t, &updated]() {
+      FakeWifiMedium medium;
+      FakeWifiContext wifi1({1, 2, 3, 4, 5, uint8_t(t)}, testBssid, &medium);
+      FakeUpdateContext update1("sketch" + std::to_string(t), 12345);
+      LazyMeshOta lmo1;
+      lmo1.begin("threadedTransferTest", 2);
+
+      FakeWifiContext wifi2({7, 8, 9, 10, 11, uint8_t(t)}, testBssid, &medium);
+      FakeUpdateContext update2("old", 789101);
+      LazyMeshOta lmo2;
+      lmo2.begin("threadedTransferTest", 1);
+
+      uint32_t start = millis();
+      while (!update2.didUpdate && millis() - start < 5000) {
+        runSome(lmo1, wifi1, update1);
+        runSome(lmo2, wifi2, update2);
+        delay(10);
+      }
+      updated[t] = update2.didUpdate && !update1.didBegin;
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  for (int t = 0; t != threadCount; ++t) {
+    assertTrue(updated[t]);
+  }
+}
+
 void setup() {
 #if !defined(EPOXY_DUINO)
   delay(1000);  // wait to prevent garbage on SERIAL_PORT_MONITOR
@@ -0,0 +1,106 @@
+// Appends a prebuilt manifest to a compiled sketch, so nodes running it
+// know its md5 and hash tree at boot instead of hashing flash.  Run it
+// on the .bin after each build, e.g. from a post-objcopy hook; running
+// it again replaces the manifest.  The sketch name and version must be
+// the ones the sketch passes to begin; a manifest for any other is
+// ignored.  Options:
+//   --block-size <n>  bufferSize of the nodes, for the hash tree; 0 for
+//                     the md5 alone (default 1024)
+//   --fanout <n>      manifestFanout of the nodes (default 16)
+//   --block-keys      include the block index, for shareBlocks
+
+#include <Arduino.h>
+#include <LazyMeshOta.h>
+#include <LazyMeshOtaFileImage.h>
+#include <LazyMeshOtaPrebuilt.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string>
+
+void wifi_raw_set_recv_cb(wifi_raw_recv_cb_fn /* rx_fn */) {
+  assert(0 /* this should not be called */);
+}
+
+class StringPrint : public Print {
+ public:
+  size_t write(uint8_t c) override {
+    data.push_back(char(c));
+    return 1;
+  }
+  size_t write(const uint8_t* buf, size_t len) override {
+    data.append((const char*)buf, len);
+    return len;
+  }
+  std::string data;
+};
+
+void setup() {
+  uint32_t blockSize = 1024;
+  uint32_t fanout = 16;
+  bool blockKeys = false;
+  String name;
+  bool haveVersion = false;
+  int version = 0;
+  const char* path = nullptr;
+  for (int i = 1; i < epoxy_argc; ++i) {
+    String arg = epoxy_argv[i];
+    if (arg == "--block-size" && i + 1 < epoxy_argc) {
+      blockSize = atoi(epoxy_argv[++i]);
+    } else if (arg == "--fanout" && i + 1 < epoxy_argc) {
+      fanout = atoi(epoxy_argv[++i]);
+    } else if (arg == "--block-keys") {
+      blockKeys = true;
+    } else if (!path && !arg.startsWith("-")) {
+      path = epoxy_argv[i];
+    } else if (!name.length() && !arg.startsWith("-")) {
+      name = arg;
+    } else if (!haveVersion && !arg.startsWith("-")) {
+      version = atoi(epoxy_argv[i]);
+      haveVersion = true;
+    } else {
+      Serial.println("Unknown argument " + arg);
+      exit(1);
+    }
+  }
+  if (!path || !name.length() || !haveVersion) {
+    Serial.println(
+        "Usage: ManifestTool [--block-size <n>] [--fanout <n>] [--block-keys] <sketch.bin> "
+        "<sketch name> <version>");
+    exit(1);
+  }
+  if (blockSize && (fanout < 2 || fanout > 0xffff)) {
+    Serial.println("Fanout must be from 2 to 65535");
+    exit(1);
+  }
+
+  // The source leaves out any manifest already there.
+  StringPrint manifest;
+  uint32_t imageSize;
+  {
+    MappedFileImageSource image(path);
+    if (!image.ok()) {
+      Serial.printf("Unable to read %s\n", path);
+      exit(1);
+    }
+    imageSize = image.size();
+    if (!writePrebuiltManifest(image, name, version, blockSize, fanout, blockKeys, manifest)) {
+      Serial.printf("Unable to hash %s\n", path);
+      exit(1);
+    }
+  }
+
+  int fd = open(path, O_WRONLY | O_CLOEXEC);
+  if (fd < 0 || ftruncate(fd, imageSize) < 0 ||
+      pwrite(fd, manifest.data.data(), manifest.data.size(), imageSize) !=
+          ssize_t(manifest.data.size())) {
+    Serial.printf("Unable to write %s\n", path);
+    exit(1);
+  }
+  close(fd);
+  Serial.printf("Appended a %u byte manifest to %u bytes of %s\n",
+                unsigned(manifest.data.size()), unsigned(imageSize), path);
+  exit(0);
+}
+
+void loop() {}
@@ -0,0 +1,32 @@
+#ifndef QUIETLISTENER_H
+#define QUIETLISTENER_H
+
+#include <LazyMeshOta.h>
+
+// Listener for the benchmarks, which run too many nodes to print what
+// each one does.  Counts what they report instead.
+class QuietListener : public LazyMeshOta::Listener {
+ public:
+  void onNeighborSeen(eth_addr, String, int, String) override {}
+  void onStartUpgrade(eth_addr, int versionArg, String) override {
+    ++starts;
+    version = versionArg;
+  }
+  void onDoneUpgrade() override {}
+  void onSendProgress(eth_addr, size_t, size_t, size_t) override {}
+  void onRequestChunk(size_t, size_t) override {}
+  void onReceiveTimeout() override { ++timeouts; }
+  void onError(String err) override {
+    ++errors;
+    failedUpdates += err.startsWith("Update failed");
+  }
+  uint32_t starts = 0;
+  uint32_t timeouts = 0;
+  uint32_t errors = 0;
+  // Errors from updates which didn't verify once written.
+  uint32_t failedUpdates = 0;
+  // Version of the last update started.
+  int version = 0;
+};
+
+#endif
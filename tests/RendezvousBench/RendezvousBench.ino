@@ -0,0 +1,340 @@
+// Measures what rendezvous schedules cost in propagation latency and
+// save in radio time.
+//
+// Nodes stand in a line, each hearing its neighbors within a few
+// places, so an update has to hop along it.  They all boot running
+// version 1 and idle for a while, then the first is flashed with
+// version 2, which spreads to the rest.  Each node's radio time is
+// accounted as the library turns it on and off.  Runs are on a virtual
+// clock from an event queue, so they're deterministic and fast.
+//
+// "make -C tests benchmarks" compares always-on with a few schedules.
+// Options:
+//   --nodes <n>   nodes in the line (default 8)
+//   --range <n>   how many places either way a node hears (default 1)
+//   --idle <n>    seconds to idle before the update (default 300)
+//   --seed <n>    seed for boot times and random numbers (default 1)
+
+#include <Arduino.h>
+#include <LazyMeshOta.h>
+#include <LazyMeshOtaImpl.h>
+
+#include <memory>
+#include <queue>
+#include <vector>
+
+#include "../QuietListener.h"
+
+void wifi_raw_set_recv_cb(wifi_raw_recv_cb_fn /* rx_fn */) {
+  assert(0 /* this should not be called */);
+}
+
+struct BenchConfig : LazyMeshOtaConfig {
+  static constexpr uint32_t advertiseInterval = 1000;
+  static constexpr uint16_t bufferSize = 256;
+  static constexpr bool useManifest = true;
+  static constexpr bool relayPartial = true;
+};
+struct AlwaysOnConfig : BenchConfig {};
+template <uint32_t period, uint32_t window>
+struct RendezvousConfig : BenchConfig {
+  static constexpr uint32_t rendezvousPeriod = period;
+  static constexpr uint32_t rendezvousWindow = window;
+};
+
+static constexpr uint32_t imageSize = 16384;
+// Runs still going after this long have stalled.
+static constexpr uint32_t horizon = 3600 * 1000;
+
+// Mixes bits for deterministic pseudo random decisions.
+static uint32_t mix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ull;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return uint32_t(x ^ (x >> 31));
+}
+
+static std::string image(int version) {
+  std::string image;
+  for (uint32_t i = 0; i != imageSize; ++i) {
+    image.push_back(char(i * (version * 2 + 5) + (i >> 8)));
+  }
+  return image;
+}
+
+struct Options {
+  uint32_t nodes = 8;
+  uint32_t range = 1;
+  uint32_t idle = 300;
+  uint32_t seed = 1;
+};
+
+struct Result {
+  // Fraction of the idle time the radio was on, averaged over nodes.
+  double idleDuty = 0;
+  // From flashing the first node until every node runs version 2.
+  uint32_t rolloutMillis = 0;
+  // Radio time per node during the rollout.
+  uint32_t rolloutRadioMillis = 0;
+  bool stalled = false;
+};
+
+template <typename Config>
+class Sim;
+
+// One node: its virtual clock, its radio, and what it runs.
+template <typename Config>
+class SimNode : public LazyMeshOtaClock, public LazyMeshOtaTransport {
+ public:
+  SimNode(Sim<Config>* simArg, uint8_t indexArg, uint32_t seed)
+      : sim(simArg),
+        index(indexArg),
+        mac({0x02, 0x52, 0x44, 0x56, 0, indexArg}),
+        _rng(uint64_t(seed) << 8 | indexArg) {}
+
+  uint32_t millis() override { return sim->now(); }
+  uint32_t micros() override { return sim->now() * 1000; }
+  long random(long min, long max) override {
+    if (max <= min) {
+      return min;
+    }
+    return min + mix(_rng++) % uint32_t(max - min);
+  }
+
+  eth_addr macAddress() override { return mac; }
+  eth_addr bssid() override { return mac; }
+  bool send(uint8_t* frame, uint16_t len) override {
+    sim->send(index, frame, len);
+    free(frame);
+    return true;
+  }
+  void setRadioOn(bool on) override {
+    if (on == radioOn) {
+      return;
+    }
+    if (radioOn) {
+      _radioMillis += sim->now() - _radioSince;
+    }
+    radioOn = on;
+    _radioSince = sim->now();
+  }
+  // Time the radio has been on since the start.
+  uint64_t radioMillis() const {
+    return _radioMillis + (radioOn ? sim->now() - _radioSince : 0);
+  }
+
+  // Powers on running the given version, with the radio on.
+  void boot(int versionArg) {
+    setRadioOn(true);
+    version = versionArg;
+    update.reset(new FakeUpdateContext(image(version), index));
+    ota.reset(new BasicLazyMeshOta<Config>);
+    ota->setClock(this);
+    ota->setTransport(this);
+    ota->setListener(&listener);
+    ota->begin("RendezvousBench", version);
+    wakeAt = sim->now();
+  }
+  void powerOff() {
+    update->enable();
+    ota.reset();
+    update.reset();
+  }
+  bool running() const { return ota != nullptr; }
+
+  Sim<Config>* sim;
+  uint8_t index;
+  eth_addr mac;
+  int version = 1;
+  // Off until it boots.
+  bool radioOn = false;
+  uint32_t wakeAt = 0;
+  QuietListener listener;
+  std::unique_ptr<FakeUpdateContext> update;
+  std::unique_ptr<BasicLazyMeshOta<Config>> ota;
+
+ private:
+  uint64_t _rng;
+  uint64_t _radioMillis = 0;
+  uint32_t _radioSince = 0;
+};
+
+template <typename Config>
+class Sim {
+ public:
+  explicit Sim(const Options& options) : _options(options) {
+    for (uint32_t i = 0; i != options.nodes; ++i) {
+      _nodes.emplace_back(new SimNode<Config>(this, i, options.seed));
+    }
+  }
+
+  uint32_t now() const { return _now; }
+
+  Result run() {
+    // Boot within the first few seconds, in no particular order.
+    std::vector<uint32_t> bootAt;
+    for (uint32_t i = 0; i != _nodes.size(); ++i) {
+      bootAt.push_back(mix(uint64_t(_options.seed) << 32 | i) % 5000);
+    }
+    uint32_t flashAt = _options.idle * 1000;
+    bool flashed = false;
+    std::vector<uint64_t> radioAtFlash(_nodes.size());
+
+    Result result;
+    for (;;) {
+      for (uint32_t i = 0; i != _nodes.size(); ++i) {
+        if (!_nodes[i]->running() && _now >= bootAt[i]) {
+          _nodes[i]->boot(1);
+        }
+      }
+      if (!flashed && _now >= flashAt) {
+        flashed = true;
+        uint64_t idleRadio = 0;
+        uint64_t idleTime = 0;
+        for (uint32_t i = 0; i != _nodes.size(); ++i) {
+          radioAtFlash[i] = _nodes[i]->radioMillis();
+          idleRadio += radioAtFlash[i];
+          idleTime += flashAt - bootAt[i];
+        }
+        result.idleDuty = double(idleRadio) / idleTime;
+        _nodes[0]->powerOff();
+        _nodes[0]->boot(2);
+      }
+
+      // Deliver what has arrived to radios which are on, then run
+      // everyone who got something or asked to be woken.
+      std::vector<bool> received(_nodes.size());
+      while (!_air.empty() && _air.top().due <= _now) {
+        // Receiving may send, which would move the top.
+        InFlight f = _air.top();
+        _air.pop();
+        SimNode<Config>& node = *_nodes[f.to];
+        if (node.running() && node.radioOn) {
+          node.update->enable();
+          RxPacket* pkt = (RxPacket*)malloc(sizeof(RxControl) + f.frame.size());
+          memcpy(pkt->data, f.frame.data(), f.frame.size());
+          pkt->rx_ctl.rssi = -50;
+          pkt->rx_ctl.legacy_length = f.frame.size();
+          node.ota->onReceiveRawFrame(pkt);
+          received[f.to] = true;
+        }
+      }
+      bool done = flashed;
+      for (uint32_t i = 0; i != _nodes.size(); ++i) {
+        SimNode<Config>& node = *_nodes[i];
+        if (node.running() && (received[i] || _now >= node.wakeAt)) {
+          node.update->enable();
+          node.ota->loop();
+          if (node.update->didUpdate) {
+            // Boot into the new version, which it can now serve.
+            node.powerOff();
+            node.boot(node.listener.version);
+          } else {
+            node.wakeAt = _now + std::max<uint32_t>(1, node.ota->millisUntilWork());
+          }
+        }
+        if (node.version != 2) {
+          done = false;
+        }
+      }
+
+      if (done || _now >= flashAt + horizon) {
+        result.stalled = !done;
+        result.rolloutMillis = _now - flashAt;
+        uint64_t rolloutRadio = 0;
+        for (uint32_t i = 0; i != _nodes.size(); ++i) {
+          rolloutRadio += _nodes[i]->radioMillis() - radioAtFlash[i];
+        }
+        result.rolloutRadioMillis = rolloutRadio / _nodes.size();
+        break;
+      }
+
+      // Skip ahead to whatever happens next.
+      uint32_t next = flashed ? flashAt + horizon : flashAt;
+      if (!_air.empty()) {
+        next = std::min(next, _air.top().due);
+      }
+      for (uint32_t i = 0; i != _nodes.size(); ++i) {
+        next = std::min(next, _nodes[i]->running() ? _nodes[i]->wakeAt : bootAt[i]);
+      }
+      _now = std::max(next, _now + 1);
+    }
+
+    for (auto& node : _nodes) {
+      node->powerOff();
+    }
+    return result;
+  }
+
+  void send(uint8_t from, const uint8_t* frame, uint16_t len) {
+    for (uint32_t to = 0; to != _nodes.size(); ++to) {
+      uint32_t distance = to > from ? to - from : from - to;
+      if (to == from || distance > _options.range) {
+        continue;
+      }
+      _air.push(InFlight{_now + 1, _seq++, uint8_t(to), std::string((const char*)frame, len)});
+    }
+  }
+
+ private:
+  struct InFlight {
+    uint32_t due;
+    uint64_t seq;
+    uint8_t to;
+    std::string frame;
+    bool operator<(const InFlight& other) const {
+      // priority_queue pops the largest, so invert.
+      return due != other.due ? due > other.due : seq > other.seq;
+    }
+  };
+
+  const Options& _options;
+  std::vector<std::unique_ptr<SimNode<Config>>> _nodes;
+  std::priority_queue<InFlight> _air;
+  uint32_t _now = 0;
+  uint64_t _seq = 0;
+};
+
+template <typename Config>
+void runSchedule(const char* name, const Options& options) {
+  Result r = Sim<Config>(options).run();
+  Serial.printf("%-18s %9.1f%% %12u%s %14u\n", name, r.idleDuty * 100, r.rolloutMillis,
+                r.stalled ? "+" : " ", r.rolloutRadioMillis);
+}
+
+void setup() {
+  Options options;
+  for (int i = 1; i < epoxy_argc; ++i) {
+    String arg = epoxy_argv[i];
+    if (arg == "--nodes" && i + 1 < epoxy_argc) {
+      options.nodes = atoi(epoxy_argv[++i]);
+    } else if (arg == "--range" && i + 1 < epoxy_argc) {
+      options.range = atoi(epoxy_argv[++i]);
+    } else if (arg == "--idle" && i + 1 < epoxy_argc) {
+      options.idle = atoi(epoxy_argv[++i]);
+    } else if (arg == "--seed" && i + 1 < epoxy_argc) {
+      options.seed = atoi(epoxy_argv[++i]);
+    } else {
+      Serial.println("Unknown argument " + arg);
+      exit(1);
+    }
+  }
+  options.nodes = std::max(2u, std::min(options.nodes, 256u));
+  options.range = std::max(1u, options.range);
+  // Everyone has to have booted and found a schedule first.
+  options.idle = std::max(60u, options.idle);
+
+  Serial.printf("%u nodes in a line, hearing %u either way, idle for %u s\n", options.nodes,
+                options.range, options.idle);
+  Serial.printf("%-18s %10s %13s %14s\n", "schedule", "idle duty", "rollout ms",
+                "radio ms/node");
+  runSchedule<AlwaysOnConfig>("always on", options);
+  runSchedule<RendezvousConfig<2000, 250>>("2 s, 250 ms", options);
+  runSchedule<RendezvousConfig<5000, 250>>("5 s, 250 ms", options);
+  runSchedule<RendezvousConfig<10000, 250>>("10 s, 250 ms", options);
+  runSchedule<RendezvousConfig<30000, 250>>("30 s, 250 ms", options);
+  runSchedule<RendezvousConfig<30000, 1000>>("30 s, 1 s", options);
+  exit(0);
+}
+
+void loop() {}
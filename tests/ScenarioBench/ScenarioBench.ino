@@ -0,0 +1,731 @@
+// Searches for network scenarios which make an update take as long as
+// possible, then shrinks the worst one found to the fewest faults that
+// still make it that bad.
+//
+// A scenario is a few seeders and clients, when each one joins, loss
+// bursts and outages, reboots, and how much frames are delayed and so
+// reordered.  Scenarios run on a virtual clock from an event queue, so
+// a run is deterministic and takes milliseconds.  Faults are limited
+// by a budget, so the search looks for timing which interacts badly
+// with retries and preemption rather than simply cutting the network
+// for longer.
+//
+// "make -C tests benchmarks" runs a short search.  Options:
+//   --iterations <n>   scenarios to try (default 2000)
+//   --seed <n>         seed for the search (default 1)
+//   --objective <time|bytes>
+//                      maximize time to completion or bytes sent
+//                      beyond one image per client (default time)
+//   --run <scenario>   run a single scenario, as printed by a search,
+//                      and describe it
+
+#include <Arduino.h>
+#include <LazyMeshOta.h>
+#include <LazyMeshOtaImpl.h>
+
+#include <memory>
+#include <queue>
+#include <sstream>
+#include <vector>
+
+#include "../QuietListener.h"
+
+void wifi_raw_set_recv_cb(wifi_raw_recv_cb_fn /* rx_fn */) {
+  assert(0 /* this should not be called */);
+}
+
+struct ScenarioConfig : LazyMeshOtaConfig {
+  static constexpr uint16_t bufferSize = 64;
+};
+using ScenarioOta = BasicLazyMeshOta<ScenarioConfig>;
+
+static constexpr uint8_t maxSeeders = 2;
+static constexpr uint8_t maxClients = 4;
+static constexpr uint8_t maxNodes = maxSeeders + maxClients;
+static constexpr uint32_t imageSize = 4096;
+// Latest time a fault or join may start.
+static constexpr uint32_t scenarioSpan = 30000;
+// Total ms of outages and reboots allowed in one scenario.
+static constexpr uint32_t faultBudget = 10000;
+// Scenarios still running after this long have stalled.
+static constexpr uint32_t horizon = 300000;
+
+// Mixes bits for deterministic pseudo random decisions.
+static uint32_t mix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ull;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return uint32_t(x ^ (x >> 31));
+}
+
+struct Scenario {
+  // While active, frames sent or received by 'node' (or by anyone, if
+  // node is allNodes) are dropped with the given percentage.
+  struct Outage {
+    static constexpr uint8_t allNodes = 0xff;
+    uint32_t start;
+    uint32_t length;
+    uint8_t node;
+    uint8_t lossPercent;
+  };
+  // The node powers off at 'at' and boots again 'down' ms later,
+  // losing any update in progress.
+  struct Reboot {
+    uint32_t at;
+    uint32_t down;
+    uint8_t node;
+  };
+
+  uint32_t seed = 1;
+  uint8_t seeders = 1;
+  uint8_t clients = 1;
+  // Seeders are nodes 0 .. seeders - 1; a newer version preempts an
+  // update to an older one.  Clients run version 1.
+  uint8_t seederVersion[maxSeeders] = {2, 2};
+  uint32_t joinAt[maxNodes] = {};
+  // Frames arrive 1 to 1 + maxDelay ms after they're sent.
+  uint32_t maxDelay = 0;
+  std::vector<Outage> outages;
+  std::vector<Reboot> reboots;
+
+  uint8_t nodes() const { return seeders + clients; }
+
+  uint32_t faultTime() const {
+    uint32_t total = 0;
+    for (const Outage& o : outages) {
+      total += o.length;
+    }
+    for (const Reboot& r : reboots) {
+      total += r.down;
+    }
+    return total;
+  }
+  bool valid() const {
+    if (!seeders || seeders > maxSeeders || !clients || clients > maxClients ||
+        faultTime() > faultBudget) {
+      return false;
+    }
+    for (const Outage& o : outages) {
+      if ((o.node != Outage::allNodes && o.node >= nodes()) || o.lossPercent > 100) {
+        return false;
+      }
+    }
+    for (const Reboot& r : reboots) {
+      if (r.node >= nodes()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // One line form, accepted by parse and --run.
+  String toString() const {
+    String out = "seed=" + String(seed) + " v=";
+    for (uint8_t i = 0; i != seeders; ++i) {
+      out += String(i ? "," : "") + String(seederVersion[i]);
+    }
+    out += " clients=" + String(clients) + " join=";
+    for (uint8_t i = 0; i != nodes(); ++i) {
+      out += String(i ? "," : "") + String(joinAt[i]);
+    }
+    out += " delay=" + String(maxDelay);
+    for (const Outage& o : outages) {
+      out += " out=" + String(o.start) + "+" + String(o.length) + "@" +
+             (o.node == Outage::allNodes ? String("all") : String(o.node)) + ":" +
+             String(o.lossPercent);
+    }
+    for (const Reboot& r : reboots) {
+      out += " reboot=" + String(r.at) + "+" + String(r.down) + "@" + String(r.node);
+    }
+    return out;
+  }
+
+  bool parse(const std::string& text) {
+    *this = Scenario();
+    std::istringstream in(text);
+    std::string word;
+    while (in >> word) {
+      size_t eq = word.find('=');
+      if (eq == std::string::npos) {
+        return false;
+      }
+      std::string key = word.substr(0, eq);
+      std::string value = word.substr(eq + 1);
+      for (char& c : value) {
+        if (c == ',' || c == '+' || c == '@' || c == ':') {
+          c = ' ';
+        }
+      }
+      std::istringstream fields(value);
+      if (key == "seed") {
+        fields >> seed;
+      } else if (key == "v") {
+        unsigned v;
+        seeders = 0;
+        while (seeders != maxSeeders && fields >> v) {
+          seederVersion[seeders++] = v;
+        }
+      } else if (key == "clients") {
+        unsigned n;
+        fields >> n;
+        clients = n;
+      } else if (key == "join") {
+        for (uint8_t i = 0; i != maxNodes && fields >> joinAt[i]; ++i) {
+        }
+      } else if (key == "delay") {
+        fields >> maxDelay;
+      } else if (key == "out") {
+        Outage o;
+        std::string node;
+        unsigned loss;
+        if (!(fields >> o.start >> o.length >> node >> loss)) {
+          return false;
+        }
+        o.node = node == "all" ? Outage::allNodes : atoi(node.c_str());
+        o.lossPercent = loss;
+        outages.push_back(o);
+      } else if (key == "reboot") {
+        Reboot r;
+        unsigned node;
+        if (!(fields >> r.at >> r.down >> node)) {
+          return false;
+        }
+        r.node = node;
+        reboots.push_back(r);
+      } else {
+        return false;
+      }
+    }
+    return valid();
+  }
+};
+
+struct Result {
+  // From when the last node joined until every client runs the newest
+  // version, or horizon if they never do.
+  uint32_t millis = 0;
+  // Bytes sent beyond one image per client.
+  uint64_t wastedBytes = 0;
+  uint32_t timeouts = 0;
+  // Updates started, including restarts after giving up or being
+  // preempted.
+  uint32_t starts = 0;
+  // Updates which failed, e.g. on a bad md5.
+  uint32_t errors = 0;
+  bool stalled = false;
+};
+
+class Sim;
+
+// One node: its virtual clock, its radio, and what it runs.
+class SimNode : public LazyMeshOtaClock, public LazyMeshOtaTransport {
+ public:
+  SimNode(Sim* sim, uint8_t index, uint32_t seed);
+
+  uint32_t millis() override;
+  uint32_t micros() override { return millis() * 1000; }
+  long random(long min, long max) override {
+    if (max <= min) {
+      return min;
+    }
+    return min + mix(_rng++) % uint32_t(max - min);
+  }
+
+  eth_addr macAddress() override { return mac; }
+  eth_addr bssid() override { return mac; }
+  bool send(uint8_t* frame, uint16_t len) override;
+
+  // Powers on running the given version.
+  void boot(int version);
+  void powerOff();
+  bool running() const { return ota != nullptr; }
+
+  Sim* sim;
+  uint8_t index;
+  eth_addr mac;
+  int version = 1;
+  uint32_t wakeAt = 0;
+  QuietListener listener;
+  std::unique_ptr<FakeUpdateContext> update;
+  std::unique_ptr<ScenarioOta> ota;
+
+ private:
+  uint64_t _rng;
+};
+
+class Sim {
+ public:
+  explicit Sim(const Scenario& scenario) : _scenario(scenario) {
+    for (uint8_t i = 0; i != scenario.nodes(); ++i) {
+      _nodes.emplace_back(new SimNode(this, i, scenario.seed));
+    }
+  }
+
+  static std::string image(int version) {
+    std::string image;
+    for (uint32_t i = 0; i != imageSize; ++i) {
+      image.push_back(char(i * (version * 2 + 5) + (i >> 8)));
+    }
+    return image;
+  }
+
+  uint32_t now() const { return _now; }
+
+  Result run() {
+    int newest = 1;
+    for (uint8_t i = 0; i != _scenario.seeders; ++i) {
+      newest = std::max<int>(newest, _scenario.seederVersion[i]);
+    }
+    uint32_t lastJoin = 0;
+    for (uint8_t i = 0; i != _scenario.nodes(); ++i) {
+      lastJoin = std::max(lastJoin, _scenario.joinAt[i]);
+    }
+
+    Result result;
+    std::vector<bool> joined(_scenario.nodes());
+    std::vector<uint32_t> bootAt(_scenario.nodes(), UINT32_MAX);
+    std::vector<bool> rebooted(_scenario.reboots.size());
+    for (;;) {
+      for (uint8_t i = 0; i != _scenario.nodes(); ++i) {
+        SimNode& node = *_nodes[i];
+        if (!joined[i] && _now >= _scenario.joinAt[i]) {
+          joined[i] = true;
+          node.boot(i < _scenario.seeders ? _scenario.seederVersion[i] : 1);
+        }
+        if (_now >= bootAt[i]) {
+          bootAt[i] = UINT32_MAX;
+          node.boot(node.version);
+        }
+      }
+      for (size_t r = 0; r != _scenario.reboots.size(); ++r) {
+        const Scenario::Reboot& reboot = _scenario.reboots[r];
+        SimNode& node = *_nodes[reboot.node];
+        if (!rebooted[r] && _now >= reboot.at && node.running()) {
+          rebooted[r] = true;
+          node.powerOff();
+          bootAt[reboot.node] = _now + reboot.down;
+        }
+      }
+
+      // Deliver what has arrived, then run everyone who got something
+      // or asked to be woken.
+      std::vector<bool> received(_scenario.nodes());
+      while (!_air.empty() && _air.top().due <= _now) {
+        // Receiving may send, which would move the top.
+        InFlight f = _air.top();
+        _air.pop();
+        SimNode& node = *_nodes[f.to];
+        if (node.running()) {
+          node.update->enable();
+          RxPacket* pkt = (RxPacket*)malloc(sizeof(RxControl) + f.frame.size());
+          memcpy(pkt->data, f.frame.data(), f.frame.size());
+          pkt->rx_ctl.rssi = -50;
+          pkt->rx_ctl.legacy_length = f.frame.size();
+          node.ota->onReceiveRawFrame(pkt);
+          received[f.to] = true;
+        }
+      }
+      bool done = true;
+      for (uint8_t i = 0; i != _scenario.nodes(); ++i) {
+        SimNode& node = *_nodes[i];
+        if (node.running() && (received[i] || _now >= node.wakeAt)) {
+          node.update->enable();
+          node.ota->loop();
+          if (node.update->didUpdate) {
+            // Boot into the new version, which it can now serve.
+            node.powerOff();
+            node.boot(node.listener.version);
+          } else {
+            node.wakeAt = _now + std::max<uint32_t>(1, node.ota->millisUntilWork());
+          }
+        }
+        if (i >= _scenario.seeders && node.version != newest) {
+          done = false;
+        }
+      }
+
+      if (done || _now >= horizon) {
+        result.stalled = !done;
+        result.millis = (done ? _now : horizon) - std::min(lastJoin, _now);
+        break;
+      }
+
+      // Skip ahead to whatever happens next.
+      uint32_t next = horizon;
+      if (!_air.empty()) {
+        next = std::min(next, _air.top().due);
+      }
+      for (uint8_t i = 0; i != _scenario.nodes(); ++i) {
+        if (_nodes[i]->running()) {
+          next = std::min(next, _nodes[i]->wakeAt);
+        } else if (!joined[i]) {
+          next = std::min(next, _scenario.joinAt[i]);
+        }
+        next = std::min(next, bootAt[i]);
+      }
+      for (size_t r = 0; r != _scenario.reboots.size(); ++r) {
+        if (!rebooted[r]) {
+          next = std::min(next, std::max(_scenario.reboots[r].at, _now + 1));
+        }
+      }
+      _now = std::max(next, _now + 1);
+    }
+
+    for (auto& node : _nodes) {
+      result.timeouts += node->listener.timeouts;
+      result.starts += node->listener.starts;
+      result.errors += node->listener.failedUpdates;
+    }
+    uint64_t needed = uint64_t(imageSize) * _scenario.clients;
+    result.wastedBytes = _airBytes > needed ? _airBytes - needed : 0;
+    return result;
+  }
+
+  void send(uint8_t from, const uint8_t* frame, uint16_t len) {
+    _airBytes += len;
+    ++_frames;
+    for (uint8_t to = 0; to != _scenario.nodes(); ++to) {
+      if (to == from || _dropped(from, to)) {
+        continue;
+      }
+      uint32_t delay = 1;
+      if (_scenario.maxDelay) {
+        delay += mix(uint64_t(_scenario.seed) << 40 ^ uint64_t(_frames) << 8 ^ to ^ 0x5a) %
+                 (_scenario.maxDelay + 1);
+      }
+      _air.push(InFlight{_now + delay, _seq++, to, std::string((const char*)frame, len)});
+    }
+  }
+
+ private:
+  struct InFlight {
+    uint32_t due;
+    uint64_t seq;
+    uint8_t to;
+    std::string frame;
+    bool operator<(const InFlight& other) const {
+      // priority_queue pops the largest, so invert.
+      return due != other.due ? due > other.due : seq > other.seq;
+    }
+  };
+
+  bool _dropped(uint8_t from, uint8_t to) {
+    for (const Scenario::Outage& o : _scenario.outages) {
+      if (_now < o.start || _now - o.start >= o.length) {
+        continue;
+      }
+      if (o.node != Scenario::Outage::allNodes && o.node != from && o.node != to) {
+        continue;
+      }
+      if (mix(uint64_t(_scenario.seed) << 40 ^ uint64_t(_frames) << 8 ^ to) % 100 <
+          o.lossPercent) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  const Scenario& _scenario;
+  std::vector<std::unique_ptr<SimNode>> _nodes;
+  std::priority_queue<InFlight> _air;
+  uint32_t _now = 0;
+  uint64_t _seq = 0;
+  uint64_t _frames = 0;
+  uint64_t _airBytes = 0;
+};
+
+SimNode::SimNode(Sim* simArg, uint8_t indexArg, uint32_t seed)
+    : sim(simArg),
+      index(indexArg),
+      mac({0x02, 0x53, 0x43, 0x4e, 0, indexArg}),
+      _rng(uint64_t(seed) << 8 | indexArg) {}
+
+uint32_t SimNode::millis() { return sim->now(); }
+
+bool SimNode::send(uint8_t* frame, uint16_t len) {
+  sim->send(index, frame, len);
+  free(frame);
+  return true;
+}
+
+void SimNode::boot(int versionArg) {
+  version = versionArg;
+  update.reset(new FakeUpdateContext(Sim::image(version), index));
+  ota.reset(new ScenarioOta);
+  ota->setClock(this);
+  ota->setTransport(this);
+  ota->setListener(&listener);
+  ota->begin("ScenarioBench", version);
+  wakeAt = sim->now();
+}
+
+void SimNode::powerOff() {
+  update->enable();
+  ota.reset();
+  update.reset();
+}
+
+// Picks scenarios to try with a generator of its own, so a search can
+// be repeated from its seed.
+class Search {
+ public:
+  Search(uint32_t seed, bool bytes) : _rng(uint64_t(seed) << 32), _bytes(bytes) {}
+
+  uint64_t score(const Result& result) const {
+    return _bytes ? result.wastedBytes : result.millis;
+  }
+
+  Scenario random() {
+    Scenario s;
+    s.seed = _next();
+    s.seeders = 1 + _below(maxSeeders);
+    s.clients = 1 + _below(maxClients);
+    for (uint8_t i = 0; i != maxSeeders; ++i) {
+      s.seederVersion[i] = 2 + _below(2);
+    }
+    for (uint8_t i = 0; i != maxNodes; ++i) {
+      s.joinAt[i] = _below(4) ? 0 : _below(scenarioSpan / 4);
+    }
+    s.maxDelay = _below(3) ? 0 : _below(50);
+    for (uint32_t n = _below(3); n; --n) {
+      _addFault(&s);
+    }
+    return s;
+  }
+
+  // Returns a small change to the given scenario.
+  Scenario mutate(const Scenario& from) {
+    for (;;) {
+      Scenario s = from;
+      switch (_below(8)) {
+        case 0:
+          s.seed = _next();
+          break;
+        case 1:
+          s.seeders = 1 + _below(maxSeeders);
+          s.seederVersion[_below(maxSeeders)] = 2 + _below(2);
+          break;
+        case 2:
+          s.clients = 1 + _below(maxClients);
+          break;
+        case 3:
+          s.joinAt[_below(maxNodes)] = _below(scenarioSpan / 4);
+          break;
+        case 4:
+          s.maxDelay = _below(50);
+          break;
+        case 5:
+          _addFault(&s);
+          break;
+        case 6:
+          if (!s.outages.empty()) {
+            Scenario::Outage& o = s.outages[_below(s.outages.size())];
+            // Nudge it, since what matters is often where it falls
+            // against a timeout.
+            o.start = std::max<int32_t>(0, int32_t(o.start) + int32_t(_below(1001)) - 500);
+            o.length = std::max<int32_t>(1, int32_t(o.length) + int32_t(_below(1001)) - 500);
+            o.lossPercent = std::min<uint32_t>(100, o.lossPercent + _below(41) - 20);
+          }
+          break;
+        case 7:
+          if (!s.reboots.empty()) {
+            Scenario::Reboot& r = s.reboots[_below(s.reboots.size())];
+            r.at = std::max<int32_t>(0, int32_t(r.at) + int32_t(_below(1001)) - 500);
+          }
+          break;
+      }
+      if (s.valid()) {
+        return s;
+      }
+    }
+  }
+
+ private:
+  void _addFault(Scenario* s) {
+    if (_below(3)) {
+      Scenario::Outage o;
+      o.start = _below(scenarioSpan);
+      o.length = 1 + _below(faultBudget / 2);
+      o.node = _below(4) ? _below(s->nodes()) : Scenario::Outage::allNodes;
+      o.lossPercent = _below(2) ? 100 : _below(101);
+      s->outages.push_back(o);
+    } else {
+      Scenario::Reboot r;
+      r.at = _below(scenarioSpan);
+      r.down = 1 + _below(faultBudget / 4);
+      r.node = _below(s->nodes());
+      s->reboots.push_back(r);
+    }
+  }
+
+  uint32_t _next() { return mix(_rng++); }
+  uint32_t _below(uint32_t n) { return _next() % n; }
+
+  uint64_t _rng;
+  bool _bytes;
+};
+
+// Removes and simplifies faults while the scenario stays at least
+// 'target' bad, so what's left is about what it takes.
+static Scenario shrink(const Search& search, Scenario s, uint64_t target, uint32_t* runs) {
+  auto stillBad = [&](const Scenario& candidate) {
+    if (!candidate.valid()) {
+      return false;
+    }
+    ++*runs;
+    return search.score(Sim(candidate).run()) >= target;
+  };
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    std::vector<Scenario> candidates;
+    for (size_t i = 0; i != s.outages.size(); ++i) {
+      Scenario c = s;
+      c.outages.erase(c.outages.begin() + i);
+      candidates.push_back(c);
+      if (s.outages[i].lossPercent != 100) {
+        c = s;
+        c.outages[i].lossPercent = 100;
+        candidates.push_back(c);
+      }
+      if (s.outages[i].length > 1) {
+        c = s;
+        c.outages[i].length /= 2;
+        candidates.push_back(c);
+      }
+    }
+    for (size_t i = 0; i != s.reboots.size(); ++i) {
+      Scenario c = s;
+      c.reboots.erase(c.reboots.begin() + i);
+      candidates.push_back(c);
+    }
+    if (s.clients > 1) {
+      Scenario c = s;
+      --c.clients;
+      candidates.push_back(c);
+    }
+    if (s.seeders > 1) {
+      // Drop the last seeder; clients and faults on later nodes shift
+      // down one.
+      Scenario c = s;
+      --c.seeders;
+      for (uint8_t i = c.seeders; i != maxNodes - 1; ++i) {
+        c.joinAt[i] = c.joinAt[i + 1];
+      }
+      for (auto& o : c.outages) {
+        o.node = o.node == Scenario::Outage::allNodes || o.node < c.seeders ? o.node : o.node - 1;
+      }
+      for (auto& r : c.reboots) {
+        r.node = r.node < c.seeders ? r.node : r.node - 1;
+      }
+      candidates.push_back(c);
+    }
+    if (s.maxDelay) {
+      Scenario c = s;
+      c.maxDelay = 0;
+      candidates.push_back(c);
+    }
+    for (uint8_t i = 0; i != s.nodes(); ++i) {
+      if (s.joinAt[i]) {
+        Scenario c = s;
+        c.joinAt[i] = 0;
+        candidates.push_back(c);
+      }
+    }
+    for (const Scenario& c : candidates) {
+      if (stillBad(c)) {
+        s = c;
+        changed = true;
+        break;
+      }
+    }
+  }
+  return s;
+}
+
+static void describe(const char* what, const Scenario& s, const Result& r) {
+  Serial.printf("%s: %u ms%s, %u wasted bytes, %u timeouts, %u updates started, %u failed\n",
+                what, r.millis, r.stalled ? " (stalled)" : "", uint32_t(r.wastedBytes),
+                r.timeouts, r.starts, r.errors);
+  Serial.printf("  --run \"%s\"\n", s.toString().c_str());
+}
+
+void setup() {
+  uint32_t iterations = 2000;
+  uint32_t seed = 1;
+  bool bytes = false;
+  const char* runScenario = nullptr;
+  for (int i = 1; i < epoxy_argc; ++i) {
+    String arg = epoxy_argv[i];
+    if (arg == "--iterations" && i + 1 < epoxy_argc) {
+      iterations = atoi(epoxy_argv[++i]);
+    } else if (arg == "--seed" && i + 1 < epoxy_argc) {
+      seed = atoi(epoxy_argv[++i]);
+    } else if (arg == "--objective" && i + 1 < epoxy_argc) {
+      bytes = String(epoxy_argv[++i]) == "bytes";
+    } else if (arg == "--run" && i + 1 < epoxy_argc) {
+      runScenario = epoxy_argv[++i];
+    } else {
+      Serial.println("Unknown argument " + arg);
+      exit(1);
+    }
+  }
+
+  if (runScenario) {
+    Scenario s;
+    if (!s.parse(runScenario)) {
+      Serial.printf("Unable to parse scenario %s\n", runScenario);
+      exit(1);
+    }
+    describe("scenario", s, Sim(s).run());
+    exit(0);
+  }
+
+  // Keep a few of the worst so far and mostly try variations on them.
+  static constexpr size_t eliteSize = 8;
+  Search search(seed, bytes);
+  std::vector<std::pair<uint64_t, Scenario>> elite;
+  uint32_t start = millis();
+  for (uint32_t i = 0; i != iterations; ++i) {
+    Scenario s = elite.size() < eliteSize || i % 4 == 0
+                     ? search.random()
+                     : search.mutate(elite[i % elite.size()].second);
+    Result result = Sim(s).run();
+    if (result.errors) {
+      describe("failed update", s, result);
+    }
+    uint64_t score = search.score(result);
+    if (elite.size() < eliteSize || score > elite.back().first) {
+      if (elite.size() == eliteSize) {
+        elite.pop_back();
+      }
+      elite.emplace_back(score, s);
+      std::stable_sort(elite.begin(), elite.end(),
+                       [](const std::pair<uint64_t, Scenario>& a,
+                          const std::pair<uint64_t, Scenario>& b) { return a.first > b.first; });
+    }
+  }
+  uint32_t searchMillis = millis() - start;
+  Serial.printf("Tried %u scenarios in %u ms\n", iterations, searchMillis);
+
+  const Scenario& worst = elite.front().second;
+  Result worstResult = Sim(worst).run();
+  describe("worst", worst, worstResult);
+
+  uint32_t runs = 0;
+  // Allow a little slack, or every fault moves the result a bit and
+  // none can go.
+  Scenario shrunk = shrink(search, worst, elite.front().first * 9 / 10, &runs);
+  Result shrunkResult = Sim(shrunk).run();
+  describe("shrunk", shrunk, shrunkResult);
+  Serial.printf("  after %u more runs\n", runs);
+
+  // The printed scenario has to reproduce exactly.
+  Scenario reparsed;
+  bool same = reparsed.parse(shrunk.toString().c_str()) &&
+              search.score(Sim(reparsed).run()) == search.score(shrunkResult);
+  Serial.printf("  reproduces: %s\n", same ? "yes" : "NO");
+  exit(same ? 0 : 1);
+}
+
+void loop() {}
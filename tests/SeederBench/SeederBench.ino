@@ -0,0 +1,282 @@
+// Serves an image over UDP multicast on loopback from an epoll event
+// loop, and measures how fast it can answer many clients at once.
+//
+// "make -C tests benchmarks" runs a load test with simulated clients
+// in the same event loop.  Options:
+//   --clients <n>    number of simulated clients (default 1000)
+//   --inflight <n>   requests outstanding at once across all clients,
+//                    standing in for airtime (default 64)
+//   --seconds <n>    how long to run (default 3)
+//   --serve <image> <sketch name> <version>
+//                    run as a seeder daemon serving the given file until
+//                    killed, with no simulated clients.
+
+#include <Arduino.h>
+#include <LazyMeshOta.h>
+#include <LazyMeshOtaFileImage.h>
+#include <LazyMeshOtaImpl.h>
+#include <LazyMeshOtaUdpTransport.h>
+#include <sys/epoll.h>
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "../QuietListener.h"
+
+void wifi_raw_set_recv_cb(wifi_raw_recv_cb_fn /* rx_fn */) {
+  assert(0 /* this should not be called */);
+}
+
+struct SeederConfig : LazyMeshOtaConfig {
+  static constexpr uint16_t bufferSize = 1024;
+};
+
+static const eth_addr seederAddr = {0x02, 0x4c, 0x4d, 0x4f, 0x00, 0x01};
+static const eth_addr seederBssid = {0x02, 0x4c, 0x4d, 0x4f, 0x00, 0x00};
+
+// Many clients sharing one socket, each repeatedly asking for the next
+// block of the image.  They speak the protocol directly rather than
+// running full LazyMeshOta instances, so only the seeder is measured.
+// Clients take turns, with a limited number of requests outstanding.
+class LoadClients : public LazyMeshOtaBase {
+ public:
+  LoadClients(uint32_t count, uint32_t inflight, uint32_t imageSize, const String& md5)
+      : _transport({0x02, 0x4c, 0x4d, 0x4f, 0xff, 0xff}, seederBssid),
+        _maxInflight(inflight),
+        _imageSize(imageSize),
+        _imageId(imageId(md5)),
+        _offsets(count),
+        _outstanding(count) {
+    for (uint32_t i = 0; i != count; ++i) {
+      _offsets[i] = (i * SeederConfig::bufferSize) % imageSize;
+      _ready.push_back(i);
+    }
+  }
+
+  UdpTransport& transport() { return _transport; }
+
+  // Send requests until the limit of outstanding ones is reached.
+  void pump() {
+    while (_inflight < _maxInflight && !_ready.empty()) {
+      uint32_t i = _ready.front();
+      _ready.pop_front();
+      _outstanding[i] = true;
+      ++_inflight;
+      _request(i);
+    }
+  }
+
+  // Give up on any outstanding requests, and ask again.
+  void retry() {
+    for (uint32_t i = 0; i != _outstanding.size(); ++i) {
+      if (_outstanding[i]) {
+        _outstanding[i] = false;
+        _ready.push_back(i);
+      }
+    }
+    _inflight = 0;
+    pump();
+  }
+
+  void receive() {
+    while (RxPacket* pkt = _transport.receive()) {
+      _receive(pkt);
+      free(pkt);
+    }
+    pump();
+  }
+
+  uint64_t replies = 0;
+  uint64_t bytes = 0;
+
+ private:
+  static eth_addr _clientAddr(uint32_t i) {
+    return {0x02, 0x4c, 0x4d, 0x50, uint8_t(i >> 8), uint8_t(i)};
+  }
+
+  void _request(uint32_t i) {
+    String body = ethToString(seederBssid) + "\n" + _imageId + "\n" + String(_offsets[i]) + "\n";
+    hdr_t hdr;
+    hdr.src = _clientAddr(i);
+    hdr.dest = seederAddr;
+    hdr.bssid = seederBssid;
+    hdr.packetType = PKT_TYPE::REQ;
+    hdr.seq = ++_seq;
+    hdr.len = body.length();
+    uint8_t* frame = (uint8_t*)malloc(sizeof(hdr) + body.length());
+    memcpy(frame, &hdr, sizeof(hdr));
+    memcpy(frame + sizeof(hdr), body.c_str(), body.length());
+    _transport.send(frame, sizeof(hdr) + body.length());
+  }
+
+  void _receive(RxPacket* pkt) {
+    uint32_t len = pkt->rx_ctl.legacy_length;
+    if (len <= sizeof(hdr_t)) {
+      return;
+    }
+    hdr_t hdr;
+    memcpy(&hdr, pkt->data, sizeof(hdr));
+    if (hdr.packetType != PKT_TYPE::REPLY || hdr.dest.addr[3] != 0x50) {
+      return;
+    }
+    uint32_t i = (hdr.dest.addr[4] << 8) | hdr.dest.addr[5];
+    if (i >= _offsets.size() || !_outstanding[i]) {
+      return;
+    }
+    ++replies;
+    bytes += len - sizeof(hdr_t);
+    _offsets[i] = (_offsets[i] + SeederConfig::bufferSize) % _imageSize;
+    _outstanding[i] = false;
+    --_inflight;
+    _ready.push_back(i);
+  }
+
+  UdpTransport _transport;
+  uint32_t _maxInflight;
+  uint32_t _inflight = 0;
+  uint32_t _imageSize;
+  String _imageId;
+  std::vector<uint32_t> _offsets;
+  std::vector<bool> _outstanding;
+  std::deque<uint32_t> _ready;
+  uint16_t _seq = 0;
+};
+
+// Md5 of the served image, which requests identify it by.
+static String imageMd5(LazyMeshOtaImageSource& source) {
+  ManifestHasher hasher;
+  hasher.begin();
+  uint8_t buf[4096];
+  for (uint32_t offset = 0; offset < source.size(); offset += sizeof(buf)) {
+    uint32_t len = std::min<uint32_t>(sizeof(buf), source.size() - offset);
+    source.read(offset, buf, len);
+    hasher.add(buf, len);
+  }
+  uint8_t md5[ManifestHasher::hashSize];
+  hasher.finish(md5);
+  return LazyMeshOtaBase::hashToString(md5);
+}
+
+void setup() {
+  uint32_t clients = 1000;
+  uint32_t inflight = 64;
+  uint32_t seconds = 3;
+  const char* imagePath = nullptr;
+  String sketchName = "SeederBench";
+  int version = 1;
+  for (int i = 1; i < epoxy_argc; ++i) {
+    String arg = epoxy_argv[i];
+    if (arg == "--clients" && i + 1 < epoxy_argc) {
+      clients = atoi(epoxy_argv[++i]);
+    } else if (arg == "--inflight" && i + 1 < epoxy_argc) {
+      inflight = atoi(epoxy_argv[++i]);
+    } else if (arg == "--seconds" && i + 1 < epoxy_argc) {
+      seconds = atoi(epoxy_argv[++i]);
+    } else if (arg == "--serve" && i + 3 < epoxy_argc) {
+      imagePath = epoxy_argv[++i];
+      sketchName = epoxy_argv[++i];
+      version = atoi(epoxy_argv[++i]);
+      clients = 0;
+    } else {
+      Serial.println("Unknown argument " + arg);
+      exit(1);
+    }
+  }
+  if (clients > 0x10000) {
+    Serial.println("At most 65536 clients");
+    exit(1);
+  }
+
+  // The image is served straight from a mapping of the file, so
+  // serving a large one doesn't mean reading it all in first.
+  std::string image;
+  std::unique_ptr<LazyMeshOtaImageSource> source;
+  if (imagePath) {
+    MappedFileImageSource* mapped = new MappedFileImageSource(imagePath);
+    source.reset(mapped);
+    if (!mapped->ok()) {
+      Serial.printf("Unable to read %s\n", imagePath);
+      exit(1);
+    }
+  } else {
+    for (int i = 0; i != 256 * 1024; ++i) {
+      image.push_back(char(i * 7));
+    }
+    source.reset(new RamImageSource((const uint8_t*)image.data(), image.size()));
+  }
+  uint32_t imageSize = source->size();
+
+  FakeUpdateContext updateCtx("", 12345);
+  UdpTransport transport(seederAddr, seederBssid);
+  if (!transport.ok()) {
+    Serial.println("Unable to join multicast group on loopback");
+    exit(1);
+  }
+  QuietListener listener;
+  BasicLazyMeshOta<SeederConfig> lmo;
+  lmo.setListener(&listener);
+  lmo.setTransport(&transport);
+  lmo.setImageSource(source.get());
+  lmo.begin(sketchName, version);
+
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.u32 = 0;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, transport.fd(), &ev);
+
+  LoadClients* load = nullptr;
+  if (clients) {
+    load = new LoadClients(clients, inflight, imageSize, imageMd5(*source));
+    if (!load->transport().ok()) {
+      Serial.println("Unable to join multicast group on loopback");
+      exit(1);
+    }
+    ev.data.u32 = 1;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, load->transport().fd(), &ev);
+    load->pump();
+    Serial.printf("Serving %u bytes to %u clients for %u seconds\n", imageSize, clients,
+                  seconds);
+  } else {
+    Serial.printf("Serving %s (%u bytes) as %s version %d\n", imagePath, imageSize,
+                  sketchName.c_str(), version);
+  }
+
+  uint32_t start = millis();
+  uint64_t lastReplies = 0;
+  uint32_t lastProgress = start;
+  while (!load || millis() - start < seconds * 1000) {
+    epoll_event events[2];
+    int n = epoll_wait(epfd, events, 2, 10 /* ms */);
+    for (int i = 0; i < n; ++i) {
+      if (events[i].data.u32 == 0) {
+        while (RxPacket* pkt = transport.receive()) {
+          lmo.onReceiveRawFrame(pkt);
+        }
+      } else {
+        load->receive();
+      }
+    }
+    lmo.loop();
+    if (load && load->replies != lastReplies) {
+      lastReplies = load->replies;
+      lastProgress = millis();
+    } else if (load && millis() - lastProgress > 100) {
+      // Requests or replies dropped by a full socket buffer would
+      // otherwise stall everything.
+      load->retry();
+      lastProgress = millis();
+    }
+  }
+
+  uint32_t elapsed = millis() - start;
+  Serial.printf("%llu replies, %.0f replies/s, %.2f MB/s, %u send drops, %u errors\n",
+                (unsigned long long)load->replies, load->replies * 1000.0 / elapsed,
+                load->bytes * 1000.0 / elapsed / 1e6,
+                transport.sendDrops + load->transport().sendDrops, listener.errors);
+  delete load;
+  exit(0);
+}
+
+void loop() {}